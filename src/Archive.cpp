@@ -0,0 +1,200 @@
+#include "Archive.h"
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <memory>
+
+static const char *kTelemetryNames[6] = {"px", "py", "psi", "speed", "steering_angle", "throttle"};
+static const char *kStateNames[6] = {"x", "y", "psi", "v", "cte", "epsi"};
+static const int kNumIntColumns = 5;
+// A block is written once it is this old even if it isn't full.
+static const int64_t kMaxBlockAgeNs = 60 * 1000000000LL;
+
+CycleRecord::CycleRecord()
+    : time_ns(0), session(0), ok(0), iterations(0), horizon(0), cost(0), steer(0), throttle(0) {
+  fill(telemetry, telemetry + 6, 0.0);
+  fill(state, state + 6, 0.0);
+  fill(coeffs, coeffs + 4, 0.0);
+  fill(plan_x, plan_x + kArchivePlanPoints, numeric_limits<double>::quiet_NaN());
+  fill(plan_y, plan_y + kArchivePlanPoints, numeric_limits<double>::quiet_NaN());
+  fill(stage_seconds, stage_seconds + kNumStages, 0.0);
+}
+
+vector<ArchiveColumn> ArchiveWriter::Columns() {
+  vector<ArchiveColumn> columns;
+  const char *int_names[kNumIntColumns] = {"time_ns", "session", "ok", "iterations", "horizon"};
+  for (int i = 0; i < kNumIntColumns; i++) {
+    columns.push_back({int_names[i], kArchiveInt});
+  }
+  columns.push_back({"cost", kArchiveDouble});
+  for (int i = 0; i < 6; i++) {
+    columns.push_back({string("telemetry_") + kTelemetryNames[i], kArchiveDouble});
+  }
+  for (int i = 0; i < 6; i++) {
+    columns.push_back({string("state_") + kStateNames[i], kArchiveDouble});
+  }
+  for (int i = 0; i < 4; i++) {
+    columns.push_back({"coeff" + to_string(i), kArchiveDouble});
+  }
+  columns.push_back({"steer", kArchiveDouble});
+  columns.push_back({"throttle", kArchiveDouble});
+  for (int i = 0; i < kArchivePlanPoints; i++) {
+    columns.push_back({"plan_x" + to_string(i), kArchiveDouble});
+  }
+  for (int i = 0; i < kArchivePlanPoints; i++) {
+    columns.push_back({"plan_y" + to_string(i), kArchiveDouble});
+  }
+  for (int s = 0; s < kNumStages; s++) {
+    columns.push_back({string("stage_") + StageName(static_cast<Stage>(s)) + "_seconds", kArchiveDouble});
+  }
+  return columns;
+}
+
+ArchiveWriter::ArchiveWriter(const string &path) : file(fopen(path.c_str(), "wb")), offset(0), block_begin_ns(0) {
+  if (file == nullptr) {
+    return;
+  }
+  vector<ArchiveColumn> columns = Columns();
+  string header = "MPCA";
+  uint32_t version = kArchiveVersion;
+  uint32_t n = columns.size();
+  header.append(reinterpret_cast<const char *>(&version), sizeof(version));
+  header.append(reinterpret_cast<const char *>(&n), sizeof(n));
+  for (const ArchiveColumn &column : columns) {
+    uint8_t type = column.type;
+    uint16_t length = column.name.size();
+    header.append(reinterpret_cast<const char *>(&type), sizeof(type));
+    header.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    header += column.name;
+    if (column.type == kArchiveInt) {
+      ints.push_back(vector<int64_t>());
+    } else {
+      doubles.push_back(vector<double>());
+    }
+  }
+  fwrite(header.data(), 1, header.size(), file);
+  offset = header.size();
+}
+
+ArchiveWriter::~ArchiveWriter() {
+  if (file == nullptr) {
+    return;
+  }
+  lock_guard<mutex> guard(lock);
+  WriteBlock();
+  string index = "IDX1";
+  uint32_t count = block_offsets.size();
+  index.append(reinterpret_cast<const char *>(&count), sizeof(count));
+  for (uint64_t block_offset : block_offsets) {
+    index.append(reinterpret_cast<const char *>(&block_offset), sizeof(block_offset));
+  }
+  index.append(reinterpret_cast<const char *>(&offset), sizeof(offset));
+  index += "MPCE";
+  fwrite(index.data(), 1, index.size(), file);
+  fclose(file);
+}
+
+void ArchiveWriter::Append(const CycleRecord &r) {
+  if (file == nullptr) {
+    return;
+  }
+  lock_guard<mutex> guard(lock);
+  if (ints[0].empty()) {
+    block_begin_ns = r.time_ns;
+  }
+  const int64_t int_values[kNumIntColumns] = {r.time_ns, r.session, r.ok, r.iterations, r.horizon};
+  for (int i = 0; i < kNumIntColumns; i++) {
+    ints[i].push_back(int_values[i]);
+  }
+  // In the order of Columns().
+  size_t c = 0;
+  doubles[c++].push_back(r.cost);
+  for (int i = 0; i < 6; i++) {
+    doubles[c++].push_back(r.telemetry[i]);
+  }
+  for (int i = 0; i < 6; i++) {
+    doubles[c++].push_back(r.state[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    doubles[c++].push_back(r.coeffs[i]);
+  }
+  doubles[c++].push_back(r.steer);
+  doubles[c++].push_back(r.throttle);
+  for (int i = 0; i < kArchivePlanPoints; i++) {
+    doubles[c++].push_back(r.plan_x[i]);
+  }
+  for (int i = 0; i < kArchivePlanPoints; i++) {
+    doubles[c++].push_back(r.plan_y[i]);
+  }
+  for (int s = 0; s < kNumStages; s++) {
+    doubles[c++].push_back(r.stage_seconds[s]);
+  }
+
+  if (ints[0].size() >= kArchiveBlockRows || r.time_ns - block_begin_ns >= kMaxBlockAgeNs) {
+    WriteBlock();
+  }
+}
+
+void ArchiveWriter::WriteBlock() {
+  uint32_t rows = ints[0].size();
+  if (rows == 0) {
+    return;
+  }
+  string header = "BLK1", body;
+  header.append(reinterpret_cast<const char *>(&rows), sizeof(rows));
+  auto describe = [&header, &body](size_t begin, double min, double max) {
+    uint32_t bytes = body.size() - begin;
+    header.append(reinterpret_cast<const char *>(&bytes), sizeof(bytes));
+    header.append(reinterpret_cast<const char *>(&min), sizeof(min));
+    header.append(reinterpret_cast<const char *>(&max), sizeof(max));
+  };
+  for (vector<int64_t> &column : ints) {
+    size_t begin = body.size();
+    EncodeInts(column, &body);
+    double min = column[0], max = column[0];
+    for (int64_t v : column) {
+      min = (v < min) ? v : min;
+      max = (v > max) ? v : max;
+    }
+    describe(begin, min, max);
+    column.clear();
+  }
+  for (vector<double> &column : doubles) {
+    size_t begin = body.size();
+    EncodeDoubles(column, &body);
+    // NaN (no value) is left out of the range; a column without values has a NaN range.
+    double min = numeric_limits<double>::quiet_NaN(), max = min;
+    for (double v : column) {
+      min = (v < min || isnan(min)) ? v : min;
+      max = (v > max || isnan(max)) ? v : max;
+    }
+    describe(begin, min, max);
+    column.clear();
+  }
+  block_offsets.push_back(offset);
+  fwrite(header.data(), 1, header.size(), file);
+  fwrite(body.data(), 1, body.size(), file);
+  fflush(file);
+  offset += header.size() + body.size();
+}
+
+static unique_ptr<ArchiveWriter> openArchive() {
+  const char *path = getenv("MPC_ARCHIVE");
+  if (path == nullptr) {
+    return nullptr;
+  }
+  unique_ptr<ArchiveWriter> archive(new ArchiveWriter(path));
+  if (!archive->Ok()) {
+    cerr << "Can't write the archive " << path << endl;
+    return nullptr;
+  }
+  cout << "Archiving cycles to " << path << endl;
+  return archive;
+}
+
+ArchiveWriter *GlobalArchive() {
+  static unique_ptr<ArchiveWriter> archive = openArchive();
+  return archive.get();
+}
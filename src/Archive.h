@@ -0,0 +1,77 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "ArchiveFormat.h"
+#include "Stage.h"
+
+using namespace std;
+
+// Points of the planned trajectory archived per cycle; the rest of the columns are NaN for shorter horizons.
+const int kArchivePlanPoints = 16;
+
+// Everything about one control cycle worth analysing later.
+struct CycleRecord {
+  int64_t time_ns;  // wall clock, since the epoch
+  int64_t session;
+  // Solver statistics.
+  int64_t ok;
+  int64_t iterations;
+  int64_t horizon;
+  double cost;
+  // Telemetry as received: px, py, psi, speed, steering_angle, throttle.
+  double telemetry[6];
+  // Initial state of the solve (car frame, after the latency prediction): x, y, psi, v, cte, epsi.
+  double state[6];
+  double coeffs[4];
+  // Actuations sent back.
+  double steer;
+  double throttle;
+  // Planned trajectory in the car frame.
+  double plan_x[kArchivePlanPoints];
+  double plan_y[kArchivePlanPoints];
+  // Wall time of every stage of the cycle (s).
+  double stage_seconds[kNumStages];
+
+  CycleRecord();
+};
+
+// Appends cycles to an archive file (format in ArchiveFormat.h). Rows are buffered per column and written a block
+// at a time, when the block is full or a minute old, so a killed controller loses at most the last minute.
+class ArchiveWriter {
+ public:
+  // Check Ok() afterwards.
+  explicit ArchiveWriter(const string &path);
+  // Writes the last block and the index.
+  ~ArchiveWriter();
+
+  bool Ok() const { return file != nullptr; }
+
+  void Append(const CycleRecord &record);
+
+  // The column names, in file order.
+  static vector<ArchiveColumn> Columns();
+
+ private:
+  mutex lock;
+  FILE *file;
+  uint64_t offset;
+  vector<uint64_t> block_offsets;
+  int64_t block_begin_ns;
+  vector<vector<int64_t>> ints;
+  vector<vector<double>> doubles;
+
+  void WriteBlock();
+
+  ArchiveWriter(const ArchiveWriter &);
+  ArchiveWriter &operator=(const ArchiveWriter &);
+};
+
+// The archive set with MPC_ARCHIVE=<path>, or nullptr.
+ArchiveWriter *GlobalArchive();
+
+#endif /* ARCHIVE_H */
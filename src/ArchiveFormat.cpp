@@ -0,0 +1,344 @@
+#include "ArchiveFormat.h"
+#include <string.h>
+
+namespace {
+
+uint64_t mask(int bits) { return bits >= 64 ? ~0ULL : (1ULL << bits) - 1; }
+
+// Most significant bit first.
+class BitWriter {
+ public:
+  explicit BitWriter(string *out) : out(out), acc(0), n(0) {}
+
+  void Write(uint64_t value, int bits) {
+    if (bits > 32) {
+      Write(value >> 32, bits - 32);
+      bits = 32;
+    }
+    acc = (acc << bits) | (value & mask(bits));
+    n += bits;
+    while (n >= 8) {
+      out->push_back(static_cast<char>(acc >> (n - 8)));
+      n -= 8;
+    }
+    acc &= mask(n);
+  }
+
+  void Finish() {
+    if (n > 0) {
+      out->push_back(static_cast<char>(acc << (8 - n)));
+    }
+    acc = 0;
+    n = 0;
+  }
+
+ private:
+  string *out;
+  uint64_t acc;
+  int n;
+};
+
+class BitReader {
+ public:
+  BitReader(const char *p, const char *end) : p(p), end(end), acc(0), n(0), ok(true) {}
+
+  uint64_t Read(int bits) {
+    if (bits > 32) {
+      uint64_t high = Read(bits - 32);
+      return (high << 32) | Read(32);
+    }
+    while (n < bits) {
+      if (p == end) {
+        ok = false;
+        return 0;
+      }
+      acc = (acc << 8) | static_cast<uint8_t>(*p++);
+      n += 8;
+    }
+    uint64_t value = (acc >> (n - bits)) & mask(bits);
+    n -= bits;
+    acc &= mask(n);
+    return value;
+  }
+
+  const char *p;
+  const char *end;
+  uint64_t acc;
+  int n;
+  bool ok;
+};
+
+void putVarint(uint64_t v, string *out) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+bool getVarint(const char **p, const char *end, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*p)++);
+    *v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t zigzag(int64_t v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+
+int64_t unzigzag(uint64_t v) { return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1); }
+
+uint64_t bitsOf(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+double doubleOf(uint64_t bits) {
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+template <typename T>
+bool get(const char **p, const char *end, T *value) {
+  if (static_cast<size_t>(end - *p) < sizeof(T)) {
+    return false;
+  }
+  memcpy(value, *p, sizeof(T));
+  *p += sizeof(T);
+  return true;
+}
+
+}  // namespace
+
+void EncodeInts(const vector<int64_t> &values, string *out) {
+  // Unsigned arithmetic, so wrapping around is defined.
+  uint64_t prev = 0, prev_delta = 0;
+  for (size_t i = 0; i < values.size(); i++) {
+    uint64_t v = static_cast<uint64_t>(values[i]);
+    uint64_t delta = v - prev;
+    if (i == 0) {
+      putVarint(zigzag(values[0]), out);
+    } else if (i == 1) {
+      putVarint(zigzag(static_cast<int64_t>(delta)), out);
+    } else {
+      putVarint(zigzag(static_cast<int64_t>(delta - prev_delta)), out);
+    }
+    prev = v;
+    prev_delta = delta;
+  }
+}
+
+bool DecodeInts(const char *data, size_t size, size_t rows, vector<int64_t> *values) {
+  const char *p = data, *end = data + size;
+  values->resize(rows);
+  uint64_t prev = 0, delta = 0;
+  for (size_t i = 0; i < rows; i++) {
+    uint64_t v;
+    if (!getVarint(&p, end, &v)) {
+      return false;
+    }
+    int64_t d = unzigzag(v);
+    if (i == 0) {
+      prev = static_cast<uint64_t>(d);
+    } else if (i == 1) {
+      delta = static_cast<uint64_t>(d);
+      prev += delta;
+    } else {
+      delta += static_cast<uint64_t>(d);
+      prev += delta;
+    }
+    (*values)[i] = static_cast<int64_t>(prev);
+  }
+  return true;
+}
+
+// Every value is XORed with the previous one. Identical values cost a 0 bit. Otherwise the meaningful bits of the
+// XOR are stored, in the window (leading and trailing zeros) of the previous value if they fit in it (10 + bits),
+// with a new window otherwise (11 + 5 bits leading zeros + 6 bits length + bits).
+void EncodeDoubles(const vector<double> &values, string *out) {
+  if (values.empty()) {
+    return;
+  }
+  BitWriter bits(out);
+  uint64_t prev = bitsOf(values[0]);
+  bits.Write(prev, 64);
+  int window_leading = -1, window_trailing = 0;
+  for (size_t i = 1; i < values.size(); i++) {
+    uint64_t v = bitsOf(values[i]);
+    uint64_t x = v ^ prev;
+    prev = v;
+    if (x == 0) {
+      bits.Write(0, 1);
+      continue;
+    }
+    int leading = __builtin_clzll(x);
+    int trailing = __builtin_ctzll(x);
+    if (leading > 31) {
+      leading = 31;
+    }
+    if (window_leading >= 0 && leading >= window_leading && trailing >= window_trailing) {
+      bits.Write(2, 2);
+      bits.Write(x >> window_trailing, 64 - window_leading - window_trailing);
+    } else {
+      int length = 64 - leading - trailing;
+      bits.Write(3, 2);
+      bits.Write(leading, 5);
+      bits.Write(length - 1, 6);
+      bits.Write(x >> trailing, length);
+      window_leading = leading;
+      window_trailing = trailing;
+    }
+  }
+  bits.Finish();
+}
+
+bool DecodeDoubles(const char *data, size_t size, size_t rows, vector<double> *values) {
+  values->resize(rows);
+  if (rows == 0) {
+    return true;
+  }
+  BitReader bits(data, data + size);
+  uint64_t prev = bits.Read(64);
+  (*values)[0] = doubleOf(prev);
+  int window_leading = 0, window_trailing = 0;
+  for (size_t i = 1; i < rows && bits.ok; i++) {
+    if (bits.Read(1) == 1) {
+      if (bits.Read(1) == 1) {
+        window_leading = static_cast<int>(bits.Read(5));
+        int length = static_cast<int>(bits.Read(6)) + 1;
+        window_trailing = 64 - window_leading - length;
+        if (window_trailing < 0) {
+          return false;
+        }
+      }
+      prev ^= bits.Read(64 - window_leading - window_trailing) << window_trailing;
+    }
+    (*values)[i] = doubleOf(prev);
+  }
+  return bits.ok;
+}
+
+bool ArchiveReader::Open(const char *data, size_t size) {
+  end = data + size;
+  columns.clear();
+  blocks.clear();
+  indexed = false;
+
+  const char *p = data;
+  uint32_t version, n;
+  if (size < 4 || memcmp(p, "MPCA", 4) != 0) {
+    return false;
+  }
+  p += 4;
+  if (!get(&p, end, &version) || version != kArchiveVersion || !get(&p, end, &n)) {
+    return false;
+  }
+  for (uint32_t c = 0; c < n; c++) {
+    uint8_t type;
+    uint16_t length;
+    if (!get(&p, end, &type) || !get(&p, end, &length) || static_cast<size_t>(end - p) < length) {
+      return false;
+    }
+    ArchiveColumn column = {string(p, length), static_cast<ArchiveColumnType>(type)};
+    columns.push_back(column);
+    p += length;
+  }
+
+  // The index, if the writer got to write it.
+  uint64_t index_offset;
+  const char *tail = end - 12;
+  if (size >= 12 + static_cast<size_t>(p - data) && memcmp(end - 4, "MPCE", 4) == 0 &&
+      get(&tail, end, &index_offset) && index_offset < size) {
+    const char *q = data + index_offset;
+    uint32_t count;
+    if (static_cast<size_t>(end - q) >= 4 && memcmp(q, "IDX1", 4) == 0) {
+      q += 4;
+      indexed = get(&q, end, &count);
+      for (uint32_t b = 0; indexed && b < count; b++) {
+        uint64_t offset;
+        const char *next;
+        indexed = get(&q, end, &offset) && offset < size && ReadBlock(data + offset, &next);
+      }
+      if (indexed) {
+        return true;
+      }
+      blocks.clear();
+    }
+  }
+
+  // No (valid) index: walk the blocks.
+  const char *next;
+  while (p < end && ReadBlock(p, &next)) {
+    p = next;
+  }
+  return true;
+}
+
+bool ArchiveReader::ReadBlock(const char *p, const char **next) {
+  Block block;
+  uint32_t rows;
+  if (end - p < 4 || memcmp(p, "BLK1", 4) != 0) {
+    return false;
+  }
+  p += 4;
+  if (!get(&p, end, &rows)) {
+    return false;
+  }
+  block.rows = rows;
+  for (size_t c = 0; c < columns.size(); c++) {
+    uint32_t bytes;
+    double min, max;
+    if (!get(&p, end, &bytes) || !get(&p, end, &min) || !get(&p, end, &max)) {
+      return false;
+    }
+    block.bytes.push_back(bytes);
+    block.min.push_back(min);
+    block.max.push_back(max);
+  }
+  for (size_t c = 0; c < columns.size(); c++) {
+    if (static_cast<size_t>(end - p) < block.bytes[c]) {
+      return false;
+    }
+    block.data.push_back(p);
+    p += block.bytes[c];
+  }
+  blocks.push_back(block);
+  *next = p;
+  return true;
+}
+
+int ArchiveReader::ColumnIndex(const string &name) const {
+  for (size_t c = 0; c < columns.size(); c++) {
+    if (columns[c].name == name) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+bool ArchiveReader::Ints(size_t block, int column, vector<int64_t> *values) const {
+  const Block &b = blocks[block];
+  if (columns[column].type != kArchiveInt) {
+    return false;
+  }
+  return DecodeInts(b.data[column], b.bytes[column], b.rows, values);
+}
+
+bool ArchiveReader::Doubles(size_t block, int column, vector<double> *values) const {
+  const Block &b = blocks[block];
+  if (columns[column].type == kArchiveDouble) {
+    return DecodeDoubles(b.data[column], b.bytes[column], b.rows, values);
+  }
+  vector<int64_t> ints;
+  if (!DecodeInts(b.data[column], b.bytes[column], b.rows, &ints)) {
+    return false;
+  }
+  values->assign(ints.begin(), ints.end());
+  return true;
+}
@@ -0,0 +1,73 @@
+#ifndef ARCHIVE_FORMAT_H
+#define ARCHIVE_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The on-disk format of cycle archives (see Archive.h for the writer, mpc_query.cpp for the reader tool).
+//
+// An archive is a header naming the columns, then blocks of up to kArchiveBlockRows rows, then an index of the
+// blocks. Within a block every column is stored separately: integer columns (timestamps, counts) as zigzag varints of
+// their delta-of-deltas, double columns with the XOR encoding of Gorilla (Pelkonen et al., VLDB 2015), which stores
+// a value equal to the previous one in a single bit and a slowly changing one in a few bits. A block header carries
+// the encoded length and the min/max of every column, so a query reads only the columns it needs and skips blocks
+// that can't match. If the writer was killed before writing the index, the reader rebuilds it by hopping from block
+// header to block header. Integers are stored in host byte order.
+//
+//   header:  "MPCA" u32 version, u32 columns, per column { u8 type, u16 name length, name }
+//   block:   "BLK1" u32 rows, per column { u32 bytes, f64 min, f64 max }, then the encoded columns
+//   index:   "IDX1" u32 blocks, per block u64 offset, then u64 offset of the index and "MPCE"
+
+enum ArchiveColumnType { kArchiveInt = 0, kArchiveDouble = 1 };
+
+const uint32_t kArchiveVersion = 1;
+const size_t kArchiveBlockRows = 4096;
+
+struct ArchiveColumn {
+  string name;
+  ArchiveColumnType type;
+};
+
+// Column codecs, appending to `out`. The decoders return false on truncated or corrupt input.
+void EncodeInts(const vector<int64_t> &values, string *out);
+void EncodeDoubles(const vector<double> &values, string *out);
+bool DecodeInts(const char *data, size_t size, size_t rows, vector<int64_t> *values);
+bool DecodeDoubles(const char *data, size_t size, size_t rows, vector<double> *values);
+
+// Read-only view of an archive in memory (typically mmapped); it must outlive the reader.
+class ArchiveReader {
+ public:
+  struct Block {
+    size_t rows;
+    vector<const char *> data;  // per column
+    vector<uint32_t> bytes;
+    vector<double> min;
+    vector<double> max;
+  };
+
+  // Returns false if `data` doesn't start like an archive. A truncated last block is ignored.
+  bool Open(const char *data, size_t size);
+
+  // -1 if there is no such column.
+  int ColumnIndex(const string &name) const;
+
+  // Decode one column of one block; integer columns can be read as doubles too.
+  bool Ints(size_t block, int column, vector<int64_t> *values) const;
+  bool Doubles(size_t block, int column, vector<double> *values) const;
+
+  vector<ArchiveColumn> columns;
+  vector<Block> blocks;
+  // Whether the index was there, i.e. the writer was closed properly.
+  bool indexed;
+
+ private:
+  const char *end;
+
+  bool ReadBlock(const char *p, const char **next);
+};
+
+#endif /* ARCHIVE_FORMAT_H */
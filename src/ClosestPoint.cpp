@@ -0,0 +1,95 @@
+#include "ClosestPoint.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "Eigen-3.3/unsupported/Eigen/Polynomials"
+
+using namespace std;
+
+// Newton steps before a point counts as not converged, and the residual |g| it has to reach (m).
+static const int kMaxIterations = 6;
+static const double kTolerance = 1e-9;
+// A converged Newton step may still have found a local minimum of the distance, but only for points farther from
+// the curve than its radius of curvature. Points farther than this are always checked against all the roots.
+static const double kTrustDistance = 5;
+
+// Closest point by solving the quintic g(x) = 0 directly.
+static double closestByRoots(const Eigen::VectorXd &c, double px, double py) {
+  // (f - py) f' + x - px, from the coefficients of f - py and of f'.
+  double a[4] = {c[0] - py, c[1], c[2], c[3]};
+  double b[3] = {c[1], 2 * c[2], 3 * c[3]};
+  Eigen::VectorXd g = Eigen::VectorXd::Zero(6);
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 3; j++) {
+      g[i + j] += a[i] * b[j];
+    }
+  }
+  g[0] -= px;
+  g[1] += 1;
+  int degree = 5;
+  while (degree > 1 && g[degree] == 0) {
+    degree--;
+  }
+  Eigen::PolynomialSolver<double, Eigen::Dynamic> solver(g.head(degree + 1));
+  vector<double> roots;
+  solver.realRoots(roots, 1e-6);
+  double best_x = px, best = -1;
+  for (double x : roots) {
+    double f = c[0] + c[1] * x + c[2] * x * x + c[3] * x * x * x;
+    double d = (x - px) * (x - px) + (f - py) * (f - py);
+    if (best < 0 || d < best) {
+      best = d;
+      best_x = x;
+    }
+  }
+  return best_x;
+}
+
+void ClosestPoints(const Eigen::VectorXd &c, const double *px, const double *py, size_t n, double *xc, double *cte) {
+  Eigen::Map<const Eigen::ArrayXd> X(px, n), Y(py, n);
+  Eigen::ArrayXd x = X;
+  Eigen::ArrayXd f, df, ddf, g, dg;
+  for (int k = 0; k < kMaxIterations; k++) {
+    f = c[0] + x * (c[1] + x * (c[2] + x * c[3]));
+    df = c[1] + x * (2 * c[2] + x * 3 * c[3]);
+    ddf = 2 * c[2] + x * 6 * c[3];
+    g = (x - X) + (f - Y) * df;
+    dg = 1 + df.square() + (f - Y) * ddf;
+    if ((g.abs() < kTolerance).all()) {
+      break;
+    }
+    x -= g / dg;
+  }
+  f = c[0] + x * (c[1] + x * (c[2] + x * c[3]));
+  df = c[1] + x * (2 * c[2] + x * 3 * c[3]);
+  ddf = 2 * c[2] + x * 6 * c[3];
+  g = (x - X) + (f - Y) * df;
+  dg = 1 + df.square() + (f - Y) * ddf;
+
+  for (size_t i = 0; i < n; i++) {
+    double xi = x[i];
+    // Not converged, converged to a maximum of the distance, or possibly to a local minimum.
+    double distance = sqrt((x[i] - px[i]) * (x[i] - px[i]) + (f[i] - py[i]) * (f[i] - py[i]));
+    if (!(fabs(g[i]) < 1e-6) || !(dg[i] > 0) || !(distance < kTrustDistance)) {
+      xi = closestByRoots(c, px[i], py[i]);
+    }
+    double fi = c[0] + xi * (c[1] + xi * (c[2] + xi * c[3]));
+    double dfi = c[1] + xi * (2 * c[2] + xi * 3 * c[3]);
+    if (xc != nullptr) {
+      xc[i] = xi;
+    }
+    cte[i] = (fi - py[i] - (xi - px[i]) * dfi) / sqrt(1 + dfi * dfi);
+  }
+}
+
+double CrossTrackError(const Eigen::VectorXd &coeffs, double px, double py) {
+  double cte;
+  ClosestPoints(coeffs, &px, &py, 1, nullptr, &cte);
+  return cte;
+}
+
+bool ExactCrossTrack() {
+  static const bool exact = getenv("MPC_CTE") == nullptr || strcmp(getenv("MPC_CTE"), "vertical") != 0;
+  return exact;
+}
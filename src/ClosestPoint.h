@@ -0,0 +1,52 @@
+#ifndef CLOSEST_POINT_H
+#define CLOSEST_POINT_H
+
+#include <stddef.h>
+#include "Eigen-3.3/Eigen/Core"
+
+// Cross-track error as the signed distance from a point to the fitted cubic y = f(x), positive when the path is to
+// the left of the point (like the vertical offset f(px) - py it replaces, which it matches on straights).
+//
+// The closest point xc is where the derivative of the squared distance vanishes:
+//   g(x) = (x - px) + (f(x) - py) f'(x) = 0,
+// a quintic. Starting from x = px, Newton's method converges in two or three steps for points within a fraction of
+// the curve's radius of it, which is where the car is. The signed distance is then
+//   cte = (f(xc) - py - (xc - px) f'(xc)) / sqrt(1 + f'(xc)^2).
+
+// Number of Newton steps taken by CrossTrackErrorNewton.
+const int kClosestPointIterations = 3;
+
+// For any scalar type, in particular CppAD's AD<double> inside FG_eval: a fixed number of Newton steps without
+// branches, so the operation sequence can be taped once. The coefficients are anything indexable, doubles (an
+// Eigen::VectorXd) or scalars of the same type.
+template <typename Coeffs, typename Scalar>
+Scalar CrossTrackErrorNewton(const Coeffs &coeffs, const Scalar &px, const Scalar &py) {
+  Scalar x = px;
+  for (int k = 0; k < kClosestPointIterations; k++) {
+    Scalar f = coeffs[0] + coeffs[1] * x + coeffs[2] * x * x + coeffs[3] * x * x * x;
+    Scalar df = coeffs[1] + 2 * coeffs[2] * x + 3 * coeffs[3] * x * x;
+    Scalar ddf = 2 * coeffs[2] + 6 * coeffs[3] * x;
+    Scalar g = (x - px) + (f - py) * df;
+    Scalar dg = 1.0 + df * df + (f - py) * ddf;
+    x = x - g / dg;
+  }
+  Scalar f = coeffs[0] + coeffs[1] * x + coeffs[2] * x * x + coeffs[3] * x * x * x;
+  Scalar df = coeffs[1] + 2 * coeffs[2] * x + 3 * coeffs[3] * x * x;
+  return (f - py - (x - px) * df) / sqrt(1.0 + df * df);
+}
+
+// The same for n points at once, vectorized across the points. Points where Newton doesn't converge (far from the
+// curve, where g has several roots) are solved exactly: the real roots of the quintic come from the polynomial solver
+// of Eigen's unsupported modules and the closest one wins. Writes the closest points to xc (if not null) and the
+// cross-track errors to cte.
+void ClosestPoints(const Eigen::VectorXd &coeffs, const double *px, const double *py, size_t n, double *xc,
+                   double *cte);
+
+// Cross-track error of a single point, through ClosestPoints.
+double CrossTrackError(const Eigen::VectorXd &coeffs, double px, double py);
+
+// Whether the cross-track error is the exact distance (the default) or the vertical offset f(px) - py, propagated
+// through the horizon with the kinematic model as before (MPC_CTE=vertical).
+bool ExactCrossTrack();
+
+#endif /* CLOSEST_POINT_H */
@@ -0,0 +1,58 @@
+#include "EventTrigger.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string>
+#include "Metrics.h"
+
+namespace {
+
+double envOr(const char *name, double fallback) {
+  const char *value = getenv(name);
+  return value != nullptr ? atof(value) : fallback;
+}
+
+EventTrigger::Mode modeFromEnv() {
+  const char *mode = getenv("MPC_EVENT_TRIGGER");
+  if (mode != nullptr && string(mode) == "on") {
+    return EventTrigger::ON;
+  } else if (mode != nullptr && string(mode) == "shadow") {
+    return EventTrigger::SHADOW;
+  }
+  return EventTrigger::OFF;
+}
+
+// Largest difference between the overlapping parts of two reference profiles.
+double maxChange(const vector<double> &a, const vector<double> &b) {
+  double change = 0;
+  for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+    change = fmax(change, fabs(a[i] - b[i]));
+  }
+  return change;
+}
+
+}  // namespace
+
+EventTrigger::EventTrigger() : mode(modeFromEnv()), reused_in_row(0) {
+  thresholds.cte = envOr("MPC_EVENT_MAX_CTE", 0.05);
+  thresholds.epsi = envOr("MPC_EVENT_MAX_EPSI", 0.01);
+  thresholds.speed = envOr("MPC_EVENT_MAX_SPEED", 0.5);
+  thresholds.steer = envOr("MPC_EVENT_MAX_STEER", 0.01);
+  thresholds.max_reuse = static_cast<size_t>(envOr("MPC_EVENT_MAX_REUSE", 3));
+}
+
+bool EventTrigger::Reusable(const double predicted[3], const double measured[3], const vector<double> &delta_ff,
+                            const vector<double> &planned_delta_ff, const vector<double> &v_ref,
+                            const vector<double> &planned_v_ref) const {
+  return reused_in_row < thresholds.max_reuse && fabs(predicted[0] - measured[0]) < thresholds.speed &&
+         fabs(predicted[1] - measured[1]) < thresholds.cte && fabs(predicted[2] - measured[2]) < thresholds.epsi &&
+         maxChange(delta_ff, planned_delta_ff) < thresholds.steer && maxChange(v_ref, planned_v_ref) < thresholds.speed;
+}
+
+void EventTrigger::Record(Decision decision, double cte) {
+  static const char *const kLabels[] = {"{decision=\"solve\"}", "{decision=\"reuse\"}", "{decision=\"cache\"}"};
+  // A cached plan is a fresh one, like a solve.
+  reused_in_row = decision == REUSE ? reused_in_row + 1 : 0;
+  const string label = kLabels[decision];
+  GlobalMetrics().Add("mpc_event_trigger_cycles_total" + label);
+  GlobalMetrics().Observe("mpc_event_trigger_abs_cte" + label, fabs(cte));
+}
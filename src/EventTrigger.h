@@ -0,0 +1,53 @@
+#ifndef EVENT_TRIGGER_H
+#define EVENT_TRIGGER_H
+
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+// How far the measured state and the references may drift from what the last plan assumed before it is solved again.
+struct EventThresholds {
+  double cte;    // m
+  double epsi;   // rad
+  double speed;  // mph, for the speed and for its reference
+  double steer;  // feed-forward steering, in units of delta
+  // Cycles in a row the plan may be reused; the shifted plan runs out and open loop errors add up.
+  size_t max_reuse;
+};
+
+// Event-triggered MPC. On straights most cycles reproduce the last plan shifted by one step, so with
+// MPC_EVENT_TRIGGER=on a cycle whose measured state is close to the one the last plan predicted for it, and whose
+// references (feed-forward steering, reference speeds) match the ones the plan was solved for, applies the shifted
+// plan instead of solving. MPC_EVENT_TRIGGER=shadow always solves but reports how far the reused actuations would
+// have been off. The thresholds come from MPC_EVENT_MAX_CTE, MPC_EVENT_MAX_EPSI, MPC_EVENT_MAX_SPEED,
+// MPC_EVENT_MAX_STEER and MPC_EVENT_MAX_REUSE.
+class EventTrigger {
+ public:
+  enum Mode { OFF, ON, SHADOW };
+
+  EventTrigger();
+
+  // Whether the plan may be reused. `predicted` and `measured` are (v, cte, epsi) of the new cycle as the plan
+  // predicted it and as measured. The planned references are the ones of the plan, already shifted by one stage like
+  // the plan itself.
+  bool Reusable(const double predicted[3], const double measured[3], const vector<double> &delta_ff,
+                const vector<double> &planned_delta_ff, const vector<double> &v_ref,
+                const vector<double> &planned_v_ref) const;
+
+  // What a cycle did: solved, reused the shifted plan, or applied a plan from the solution cache.
+  enum Decision { SOLVE, REUSE, CACHE };
+
+  // Called for every cycle with what was done and the measured cross-track error, to compare tracking with and
+  // without reuse.
+  void Record(Decision decision, double cte);
+
+  Mode mode;
+  EventThresholds thresholds;
+
+ private:
+  // Cycles in a row the plan was reused.
+  size_t reused_in_row;
+};
+
+#endif /* EVENT_TRIGGER_H */
@@ -0,0 +1,217 @@
+#include "Governor.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include "Metrics.h"
+
+// From the full problem down to the cheapest one we still trust to keep the car on the track.
+// Tier 0 is what the controller always used: Ipopt's default iteration cap and tolerance and a 0.5 s CPU cap.
+static const SolverEffort kTiers[] = {
+    {10, 3000, 1e-8, 1e-6, 15, 0.5},
+    {10, 100, 1e-6, 1e-4, 10, 0.25},
+    {8, 50, 1e-4, 1e-3, 5, 0.1},
+    {6, 25, 1e-3, 1e-2, 3, 0.05},
+};
+
+// Shortest horizon a tier may have.
+static const size_t kMinHorizon = 3;
+
+// Pressure levels above which we step down, and below which we are allowed to step up again.
+static const double kHighPsi = 20, kLowPsi = 5;
+static const double kHighThrottled = 0.1, kLowThrottled = 0.01;
+static const double kHighLoad = 1.5, kLowLoad = 0.8;
+// Solves to wait after a change before stepping up (stepping down is never delayed that long).
+static const size_t kUpCooldown = 100, kDownCooldown = 10;
+
+namespace {
+
+// Reads the value following `key` in a "key value" or "key=value" text file. Returns false if not found.
+bool readField(const char *path, const char *key, double *value) {
+  FILE *f = fopen(path, "r");
+  if (f == nullptr) {
+    return false;
+  }
+  char line[256];
+  bool found = false;
+  size_t key_len = strlen(key);
+  while (!found && fgets(line, sizeof(line), f) != nullptr) {
+    char *p = strstr(line, key);
+    if (p != nullptr && (p == line || p[-1] == ' ') && (p[key_len] == ' ' || p[key_len] == '=')) {
+      *value = atof(p + key_len + 1);
+      found = true;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+double cgroupQuota() {
+  char buf[64];
+  FILE *f = fopen("/sys/fs/cgroup/cpu.max", "r");
+  if (f != nullptr) {
+    double quota = 0, period = 0;
+    if (fscanf(f, "%63s %lf", buf, &period) == 2 && strcmp(buf, "max") != 0 && period > 0) {
+      quota = atof(buf) / period;
+    }
+    fclose(f);
+    return quota;
+  }
+  double quota = -1, period = 0;
+  f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+  if (f != nullptr) {
+    if (fscanf(f, "%lf", &quota) != 1) quota = -1;
+    fclose(f);
+  }
+  f = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+  if (f != nullptr) {
+    if (fscanf(f, "%lf", &period) != 1) period = 0;
+    fclose(f);
+  }
+  return (quota > 0 && period > 0) ? quota / period : 0;
+}
+
+bool cgroupPeriods(double *periods, double *throttled) {
+  const char *paths[] = {"/sys/fs/cgroup/cpu.stat", "/sys/fs/cgroup/cpu/cpu.stat"};
+  for (const char *path : paths) {
+    if (readField(path, "nr_periods", periods) && readField(path, "nr_throttled", throttled)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+double envOr(const char *name, double fallback) {
+  const char *value = getenv(name);
+  return value != nullptr ? atof(value) : fallback;
+}
+
+}  // namespace
+
+HostPressure SampleHostPressure() {
+  static mutex lock;
+  static HostPressure last = {0, 0, 0, 0};
+  static chrono::steady_clock::time_point sampled;
+  static double last_periods = 0, last_throttled = 0;
+
+  lock_guard<mutex> guard(lock);
+  auto now = chrono::steady_clock::now();
+  if (sampled.time_since_epoch().count() != 0 && now - sampled < chrono::seconds(1)) {
+    return last;
+  }
+  sampled = now;
+
+  HostPressure p = {0, 0, 0, 0};
+  p.cpu_quota = cgroupQuota();
+
+  double periods, throttled;
+  if (cgroupPeriods(&periods, &throttled)) {
+    if (periods > last_periods) {
+      p.throttled_ratio = (throttled - last_throttled) / (periods - last_periods);
+    }
+    last_periods = periods;
+    last_throttled = throttled;
+  }
+
+  readField("/proc/pressure/cpu", "avg10", &p.psi_some);
+
+  double load = 0;
+  FILE *f = fopen("/proc/loadavg", "r");
+  if (f != nullptr) {
+    if (fscanf(f, "%lf", &load) != 1) load = 0;
+    fclose(f);
+  }
+  double cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (p.cpu_quota > 0 && p.cpu_quota < cpus) {
+    cpus = p.cpu_quota;
+  }
+  p.load_per_cpu = cpus > 0 ? load / cpus : 0;
+
+  last = p;
+  return p;
+}
+
+Governor::Governor()
+    : deadline(envOr("MPC_DEADLINE_MS", 50) / 1000.0),
+      target_miss_rate(envOr("MPC_TARGET_MISS_RATE", 0.01)),
+      tiers(&SharedTiers()),
+      tier(0),
+      miss_rate(0),
+      since_change(0),
+      pressure(SampleHostPressure()) {}
+
+// MPC_HORIZON sets the horizon of the full tier (long horizons, see StageEval in MPC.cpp); the cheaper tiers keep
+// their share of it.
+static vector<SolverEffort> tiersFromEnv() {
+  vector<SolverEffort> tiers(kTiers, kTiers + sizeof(kTiers) / sizeof(kTiers[0]));
+  double horizon = envOr("MPC_HORIZON", 0);
+  if (horizon >= kMinHorizon) {
+    for (SolverEffort &effort : tiers) {
+      effort.N = max<size_t>(kMinHorizon, llround(effort.N * horizon / kTiers[0].N));
+    }
+  }
+  return tiers;
+}
+
+const vector<SolverEffort> &Governor::SharedTiers() {
+  static const vector<SolverEffort> tiers = tiersFromEnv();
+  return tiers;
+}
+
+void Governor::Record(double solve_seconds) {
+  bool miss = solve_seconds > deadline;
+  // About the last 50 solves.
+  miss_rate = 0.98 * miss_rate + 0.02 * (miss ? 1 : 0);
+  since_change++;
+  pressure = SampleHostPressure();
+
+  bool contended = pressure.psi_some > kHighPsi || pressure.throttled_ratio > kHighThrottled ||
+                   pressure.load_per_cpu > kHighLoad;
+  bool quiet = pressure.psi_some < kLowPsi && pressure.throttled_ratio < kLowThrottled &&
+               pressure.load_per_cpu < kLowLoad;
+
+  if ((miss_rate > target_miss_rate || contended) && since_change >= kDownCooldown && tier + 1 < tiers->size()) {
+    tier++;
+    since_change = 0;
+    GlobalMetrics().Add("mpc_governor_step_down_total");
+  } else if (miss_rate < target_miss_rate / 4 && quiet && since_change >= kUpCooldown && tier > 0) {
+    tier--;
+    since_change = 0;
+    GlobalMetrics().Add("mpc_governor_step_up_total");
+  }
+  if (miss) {
+    GlobalMetrics().Add("mpc_deadline_miss_total");
+  }
+}
+
+// The per-session series of Export.
+static const char *const kSessionSeries[] = {"mpc_governor_tier", "mpc_governor_horizon", "mpc_governor_max_iter",
+                                             "mpc_governor_tol", "mpc_governor_miss_rate"};
+
+void Governor::Export(unsigned session) const {
+  ostringstream label;
+  label << "{session=\"" << session << "\"}";
+  Metrics &m = GlobalMetrics();
+  const double values[] = {static_cast<double>(tier), static_cast<double>(Effort().N),
+                           static_cast<double>(Effort().max_iter), Effort().tol, miss_rate};
+  for (int i = 0; i < 5; i++) {
+    m.Set(kSessionSeries[i] + label.str(), values[i]);
+  }
+  m.Set("mpc_host_cpu_quota", pressure.cpu_quota);
+  m.Set("mpc_host_throttled_ratio", pressure.throttled_ratio);
+  m.Set("mpc_host_psi_cpu_some", pressure.psi_some);
+  m.Set("mpc_host_load_per_cpu", pressure.load_per_cpu);
+}
+
+void Governor::Unexport(unsigned session) {
+  ostringstream label;
+  label << "{session=\"" << session << "\"}";
+  for (const char *series : kSessionSeries) {
+    GlobalMetrics().Remove(series + label.str());
+  }
+}
@@ -0,0 +1,70 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// How much work a single solve is allowed to do.
+struct SolverEffort {
+  size_t N;               // horizon length
+  int max_iter;           // Ipopt iteration cap
+  double tol;             // Ipopt convergence tolerance
+  double acceptable_tol;  // Ipopt also stops after acceptable_iter iterations within this tolerance
+  int acceptable_iter;
+  double max_cpu_time;    // s
+};
+
+// What the host tells us about CPU contention.
+struct HostPressure {
+  double cpu_quota;        // cores granted by the cgroup, 0 if unlimited
+  double throttled_ratio;  // fraction of cgroup periods throttled since the last sample
+  double psi_some;         // % of time some task waited for a CPU (PSI avg10)
+  double load_per_cpu;     // 1 minute load average divided by the online CPUs
+};
+
+// Reads the cgroup (v2, falling back to v1) CPU controller, /proc/pressure/cpu and the load average. Samples are
+// taken at most once per second and shared by all sessions.
+HostPressure SampleHostPressure();
+
+// Picks the solver effort of one session. Whenever the deadline miss rate goes above the target or the host is
+// under pressure it steps down to a cheaper tier (shorter horizon, fewer iterations, looser tolerance). It climbs
+// back one tier at a time once things have been quiet for a while.
+class Governor {
+ public:
+  Governor();
+
+  const SolverEffort &Effort() const { return (*tiers)[tier]; }
+  // The largest horizon any tier uses.
+  size_t MaxHorizon() const { return (*tiers)[0].N; }
+  // 0 for full effort, higher for the cheaper tiers.
+  size_t Tier() const { return tier; }
+
+  // Called after every solve with its wall time.
+  void Record(double solve_seconds);
+
+  // Reports the decisions under the given session label.
+  void Export(unsigned session) const;
+  // Removes what Export reported for the session, once it has ended.
+  static void Unexport(unsigned session);
+
+  // Solves slower than this count as misses (s).
+  double deadline;
+  // Miss rate we try to stay under.
+  double target_miss_rate;
+
+ private:
+  // The tiers are the same for every session.
+  const vector<SolverEffort> *tiers;
+  static const vector<SolverEffort> &SharedTiers();
+  size_t tier;
+  // Exponential moving average of misses.
+  double miss_rate;
+  // Solves since the last tier change.
+  size_t since_change;
+  HostPressure pressure;
+};
+
+#endif /* GOVERNOR_H */
@@ -0,0 +1,262 @@
+#include "LiveStats.h"
+#include <math.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include "json.hpp"
+
+using json = nlohmann::json;
+
+namespace {
+
+const int kSampleRing = 1024;
+const size_t kCacheLine = 64;
+
+// The counters of one thread, on cache lines of their own so that no other thread writes next to them. Only that
+// thread writes them, so an increment is a load and a store rather than a locked read-modify-write; the atomics only
+// keep CollectLive's reads from tearing. The one field the collector writes, `read`, has a line to itself.
+struct alignas(kCacheLine) ThreadStats {
+  atomic<uint64_t> stage_count[kNumStages];
+  atomic<uint64_t> stage_ns[kNumStages];
+  atomic<uint64_t> stage_buckets[kNumStages][kLiveLatencyBuckets];
+  atomic<uint64_t> solves;
+  atomic<uint64_t> deadline_misses;
+  atomic<uint64_t> iterations[kLiveIterationBuckets];
+
+  // Sampled cycles, a ring between this thread and the collector: `written` counts the samples ever put in, `read`
+  // those taken out. Samples that find it full are dropped rather than overwrite ones not collected yet.
+  LiveCycle ring[kSampleRing];
+  atomic<uint64_t> written;
+  atomic<uint64_t> dropped;
+  // Cycles seen since the last sample.
+  unsigned skipped;
+  alignas(kCacheLine) atomic<uint64_t> read;
+  char padding[kCacheLine - sizeof(atomic<uint64_t>)];
+
+  ThreadStats() : skipped(0) {
+    for (int s = 0; s < kNumStages; s++) {
+      stage_count[s] = 0;
+      stage_ns[s] = 0;
+      for (int b = 0; b < kLiveLatencyBuckets; b++) {
+        stage_buckets[s][b] = 0;
+      }
+    }
+    solves = 0;
+    deadline_misses = 0;
+    for (int b = 0; b < kLiveIterationBuckets; b++) {
+      iterations[b] = 0;
+    }
+    written = 0;
+    read = 0;
+    dropped = 0;
+  }
+
+  // Plain new only aligns to 16 bytes before C++17.
+  static void *operator new(size_t size) {
+    void *memory = nullptr;
+    if (posix_memalign(&memory, kCacheLine, size) != 0) {
+      throw bad_alloc();
+    }
+    return memory;
+  }
+  static void operator delete(void *memory) { free(memory); }
+};
+
+void bump(atomic<uint64_t> &counter, uint64_t value = 1) {
+  counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+// Every thread that ever recorded. Threads don't give their counters back when they exit, the totals would go down.
+mutex registry_lock;
+vector<ThreadStats *> registry;
+
+ThreadStats &mine() {
+  thread_local ThreadStats *stats = nullptr;
+  if (stats == nullptr) {
+    stats = new ThreadStats();
+    lock_guard<mutex> guard(registry_lock);
+    registry.push_back(stats);
+  }
+  return *stats;
+}
+
+atomic<unsigned> sample_every(0);
+
+// Bucket of a value in [1, 2^(buckets - 1)], by powers of 2.
+int bucket(double value, int buckets) {
+  int b = value <= 1 ? 0 : static_cast<int>(ceil(log2(value)));
+  return b < buckets ? b : buckets - 1;
+}
+
+// The sums of the previous CollectLive.
+struct Totals {
+  uint64_t stage_count[kNumStages];
+  uint64_t stage_ns[kNumStages];
+  uint64_t stage_buckets[kNumStages][kLiveLatencyBuckets];
+  uint64_t solves;
+  uint64_t deadline_misses;
+  uint64_t iterations[kLiveIterationBuckets];
+  uint64_t cycles_dropped;
+};
+
+// Upper end of the bucket holding quantile q of `buckets` (ms).
+double quantileMs(const uint64_t buckets[kLiveLatencyBuckets], uint64_t count, double q) {
+  uint64_t rank = static_cast<uint64_t>(ceil(q * count));
+  uint64_t seen = 0;
+  for (int b = 0; b < kLiveLatencyBuckets; b++) {
+    seen += buckets[b];
+    if (seen >= rank) {
+      return ldexp(1.0, b) / 1000;
+    }
+  }
+  return ldexp(1.0, kLiveLatencyBuckets - 1) / 1000;
+}
+
+}  // namespace
+
+void RecordLiveStage(Stage stage, double seconds) {
+  ThreadStats &stats = mine();
+  bump(stats.stage_count[stage]);
+  bump(stats.stage_ns[stage], static_cast<uint64_t>(seconds * 1e9));
+  bump(stats.stage_buckets[stage][bucket(seconds * 1e6, kLiveLatencyBuckets)]);
+}
+
+void RecordLiveSolve(int iterations, bool deadline_miss) {
+  ThreadStats &stats = mine();
+  bump(stats.solves);
+  if (deadline_miss) {
+    bump(stats.deadline_misses);
+  }
+  bump(stats.iterations[bucket(iterations, kLiveIterationBuckets)]);
+}
+
+void RecordLiveCycle(const LiveCycle &cycle) {
+  unsigned every = sample_every.load(memory_order_relaxed);
+  if (every == 0) {
+    return;
+  }
+  ThreadStats &stats = mine();
+  if (++stats.skipped < every) {
+    return;
+  }
+  stats.skipped = 0;
+  uint64_t index = stats.written.load(memory_order_relaxed);
+  if (index - stats.read.load(memory_order_acquire) >= kSampleRing) {
+    bump(stats.dropped);
+    return;
+  }
+  stats.ring[index % kSampleRing] = cycle;
+  stats.written.store(index + 1, memory_order_release);
+}
+
+unsigned LiveSampling() { return sample_every.load(memory_order_relaxed); }
+
+void SetLiveSampling(unsigned every) { sample_every = every; }
+
+LiveReport CollectLive() {
+  static Totals previous = Totals();
+  static chrono::steady_clock::time_point last = chrono::steady_clock::now();
+
+  vector<ThreadStats *> threads;
+  {
+    lock_guard<mutex> guard(registry_lock);
+    threads = registry;
+  }
+
+  LiveReport report = LiveReport();
+  Totals now = Totals();
+  for (ThreadStats *stats : threads) {
+    for (int s = 0; s < kNumStages; s++) {
+      now.stage_count[s] += stats->stage_count[s].load(memory_order_relaxed);
+      now.stage_ns[s] += stats->stage_ns[s].load(memory_order_relaxed);
+      for (int b = 0; b < kLiveLatencyBuckets; b++) {
+        now.stage_buckets[s][b] += stats->stage_buckets[s][b].load(memory_order_relaxed);
+      }
+    }
+    now.solves += stats->solves.load(memory_order_relaxed);
+    now.deadline_misses += stats->deadline_misses.load(memory_order_relaxed);
+    for (int b = 0; b < kLiveIterationBuckets; b++) {
+      now.iterations[b] += stats->iterations[b].load(memory_order_relaxed);
+    }
+    now.cycles_dropped += stats->dropped.load(memory_order_relaxed);
+
+    uint64_t written = stats->written.load(memory_order_acquire);
+    for (uint64_t i = stats->read.load(memory_order_relaxed); i < written; i++) {
+      report.cycles.push_back(stats->ring[i % kSampleRing]);
+    }
+    stats->read.store(written, memory_order_release);
+  }
+
+  chrono::steady_clock::time_point time = chrono::steady_clock::now();
+  report.interval = chrono::duration<double>(time - last).count();
+  last = time;
+  for (int s = 0; s < kNumStages; s++) {
+    report.stage_count[s] = now.stage_count[s] - previous.stage_count[s];
+    report.stage_seconds[s] = (now.stage_ns[s] - previous.stage_ns[s]) / 1e9;
+    for (int b = 0; b < kLiveLatencyBuckets; b++) {
+      report.stage_buckets[s][b] = now.stage_buckets[s][b] - previous.stage_buckets[s][b];
+    }
+  }
+  report.solves = now.solves - previous.solves;
+  report.deadline_misses = now.deadline_misses - previous.deadline_misses;
+  for (int b = 0; b < kLiveIterationBuckets; b++) {
+    report.iterations[b] = now.iterations[b] - previous.iterations[b];
+  }
+  report.cycles_dropped = now.cycles_dropped - previous.cycles_dropped;
+  previous = now;
+  return report;
+}
+
+string LiveReport::Json(bool with_cycles) const {
+  json out;
+  out["time"] = chrono::duration<double>(chrono::system_clock::now().time_since_epoch()).count();
+  out["interval"] = interval;
+  out["sessions"] = sessions;
+  out["solves"] = solves;
+  out["deadline_misses"] = deadline_misses;
+  json stages = json::object();
+  for (int s = 0; s < kNumStages; s++) {
+    if (stage_count[s] == 0) {
+      continue;
+    }
+    json stage;
+    stage["count"] = stage_count[s];
+    stage["mean_ms"] = 1000 * stage_seconds[s] / stage_count[s];
+    stage["p50_ms"] = quantileMs(stage_buckets[s], stage_count[s], 0.5);
+    stage["p99_ms"] = quantileMs(stage_buckets[s], stage_count[s], 0.99);
+    stage["p999_ms"] = quantileMs(stage_buckets[s], stage_count[s], 0.999);
+    stages[StageName(static_cast<Stage>(s))] = stage;
+  }
+  out["stages"] = stages;
+  // Upper bounds of the buckets, "+Inf" for the last one.
+  json le = json::array();
+  for (int b = 0; b + 1 < kLiveIterationBuckets; b++) {
+    le.push_back(static_cast<uint64_t>(1) << b);
+  }
+  le.push_back("+Inf");
+  out["iterations"] = {{"le", le}, {"counts", vector<uint64_t>(iterations, iterations + kLiveIterationBuckets)}};
+  if (with_cycles) {
+    json samples = json::array();
+    for (const LiveCycle &cycle : cycles) {
+      json sample;
+      sample["time_ns"] = cycle.time_ns;
+      sample["session"] = cycle.session;
+      sample["ok"] = cycle.ok;
+      sample["iterations"] = cycle.iterations;
+      sample["horizon"] = cycle.horizon;
+      json seconds;
+      for (int s = 0; s < kNumStages; s++) {
+        if (cycle.stage_seconds[s] > 0) {
+          seconds[StageName(static_cast<Stage>(s))] = cycle.stage_seconds[s];
+        }
+      }
+      sample["stage_seconds"] = seconds;
+      samples.push_back(sample);
+    }
+    out["cycles"] = samples;
+    out["cycles_dropped"] = cycles_dropped;
+  }
+  return out.dump();
+}
@@ -0,0 +1,69 @@
+#ifndef LIVE_STATS_H
+#define LIVE_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Stage.h"
+
+using namespace std;
+
+// What the live metrics WebSocket ("/live", see main.cpp) pushes every second: stage latencies, the solver iteration
+// histogram, deadline misses and, for subscribers that ask for them, samples of single control cycles.
+//
+// /metrics is scraped every few seconds at best and its histograms only ever add up, so a 200 ms spike disappears in
+// them. These counters are cut into seconds instead. Recording has to stay off the control loop's back: every thread
+// writes counters of its own (created on its first record), with plain relaxed atomic stores, no lock and no cache
+// line shared with another thread. CollectLive, once a second on the event loop thread, sums the counters of all the
+// threads and subtracts the previous sum.
+
+// Latency buckets: bucket b counts stages shorter than 2^b us, the last one everything longer (~8 s and up).
+const int kLiveLatencyBuckets = 24;
+// Iteration buckets: bucket b counts solves of at most 2^b iterations (see CountBounds), the last one the rest.
+const int kLiveIterationBuckets = 14;
+
+// One control cycle, as sampled for the subscribers.
+struct LiveCycle {
+  uint64_t time_ns;  // wall clock at the end of the cycle
+  unsigned session;
+  bool ok;
+  int iterations;
+  size_t horizon;
+  double stage_seconds[kNumStages];
+};
+
+// Called on the hot paths: at the end of every stage (StageScope), after every solve with its iterations and
+// whether it missed the governor's deadline, and at the end of every cycle.
+void RecordLiveStage(Stage stage, double seconds);
+void RecordLiveSolve(int iterations, bool deadline_miss);
+// Keeps `cycle` for the next report if sampling is on and it is the cycle's turn; call LiveSampling() first to
+// avoid building it when sampling is off.
+void RecordLiveCycle(const LiveCycle &cycle);
+
+// Every how many cycles (per thread) one is sampled, 0 for none.
+unsigned LiveSampling();
+void SetLiveSampling(unsigned every);
+
+// Totals since the previous CollectLive.
+struct LiveReport {
+  double interval;  // s
+  size_t sessions;  // filled in by the caller
+  uint64_t solves;
+  uint64_t deadline_misses;
+  uint64_t stage_count[kNumStages];
+  double stage_seconds[kNumStages];
+  uint64_t stage_buckets[kNumStages][kLiveLatencyBuckets];
+  uint64_t iterations[kLiveIterationBuckets];
+  vector<LiveCycle> cycles;
+  // Samples dropped because the collector was a second behind.
+  uint64_t cycles_dropped;
+
+  // As a JSON object, with the sampled cycles or without.
+  string Json(bool with_cycles) const;
+};
+
+// Event loop thread only.
+LiveReport CollectLive();
+
+#endif /* LIVE_STATS_H */
@@ -0,0 +1,54 @@
+#include "LoopTimers.h"
+#include <chrono>
+#include "Metrics.h"
+
+// Ticks of the wheel (ms).
+static uint64_t loopMs() {
+  return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+LoopTimers::LoopTimers(uS::Loop *loop) : wheel(loopMs()), alarm(new uS::Timer(loop)), armed(TimerWheel::kNever) {
+  alarm->setData(this);
+}
+
+LoopTimers::~LoopTimers() {
+  alarm->stop();
+  // Frees the timer once the loop has let go of it.
+  alarm->close();
+}
+
+LoopTimers::Handle LoopTimers::Schedule(uint64_t ms, function<void()> fn) {
+  // The wheel is only as recent as its last Advance, the delay counts from now.
+  uint64_t now = loopMs();
+  Handle handle = wheel.Schedule(now - wheel.Now() + ms, move(fn));
+  if (now + ms < armed) {
+    rearm();
+  }
+  return handle;
+}
+
+void LoopTimers::rearm() {
+  uint64_t due = wheel.NextDue();
+  if (due == armed) {
+    return;
+  }
+  armed = due;
+  if (due == TimerWheel::kNever) {
+    alarm->stop();
+    return;
+  }
+  uint64_t now = loopMs();
+  alarm->start(ring, due > now ? static_cast<int>(due - now) : 0, 0);
+}
+
+void LoopTimers::ring(uS::Timer *alarm) {
+  LoopTimers *timers = static_cast<LoopTimers *>(alarm->getData());
+  // The alarm has gone off; callbacks that schedule set it again as needed.
+  timers->armed = TimerWheel::kNever;
+  size_t fired = timers->wheel.Advance(loopMs());
+  if (fired > 0) {
+    GlobalMetrics().Add("mpc_timers_fired_total", fired);
+  }
+  GlobalMetrics().Set("mpc_timers", timers->wheel.Size());
+  timers->rearm();
+}
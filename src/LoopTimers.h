@@ -0,0 +1,40 @@
+#ifndef LOOP_TIMERS_H
+#define LOOP_TIMERS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <uWS/uWS.h>
+#include "TimerWheel.h"
+
+using namespace std;
+
+// The session timers (TimerWheel.h) on the event loop, in milliseconds.
+//
+// The wheel only moves when it is advanced. Rather than advancing it every millisecond, which wakes the loop a
+// thousand times a second whether or not a timer is pending, one timer of the loop is set for the wheel's next due
+// tick (TimerWheel::NextDue), set again for the one after when it goes off or when an earlier timer is scheduled, and
+// stopped while the wheel is empty. Event loop thread only.
+class LoopTimers {
+ public:
+  typedef TimerWheel::Handle Handle;
+
+  explicit LoopTimers(uS::Loop *loop);
+  ~LoopTimers();
+
+  // Calls fn on the loop once `ms` have passed.
+  Handle Schedule(uint64_t ms, function<void()> fn);
+  bool Cancel(Handle handle) { return wheel.Cancel(handle); }
+  size_t Size() const { return wheel.Size(); }
+
+ private:
+  TimerWheel wheel;
+  uS::Timer *alarm;
+  // Tick the alarm is set for, TimerWheel::kNever while it is stopped.
+  uint64_t armed;
+
+  void rearm();
+  static void ring(uS::Timer *alarm);
+};
+
+#endif /* LOOP_TIMERS_H */
@@ -1,7 +1,26 @@
 #include "MPC.h"
+#include <assert.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <cppad/cppad.hpp>
-#include <cppad/ipopt/solve.hpp>
 #include "Eigen-3.3/Eigen/Core"
+#include "ClosestPoint.h"
+#include "EventTrigger.h"
+#include "LiveStats.h"
+#include "MPC_NLP.h"
+#include "ProblemTape.h"
+#include "ModelDSL.h"
+#include "Metrics.h"
+#include "Scaling.h"
+#include "SolutionCache.h"
+#include "Stage.h"
+#include "ThreadPool.h"
 
 using CppAD::AD;
 
@@ -39,166 +58,968 @@ const double weight_deltaseq = 150;
 const double weight_aseq = 15;
 
 // The solver takes all the state variables and actuator variables in a singular vector. Thus, we should establish
-// when one variable starts and another ends to make our lives easier.
-size_t x_start = 0;
-size_t y_start = x_start + N;
-size_t psi_start = y_start + N;
-size_t v_start = psi_start + N;
-size_t cte_start = v_start + N;
-size_t epsi_start = cte_start + N;
-size_t delta_start = epsi_start + N;
-size_t a_start = delta_start + N - 1;
+// when one variable starts and another ends to make our lives easier. The governor may pick a shorter horizon than
+// N when the host is busy, so the layout is worked out for every solve.
+//
+// The state at t = 0 is known (the measured state), so it is a parameter of FG_eval rather than six variables pinned
+// by six equality constraints: the state blocks hold stages 1 to N - 1, the actuation blocks the N - 1 actuations
+// from t = 0. Every kind has N - 1 entries and constraint i is the dynamics of variable i.
+struct Layout {
+    size_t N;
+    size_t x_start;
+    size_t y_start;
+    size_t psi_start;
+    size_t v_start;
+    size_t cte_start;
+    size_t epsi_start;
+    size_t delta_start;
+    size_t a_start;
+    // N timesteps ==> N - 1 actuations
+    size_t n_vars;
+    // Number of constraints: (constraints != actuations)
+    size_t n_constraints;
+
+    explicit Layout(size_t N)
+        : N(N),
+          x_start(0),
+          y_start(x_start + N - 1),
+          psi_start(y_start + N - 1),
+          v_start(psi_start + N - 1),
+          cte_start(v_start + N - 1),
+          epsi_start(cte_start + N - 1),
+          delta_start(epsi_start + N - 1),
+          a_start(delta_start + N - 1),
+          n_vars((N - 1) * 8),
+          n_constraints((N - 1) * 6) {}
+
+    // Where the block of a VarKind (see Scaling.h) starts and how long it is. The constraints use the same blocks
+    // for the six states.
+    size_t Start(size_t kind) const {
+        const size_t starts[kNumKinds] = {x_start, y_start, psi_start, v_start, cte_start, epsi_start, delta_start,
+                                          a_start};
+        return starts[kind];
+    }
+    size_t Length(size_t) const { return N - 1; }
+};
+
+// Copies `from` (laid out like `layout`, variables or constraints) into `to`, moved one step ahead in time. The
+// last step is repeated.
+template <typename Vector>
+static void shiftStages(const Layout &layout, const vector<double> &from, Vector &to) {
+    for (size_t kind = 0; kind < kNumKinds; kind++) {
+        size_t start = layout.Start(kind);
+        size_t length = layout.Length(kind);
+        if (start + length > from.size()) {
+            break;
+        }
+        for (size_t t = 0; t < length; t++) {
+            to[start + t] = from[start + ((t + 1 < length) ? t + 1 : t)];
+        }
+    }
+}
+
+// Ipopt's bound multipliers of the variables without bounds (the states) are zero, so only those of the actuation
+// blocks are kept between solves: compactBounds takes them out of a full vector laid out like `layout`,
+// expandBounds puts them back.
+template <typename Vector>
+static void compactBounds(const Layout &layout, const Vector &full, vector<double> &compact) {
+    compact.clear();
+    for (size_t i = layout.delta_start; i < layout.n_vars; i++) {
+        compact.push_back(full[i]);
+    }
+}
+
+static vector<double> expandBounds(const Layout &layout, const vector<double> &compact) {
+    vector<double> full(layout.n_vars, 0.0);
+    std::copy(compact.begin(), compact.end(), full.begin() + layout.delta_start);
+    return full;
+}
+
+// A reference profile moved one step ahead in time, like shiftStages does with a plan.
+static vector<double> shifted(const vector<double> &profile) {
+    vector<double> result(profile.begin() + (profile.empty() ? 0 : 1), profile.end());
+    if (!profile.empty()) {
+        result.push_back(profile.back());
+    }
+    return result;
+}
+
+// The first actuations of a plan, then the positions of its stages in the frame of a car at (x0, y0) heading psi0
+// in the plan's frame (the origin for a fresh solution; a shifted plan starts where the car was predicted to be by
+// now).
+template <typename Vector>
+static vector<double> actuationsAndPath(const Layout &layout, const Vector &plan, double x0 = 0, double y0 = 0,
+                                        double psi0 = 0) {
+    vector<double> result;
+
+    result.push_back(plan[layout.delta_start]);
+    result.push_back(plan[layout.a_start]);
+
+    for (size_t i = 0; i < layout.N - 1; i++) {
+        double dx = plan[layout.x_start + i] - x0;
+        double dy = plan[layout.y_start + i] - y0;
+        result.push_back(dx * cos(psi0) + dy * sin(psi0));
+        result.push_back(-dx * sin(psi0) + dy * cos(psi0));
+    }
+
+    return result;
+}
+
+// The model, declared once (see ModelDSL.h): the dynamics as residuals that the constraints hold at 0, and the cost
+// terms. FG_eval evaluates them for doubles and for CppAD; dsl::Gradient and dsl::Hessian give their derivatives.
+namespace model {
+
+using dsl::Ref;
+using dsl::square;
+
+// One step of the kinematic model, from the state at t to the state at t + 1 under the actuations at t.
+namespace dynamics {
+
+enum Input { kX0, kY0, kPsi0, kV0, kCte0, kEpsi0, kDelta0, kA0, kX1, kY1, kPsi1, kV1, kCte1, kEpsi1, kC0, kC1, kC2, kC3,
+             kNumInputs };
+// The inputs before kC0 are variables of the NLP, the coefficients of the fit are parameters.
+const int kNumVariables = kC0;
+
+const dsl::In<kX0> x0;
+const dsl::In<kY0> y0;
+const dsl::In<kPsi0> psi0;
+const dsl::In<kV0> v0;
+const dsl::In<kEpsi0> epsi0;
+const dsl::In<kDelta0> delta0;
+const dsl::In<kA0> a0;
+const dsl::In<kX1> x1;
+const dsl::In<kY1> y1;
+const dsl::In<kPsi1> psi1;
+const dsl::In<kV1> v1;
+const dsl::In<kCte1> cte1;
+const dsl::In<kEpsi1> epsi1;
+const dsl::In<kC0> c0;
+const dsl::In<kC1> c1;
+const dsl::In<kC2> c2;
+const dsl::In<kC3> c3;
+
+// These are needed for the cte and epsi evolution:
+const auto f0 = c0 + c1 * x0 + c2 * x0 * x0 + c3 * x0 * x0 * x0;
+const auto psides0 = atan(3 * c3 * x0 * x0 + 2 * c2 * x0 + c1);
+
+// The cross-track error of a position: its distance to the path (see ClosestPoint.h).
+struct CrossTrack {
+    template <class S>
+    S operator()(const S *in, const S &x, const S &y) const {
+        const S coeffs[4] = {in[kC0], in[kC1], in[kC2], in[kC3]};
+        return CrossTrackErrorNewton(coeffs, x, y);
+    }
+};
+
+const auto x = x1 - (x0 + v0 * cos(psi0) * Ref(dt));
+const auto y = y1 - (y0 + v0 * sin(psi0) * Ref(dt));
+// This one I changed the sign so because delta > 0 implies a right turn in the simulator
+const auto psi = psi1 - (psi0 - v0 * delta0 / Ref(Lf) * Ref(dt));
+const auto v = v1 - (v0 + a0 * Ref(dt));
+// The cross-track error of the state itself, or the vertical offset propagated with the model (MPC_CTE=vertical).
+const auto cte_exact = cte1 - dsl::apply<CrossTrack>(x1, y1);
+const auto cte_vertical = cte1 - ((f0 - y0) + (v0 * sin(epsi0) * Ref(dt)));
+// This one I changed the sign so because delta > 0 implies a right turn in the simulator
+const auto epsi = epsi1 - ((psi0 - psides0) - v0 * delta0 / Ref(Lf) * Ref(dt));
+
+}  // namespace dynamics
+
+// Cost of a stage: the reference state cost, plus for all stages but the last (the terminal one) the use of the
+// actuators. Steering is only penalized for what it adds to the feed-forward: holding a bend is not a correction.
+namespace cost {
+
+enum Input { kCte, kEpsi, kV, kDelta, kA, kVRef, kDeltaFF, kNumInputs };
+// The references are parameters.
+const int kNumVariables = kVRef;
+
+const dsl::In<kCte> cte;
+const dsl::In<kEpsi> epsi;
+const dsl::In<kV> v;
+const dsl::In<kVRef> v_ref;
+const dsl::In<kDelta> delta;
+const dsl::In<kA> a;
+const dsl::In<kDeltaFF> delta_ff;
+
+const auto terminal = Ref(weight_cte) * square(cte - Ref(ref_cte)) + Ref(weight_epsi) * square(epsi - Ref(ref_epsi)) +
+                      Ref(weight_v) * square(v - v_ref);
+const auto stage = terminal + Ref(weight_delta) * square(delta - delta_ff) + Ref(weight_a) * square(a);
+
+}  // namespace cost
+
+// Minimize the value gap between sequential actuations.
+namespace rate {
+
+enum Input { kDelta0, kA0, kDelta1, kA1, kNumInputs };
 
+const dsl::In<kDelta0> delta0;
+const dsl::In<kA0> a0;
+const dsl::In<kDelta1> delta1;
+const dsl::In<kA1> a1;
+
+const auto cost = Ref(weight_deltaseq) * square(delta1 - delta0) + Ref(weight_aseq) * square(a1 - a0);
+
+}  // namespace rate
+
+}  // namespace model
 
 class FG_eval {
     public:
 
     // Fitted polynomial coefficients
     Eigen::VectorXd coeffs;
+    // Feed-forward steering of every actuation, the steering cost is centred on it.
+    vector<double> delta_ff;
+    // Reference speed of every stage.
+    vector<double> v_ref;
+    // Exact cross-track error or the vertical offset approximation.
+    bool exact_cte;
+    // Where each variable lives in `vars`
+    Layout layout;
+    // The state at t = 0 (x, y, psi, v, cte, epsi), which isn't a variable.
+    double state0[6];
+    // All of the above that changes from solve to solve, in one vector: the coefficients, the state at t = 0, the
+    // reference speeds from kParamVRef and the feed-forward from ParamDeltaFF(). These are the dynamic parameters
+    // of the shared tape (see ProblemTape.h).
+    CPPAD_TESTVECTOR(double) parameters;
+    static const size_t kParamCoeffs = 0;
+    static const size_t kParamState = 4;
+    static const size_t kParamVRef = 10;
+    size_t ParamDeltaFF() const { return kParamVRef + layout.N; }
 
     // Constructor
-    FG_eval(Eigen::VectorXd coeffs) {
+    FG_eval(Eigen::VectorXd coeffs, const Eigen::VectorXd &state, const vector<double> &delta_ff,
+            const vector<double> &v_ref, const Layout &layout)
+        : delta_ff(delta_ff), v_ref(v_ref), exact_cte(ExactCrossTrack()), layout(layout),
+          parameters(kParamVRef + 2 * layout.N - 1) {
         this->coeffs = coeffs;
+        for (size_t kind = 0; kind < 6; kind++) {
+            state0[kind] = state[kind];
+        }
+        for (int i = 0; i < 4; i++) {
+            parameters[kParamCoeffs + i] = coeffs[i];
+        }
+        for (size_t kind = 0; kind < 6; kind++) {
+            parameters[kParamState + kind] = state0[kind];
+        }
+        for (size_t t = 0; t < layout.N; t++) {
+            parameters[kParamVRef + t] = v_ref[t];
+        }
+        for (size_t t = 0; t + 1 < layout.N; t++) {
+            parameters[ParamDeltaFF() + t] = delta_ff[t];
+        }
     }
 
-    // To use CppAD effectively (library for automatic differentiation), we have to use its types instead of
-    // regular std::vector types.
-    typedef CPPAD_TESTVECTOR(AD<double>) ADvector;
+    // Everything the tape depends on besides the parameters: the horizon, dt, the cross-track model and the cost.
+    // Solves with the same key share a tape.
+    std::string Key() const {
+        std::ostringstream key;
+        key << "N=" << layout.N << " dt=" << dt << " Lf=" << Lf << " cte=" << (exact_cte ? "exact" : "vertical")
+            << " weights=" << weight_cte << "," << weight_epsi << "," << weight_v << "," << weight_delta << ","
+            << weight_a << "," << weight_deltaseq << "," << weight_aseq << " ref=" << ref_cte << "," << ref_epsi;
+        return key.str();
+    }
+
+    // State `kind` (a VarKind, see Scaling.h) at time t.
+    template <typename Vector, typename Params>
+    typename Vector::value_type At(const Vector& vars, const Params& params, size_t kind, size_t t) const {
+        typedef typename Vector::value_type Scalar;
+        return (t == 0) ? Scalar(params[kParamState + kind]) : vars[layout.Start(kind) + t - 1];
+    }
 
     // `fg` is a vector containing the cost and constraints.
     // `vars` is a vector containing the variable values (state & actuators).
-    void operator()(ADvector& fg, const ADvector& vars) {
+    //
+    // The same source for every scalar type: CppAD's AD<double> when the NLP is taped for derivatives (see
+    // MPC_NLP.h), plain double for the values Ipopt asks for without derivatives, which skips the tape. The terms
+    // themselves are declared once in `model`.
+    template <typename Vector>
+    void operator()(Vector& fg, const Vector& vars) {
+        (*this)(fg, vars, parameters);
+    }
+
+    // The same with the parameters taken from `params`, laid out like `parameters`: the tape is recorded with them
+    // as dynamic parameters.
+    template <typename Vector, typename Params>
+    void operator()(Vector& fg, const Vector& vars, const Params& params) const {
+        typedef typename Vector::value_type Scalar;
+
         // The cost is stored is the first element of `fg`.
         // Any additions to the cost should be added to `fg[0]`.
         fg[0] = 0;
 
-        // Reference State Cost
-        // The part of the cost based on the reference state:
-        for (size_t t = 0; t < N; t++) {
-            fg[0] += weight_cte*CppAD::pow(vars[cte_start + t] - ref_cte, 2);
-            fg[0] += weight_epsi*CppAD::pow(vars[epsi_start + t] - ref_epsi, 2);
-            fg[0] += weight_v*CppAD::pow(vars[v_start + t] - ref_v, 2);
-        }
-        // Minimize the use of actuators.
-        for (size_t t = 0; t < N - 1; t++) {
-            fg[0] += weight_delta*CppAD::pow(vars[delta_start + t], 2);
-            fg[0] += weight_a*CppAD::pow(vars[a_start + t], 2);
+        // Reference state cost of every stage, the actuations from every stage but the last and their changes
+        // (see model::cost).
+        for (size_t t = 0; t < layout.N; t++) {
+            Scalar in[model::cost::kNumInputs] = {At(vars, params, kCte, t), At(vars, params, kEpsi, t),
+                                                  At(vars, params, kV, t), Scalar(0), Scalar(0),
+                                                  Scalar(params[kParamVRef + t]), Scalar(0)};
+            if (t + 1 < layout.N) {
+                in[model::cost::kDelta] = vars[layout.delta_start + t];
+                in[model::cost::kA] = vars[layout.a_start + t];
+                in[model::cost::kDeltaFF] = params[ParamDeltaFF() + t];
+                fg[0] += model::cost::stage(in);
+            } else {
+                fg[0] += model::cost::terminal(in);
+            }
         }
-        // Minimize the value gap between sequential actuations.
-        for (size_t t = 0; t < N - 2; t++) {
-            fg[0] += weight_deltaseq*CppAD::pow(vars[delta_start + t + 1] - vars[delta_start + t], 2);
-            fg[0] += weight_aseq*CppAD::pow(vars[a_start + t + 1] - vars[a_start + t], 2);
+        for (size_t t = 0; t + 2 < layout.N; t++) {
+            Scalar in[model::rate::kNumInputs] = {vars[layout.delta_start + t], vars[layout.a_start + t],
+                                                  vars[layout.delta_start + t + 1], vars[layout.a_start + t + 1]};
+            fg[0] += model::rate::cost(in);
         }
 
         // Setup the Model Constraints
-
-        // i) Initial constraints
         // We add 1 to each of the starting indices due to cost being located at
-        // index 0 of `fg`. This bumps up the position of all the other values.
-        fg[1 + x_start] = vars[x_start];
-        fg[1 + y_start] = vars[y_start];
-        fg[1 + psi_start] = vars[psi_start];
-        fg[1 + v_start] = vars[v_start];
-        fg[1 + cte_start] = vars[cte_start];
-        fg[1 + epsi_start] = vars[epsi_start];
-
-        // ii) The rest of the constraints
-        for (size_t t = 1; t < N; t++) {
-            // The state at time t+1 .
-            AD<double> x1 = vars[x_start + t];
-            AD<double> y1 = vars[y_start + t];
-            AD<double> psi1 = vars[psi_start + t];
-            AD<double> v1 = vars[v_start + t];
-            AD<double> cte1 = vars[cte_start + t];
-            AD<double> epsi1 = vars[epsi_start + t];
-            // The state at time t.
-            AD<double> x0 = vars[x_start + t - 1];
-            AD<double> y0 = vars[y_start + t - 1];
-            AD<double> psi0 = vars[psi_start + t - 1];
-            AD<double> v0 = vars[v_start + t - 1];
-            AD<double> cte0 = vars[cte_start + t - 1];
-            AD<double> epsi0 = vars[epsi_start + t - 1];
-
-            // Only consider the actuation values at time t (needed for psi(t), v(t) and epsi(t)).
-            AD<double> delta0 = vars[delta_start + t - 1];
-            AD<double> a0 = vars[a_start + t - 1];
-            // These are needed for the cte and epsi evolution:
-            AD<double> f0 = coeffs[0] + coeffs[1] * x0 + coeffs[2] * x0 * x0 + coeffs[3] * x0 * x0 * x0;
-            AD<double> psides0 = CppAD::atan(3*coeffs[3] * x0 * x0 + 2*coeffs[2] * x0 + coeffs[1]);
-
-            // Finally:
-            // Model constraints for our state set such that their values are 0:
-            fg[1 + x_start + t] = x1 - (x0 + v0 * CppAD::cos(psi0) * dt);
-            fg[1 + y_start + t] = y1 - (y0 + v0 * CppAD::sin(psi0) * dt);
-            // This one I changed the sign so because delta > 0 implies a right turn in the simulator
-            fg[1 + psi_start + t] = psi1 - (psi0 - v0 * delta0 / Lf * dt);
-            fg[1 + v_start + t] = v1 - (v0 + a0 * dt);
-            fg[1 + cte_start + t] = cte1 - ((f0 - y0) + (v0 * CppAD::sin(epsi0) * dt));
-            // This one I changed the sign so because delta > 0 implies a right turn in the simulator
-            fg[1 + epsi_start + t] = epsi1 - ((psi0 - psides0) - v0 * delta0 / Lf * dt);
+        // index 0 of `fg`. This bumps up the position of all the other values. The state at t = 0 is given, so the
+        // constraints start with the step to t = 1, at the index of the variables of t = 1.
+        for (size_t t = 1; t < layout.N; t++) {
+            Scalar in[model::dynamics::kNumInputs];
+            for (size_t kind = 0; kind < 6; kind++) {
+                in[model::dynamics::kX0 + kind] = At(vars, params, kind, t - 1);
+                in[model::dynamics::kX1 + kind] = At(vars, params, kind, t);
+            }
+            in[model::dynamics::kDelta0] = vars[layout.delta_start + t - 1];
+            in[model::dynamics::kA0] = vars[layout.a_start + t - 1];
+            for (int i = 0; i < 4; i++) {
+                in[model::dynamics::kC0 + i] = params[kParamCoeffs + i];
+            }
+            fg[1 + layout.x_start + t - 1] = model::dynamics::x(in);
+            fg[1 + layout.y_start + t - 1] = model::dynamics::y(in);
+            fg[1 + layout.psi_start + t - 1] = model::dynamics::psi(in);
+            fg[1 + layout.v_start + t - 1] = model::dynamics::v(in);
+            fg[1 + layout.cte_start + t - 1] = exact_cte ? model::dynamics::cte_exact(in)
+                                                         : model::dynamics::cte_vertical(in);
+            fg[1 + layout.epsi_start + t - 1] = model::dynamics::epsi(in);
         }
     }
 };
 
 
+// Cost, constraints and their derivatives stage by stage, from the declarations in `model` (dsl::Gradient,
+// dsl::Hessian and dsl::Sparsity) instead of the tape, whose sparse Jacobian and Hessian take most of an Ipopt
+// iteration at long horizons and run on one core.
+//
+// Unit t holds the step into stage t (for t > 0), the cost of stage t and the rate cost between the actuations t and
+// t + 1. Units only involve the variables around their stage, so they are spread over a thread pool (ThreadPool.h),
+// each thread working on the dual numbers on its own stack. A unit writes its constraint rows and Jacobian entries
+// in place; what neighbouring units share (the cost, the gradient and the Hessian entries of the variables of one
+// stage) goes to the unit's own slots and is summed afterwards in unit order, so the result is the same for any
+// number of threads.
+class StageEval : public StageDerivatives {
+    public:
+
+    StageEval(const FG_eval &fg_eval, ThreadPool &pool)
+        : fg(fg_eval), layout(fg_eval.layout), pool(pool), units(fg_eval.layout.N) {
+        using namespace model;
+        std::map<std::pair<size_t, size_t>, size_t> slots;
+        size_t hessian_parts = 0;
+        for (size_t t = 0; t < units.size(); t++) {
+            Unit &unit = units[t];
+            unit.has_dynamics = t > 0;
+            unit.terminal = t + 1 == layout.N;
+            unit.has_rate = t + 2 < layout.N;
+            for (size_t kind = 0; kind < 6; kind++) {
+                unit.dynamics[dynamics::kX0 + kind] = unit.has_dynamics ? variable(kind, t - 1) : -1;
+                unit.dynamics[dynamics::kX1 + kind] = unit.has_dynamics ? variable(kind, t) : -1;
+            }
+            unit.dynamics[dynamics::kDelta0] = unit.has_dynamics ? int(layout.delta_start + t - 1) : -1;
+            unit.dynamics[dynamics::kA0] = unit.has_dynamics ? int(layout.a_start + t - 1) : -1;
+            unit.cost[cost::kCte] = variable(kCte, t);
+            unit.cost[cost::kEpsi] = variable(kEpsi, t);
+            unit.cost[cost::kV] = variable(kV, t);
+            unit.cost[cost::kDelta] = unit.terminal ? -1 : int(layout.delta_start + t);
+            unit.cost[cost::kA] = unit.terminal ? -1 : int(layout.a_start + t);
+            unit.rate[rate::kDelta0] = unit.has_rate ? int(layout.delta_start + t) : -1;
+            unit.rate[rate::kA0] = unit.has_rate ? int(layout.a_start + t) : -1;
+            unit.rate[rate::kDelta1] = unit.has_rate ? int(layout.delta_start + t + 1) : -1;
+            unit.rate[rate::kA1] = unit.has_rate ? int(layout.a_start + t + 1) : -1;
+
+            // The patterns: which inputs every constraint depends on, and which pairs of variables the Hessian of
+            // every term involves.
+            // The constraints are differentiated with respect to the few variables each one involves.
+            unit.jac_begin = jac_row.size();
+            if (unit.has_dynamics) {
+                dsl::Sparsity in[dynamics::kNumInputs];
+                seed(unit.dynamics, in);
+                for (size_t kind = 0; kind < 6; kind++) {
+                    dsl::Sparsity r = residual(kind, in);
+                    int *direction = unit.direction[kind];
+                    int directions = 0;
+                    for (int i = 0; i < dynamics::kNumInputs; i++) {
+                        direction[i] = (i < dynamics::kNumVariables && r.Depends(i)) ? directions++ : -1;
+                        if (direction[i] >= 0) {
+                            unit.jacobian.push_back(std::make_pair(kind, direction[i]));
+                            jac_row.push_back(layout.Start(kind) + t - 1);
+                            jac_col.push_back(unit.dynamics[i]);
+                        }
+                    }
+                    assert(directions <= kDirections);
+                    for (int i = 0; i < dynamics::kNumVariables; i++) {
+                        for (int j = 0; j <= i; j++) {
+                            if (r.Pair(i, j)) {
+                                addHessian(unit, int(kind), direction[i], direction[j], unit.dynamics[i],
+                                           unit.dynamics[j], slots);
+                            }
+                        }
+                    }
+                }
+            }
+            dsl::Sparsity cost_in[cost::kNumInputs];
+            seed(unit.cost, cost_in);
+            dsl::Sparsity cost_pattern = stageCost(unit, cost_in);
+            for (int i = 0; i < cost::kNumVariables; i++) {
+                for (int j = 0; j <= i; j++) {
+                    if (cost_pattern.Pair(i, j)) {
+                        addHessian(unit, kCost, i, j, unit.cost[i], unit.cost[j], slots);
+                    }
+                }
+            }
+            if (unit.has_rate) {
+                dsl::Sparsity rate_in[rate::kNumInputs];
+                seed(unit.rate, rate_in);
+                dsl::Sparsity rate_pattern = rate::cost(rate_in);
+                for (int i = 0; i < rate::kNumInputs; i++) {
+                    for (int j = 0; j <= i; j++) {
+                        if (rate_pattern.Pair(i, j)) {
+                            addHessian(unit, kRate, i, j, unit.rate[i], unit.rate[j], slots);
+                        }
+                    }
+                }
+            }
+            unit.hes_begin = hessian_parts;
+            hessian_parts += unit.hessian.size();
+        }
+        cost_part.resize(units.size());
+        gradient_part.resize(units.size() * kGradientSlots);
+        hessian_part.resize(hessian_parts);
+    }
+
+    // Threads the units are spread over.
+    size_t Threads() const { return pool.Chunks(units.size(), kGrain); }
+
+    void Structure(vector<size_t> &jac_row_, vector<size_t> &jac_col_, vector<size_t> &hes_row_,
+                   vector<size_t> &hes_col_) {
+        jac_row_ = jac_row;
+        jac_col_ = jac_col;
+        hes_row_ = hes_row;
+        hes_col_ = hes_col;
+    }
+
+    void Values(const double *x, double *fg_) {
+        pool.ParallelFor(units.size(), kGrain, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; t++) {
+                const Unit &unit = units[t];
+                double cost_in[model::cost::kNumInputs];
+                costInputs(t, x, cost_in);
+                cost_part[t] = stageCost(unit, cost_in);
+                if (unit.has_rate) {
+                    double rate_in[model::rate::kNumInputs];
+                    rateInputs(t, x, rate_in);
+                    cost_part[t] += model::rate::cost(rate_in);
+                }
+                if (unit.has_dynamics) {
+                    double in[model::dynamics::kNumInputs];
+                    dynamicsInputs(t, x, in);
+                    for (size_t kind = 0; kind < 6; kind++) {
+                        fg_[1 + layout.Start(kind) + t - 1] = residual(kind, in);
+                    }
+                }
+            }
+        });
+        fg_[0] = 0;
+        for (size_t t = 0; t < units.size(); t++) {
+            fg_[0] += cost_part[t];
+        }
+    }
+
+    void Gradient(const double *x, double *grad_f) {
+        const int kCostVariables = model::cost::kNumVariables;
+        pool.ParallelFor(units.size(), kGrain, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; t++) {
+                const Unit &unit = units[t];
+                double *part = &gradient_part[t * kGradientSlots];
+                double cost_in[model::cost::kNumInputs];
+                double cost_gradient[kCostVariables];
+                costInputs(t, x, cost_in);
+                if (unit.terminal) {
+                    dsl::Gradient<kCostVariables>(model::cost::terminal, cost_in, cost_gradient);
+                } else {
+                    dsl::Gradient<kCostVariables>(model::cost::stage, cost_in, cost_gradient);
+                }
+                double rate_gradient[model::rate::kNumInputs] = {0, 0, 0, 0};
+                if (unit.has_rate) {
+                    double rate_in[model::rate::kNumInputs];
+                    rateInputs(t, x, rate_in);
+                    dsl::Gradient<model::rate::kNumInputs>(model::rate::cost, rate_in, rate_gradient);
+                }
+                std::copy(cost_gradient, cost_gradient + kCostVariables, part);
+                std::copy(rate_gradient, rate_gradient + model::rate::kNumInputs, part + kCostVariables);
+            }
+        });
+        std::fill(grad_f, grad_f + layout.n_vars, 0.0);
+        for (size_t t = 0; t < units.size(); t++) {
+            const Unit &unit = units[t];
+            const double *part = &gradient_part[t * kGradientSlots];
+            for (int i = 0; i < kCostVariables; i++) {
+                if (unit.cost[i] >= 0) {
+                    grad_f[unit.cost[i]] += part[i];
+                }
+            }
+            for (int i = 0; i < model::rate::kNumInputs; i++) {
+                if (unit.rate[i] >= 0) {
+                    grad_f[unit.rate[i]] += part[kCostVariables + i];
+                }
+            }
+        }
+    }
+
+    void Jacobian(const double *x, double *values) {
+        typedef dsl::Dual<double, kDirections> D1;
+        pool.ParallelFor(units.size(), kGrain, [&](size_t begin, size_t end) {
+            for (size_t t = std::max<size_t>(begin, 1); t < end; t++) {
+                const Unit &unit = units[t];
+                double in[model::dynamics::kNumInputs];
+                dynamicsInputs(t, x, in);
+                D1 r[6];
+                for (size_t kind = 0; kind < 6; kind++) {
+                    D1 s[model::dynamics::kNumInputs];
+                    dsl::Seed(in, unit.direction[kind], s);
+                    r[kind] = residual(kind, s);
+                }
+                for (size_t e = 0; e < unit.jacobian.size(); e++) {
+                    values[unit.jac_begin + e] = r[unit.jacobian[e].first].d[unit.jacobian[e].second];
+                }
+            }
+        });
+    }
+
+    void Hessian(const double *x, double obj_factor, const double *lambda, double *values) {
+        const int kCostVariables = model::cost::kNumVariables;
+        const int kRateVariables = model::rate::kNumInputs;
+        typedef dsl::Dual<dsl::Dual<double, kDirections>, kDirections> D2;
+        pool.ParallelFor(units.size(), kGrain, [&](size_t begin, size_t end) {
+            for (size_t t = begin; t < end; t++) {
+                const Unit &unit = units[t];
+                // The constraints of the step weighted by their multipliers, then the cost terms.
+                D2 r[6];
+                double weight[6] = {0, 0, 0, 0, 0, 0};
+                if (unit.has_dynamics) {
+                    double in[model::dynamics::kNumInputs];
+                    dynamicsInputs(t, x, in);
+                    for (size_t kind = 0; kind < 6; kind++) {
+                        D2 s[model::dynamics::kNumInputs];
+                        dsl::Seed(in, unit.direction[kind], s);
+                        r[kind] = residual(kind, s);
+                        weight[kind] = lambda[layout.Start(kind) + t - 1];
+                    }
+                }
+                double cost_in[model::cost::kNumInputs];
+                double cost_gradient[kCostVariables];
+                double cost_hessian[kCostVariables][kCostVariables];
+                costInputs(t, x, cost_in);
+                if (unit.terminal) {
+                    dsl::Hessian<kCostVariables>(model::cost::terminal, cost_in, cost_gradient, cost_hessian);
+                } else {
+                    dsl::Hessian<kCostVariables>(model::cost::stage, cost_in, cost_gradient, cost_hessian);
+                }
+                double rate_gradient[kRateVariables];
+                double rate_hessian[kRateVariables][kRateVariables];
+                if (unit.has_rate) {
+                    double rate_in[model::rate::kNumInputs];
+                    rateInputs(t, x, rate_in);
+                    dsl::Hessian<kRateVariables>(model::rate::cost, rate_in, rate_gradient, rate_hessian);
+                }
+                double *part = &hessian_part[unit.hes_begin];
+                for (size_t e = 0; e < unit.hessian.size(); e++) {
+                    const HessianEntry &entry = unit.hessian[e];
+                    if (entry.term < kCost) {
+                        part[e] = weight[entry.term] * r[entry.term].d[entry.i].d[entry.j];
+                    } else if (entry.term == kCost) {
+                        part[e] = obj_factor * cost_hessian[entry.i][entry.j];
+                    } else {
+                        part[e] = obj_factor * rate_hessian[entry.i][entry.j];
+                    }
+                }
+            }
+        });
+        std::fill(values, values + hes_row.size(), 0.0);
+        for (size_t t = 0; t < units.size(); t++) {
+            const Unit &unit = units[t];
+            for (size_t e = 0; e < unit.hessian.size(); e++) {
+                values[unit.hessian[e].slot] += hessian_part[unit.hes_begin + e];
+            }
+        }
+    }
+
+    private:
+
+    // Fewest units a thread takes: below that handing them over costs more than it saves.
+    static const size_t kGrain = 8;
+    // Gradient entries of a unit: the variables of its cost, then its rate cost.
+    static const int kGradientSlots = model::cost::kNumVariables + model::rate::kNumInputs;
+    // Most variables a single constraint involves (the cross-track and heading errors, with five).
+    static const int kDirections = 6;
+
+    // Terms of a unit: the constraints (by VarKind, up to kEpsi), then the cost and the rate cost.
+    enum Term { kCost = 6, kRate };
+
+    // An entry of the Hessian of one term of a unit: its derivative directions (the direction of the constraint's
+    // inputs, the inputs of the cost terms) and the entry of the values it adds to.
+    struct HessianEntry {
+        int term;
+        int i;
+        int j;
+        size_t slot;
+    };
+
+    struct Unit {
+        // The NLP variable of every variable input of the terms, -1 where it is known (the state at t = 0) or the
+        // term doesn't exist.
+        int dynamics[model::dynamics::kNumVariables];
+        int cost[model::cost::kNumVariables];
+        int rate[model::rate::kNumInputs];
+        bool has_dynamics;
+        bool terminal;
+        bool has_rate;
+        // The derivative direction of every input of each constraint, -1 for those it doesn't involve.
+        int direction[6][model::dynamics::kNumInputs];
+        // Jacobian entries (kind of the constraint, direction), stored from jac_begin on.
+        std::vector<std::pair<size_t, int> > jacobian;
+        size_t jac_begin;
+        // Hessian entries, stored in hessian_part from hes_begin on.
+        std::vector<HessianEntry> hessian;
+        size_t hes_begin;
+    };
+
+    FG_eval fg;
+    Layout layout;
+    ThreadPool &pool;
+    std::vector<Unit> units;
+    std::vector<size_t> jac_row, jac_col, hes_row, hes_col;
+    // What every unit leaves for the reduction.
+    std::vector<double> cost_part, gradient_part, hessian_part;
+
+    // The variable of state `kind` at time t, -1 for t = 0.
+    int variable(size_t kind, size_t t) const { return (t == 0) ? -1 : int(layout.Start(kind) + t - 1); }
+    double at(const double *x, size_t kind, size_t t) const {
+        return (t == 0) ? fg.state0[kind] : x[layout.Start(kind) + t - 1];
+    }
+
+    void dynamicsInputs(size_t t, const double *x, double (&in)[model::dynamics::kNumInputs]) const {
+        for (size_t kind = 0; kind < 6; kind++) {
+            in[model::dynamics::kX0 + kind] = at(x, kind, t - 1);
+            in[model::dynamics::kX1 + kind] = at(x, kind, t);
+        }
+        in[model::dynamics::kDelta0] = x[layout.delta_start + t - 1];
+        in[model::dynamics::kA0] = x[layout.a_start + t - 1];
+        for (int i = 0; i < 4; i++) {
+            in[model::dynamics::kC0 + i] = fg.coeffs[i];
+        }
+    }
+
+    void costInputs(size_t t, const double *x, double (&in)[model::cost::kNumInputs]) const {
+        bool terminal = t + 1 == layout.N;
+        in[model::cost::kCte] = at(x, kCte, t);
+        in[model::cost::kEpsi] = at(x, kEpsi, t);
+        in[model::cost::kV] = at(x, kV, t);
+        in[model::cost::kDelta] = terminal ? 0 : x[layout.delta_start + t];
+        in[model::cost::kA] = terminal ? 0 : x[layout.a_start + t];
+        in[model::cost::kVRef] = fg.v_ref[t];
+        in[model::cost::kDeltaFF] = terminal ? 0 : fg.delta_ff[t];
+    }
+
+    void rateInputs(size_t t, const double *x, double (&in)[model::rate::kNumInputs]) const {
+        in[model::rate::kDelta0] = x[layout.delta_start + t];
+        in[model::rate::kA0] = x[layout.a_start + t];
+        in[model::rate::kDelta1] = x[layout.delta_start + t + 1];
+        in[model::rate::kA1] = x[layout.a_start + t + 1];
+    }
+
+    // The dynamics constraint of state `kind`, like FG_eval.
+    template <class S>
+    S residual(size_t kind, const S *in) const {
+        switch (kind) {
+            case kX: return model::dynamics::x(in);
+            case kY: return model::dynamics::y(in);
+            case kPsi: return model::dynamics::psi(in);
+            case kV: return model::dynamics::v(in);
+            case kCte: return fg.exact_cte ? model::dynamics::cte_exact(in) : model::dynamics::cte_vertical(in);
+            default: return model::dynamics::epsi(in);
+        }
+    }
+
+    template <class S>
+    S stageCost(const Unit &unit, const S *in) const {
+        return unit.terminal ? model::cost::terminal(in) : model::cost::stage(in);
+    }
+
+    // Inputs for the patterns: the variables seeded, the parameters and missing variables constant.
+    template <int K, int M>
+    static void seed(const int (&variables)[K], dsl::Sparsity (&in)[M]) {
+        for (int i = 0; i < K; i++) {
+            in[i] = (variables[i] >= 0) ? dsl::Sparsity::Input(i) : dsl::Sparsity();
+        }
+    }
+
+    // Adds the entry (i, j) of the Hessian of a term, that of the variables (vi, vj) of the NLP, to the unit. Entries
+    // no unit had before go to the end of the structure.
+    void addHessian(Unit &unit, int term, int i, int j, int vi, int vj,
+                    std::map<std::pair<size_t, size_t>, size_t> &slots) {
+        if (vi < 0 || vj < 0) {
+            return;
+        }
+        std::pair<size_t, size_t> entry(std::max(vi, vj), std::min(vi, vj));
+        auto found = slots.find(entry);
+        if (found == slots.end()) {
+            found = slots.insert(std::make_pair(entry, hes_row.size())).first;
+            hes_row.push_back(entry.first);
+            hes_col.push_back(entry.second);
+        }
+        HessianEntry hessian_entry = {term, i, j, found->second};
+        unit.hessian.push_back(hessian_entry);
+    }
+};
+
 //
 // MPC class definition implementation.
 //
 
-MPC::MPC() {}
+// Early exit (see MPC_NLP.h) is chosen with MPC_EARLY_EXIT=on|shadow. The steering resolution is a thousandth of the
+// [-1, 1] range the simulator takes, in units of our delta (which carries the Lf factor).
+static EarlyExit earlyExitFromEnv() {
+    EarlyExit early_exit;
+    const char *mode = getenv("MPC_EARLY_EXIT");
+    early_exit.mode = EarlyExit::OFF;
+    if (mode != nullptr && std::string(mode) == "on") {
+        early_exit.mode = EarlyExit::ON;
+    } else if (mode != nullptr && std::string(mode) == "shadow") {
+        early_exit.mode = EarlyExit::SHADOW;
+    }
+    early_exit.delta_resolution = 0.001 * 0.436332 * Lf;
+    early_exit.a_resolution = 0.001;
+    early_exit.stable_iterations = 2;
+    early_exit.max_infeasibility = 1e-4;
+    return early_exit;
+}
+
+static const EarlyExit early_exit = earlyExitFromEnv();
+static const bool warm_start_multipliers = getenv("MPC_WARM_START_MULTIPLIERS") != nullptr;
+// Values without derivatives come from FG_eval on doubles, unless MPC_DIRECT_EVAL=off (to compare with the tape).
+static const bool direct_eval = getenv("MPC_DIRECT_EVAL") == nullptr || std::string(getenv("MPC_DIRECT_EVAL")) != "off";
+// With MPC_STAGE_THREADS set, values and derivatives come from StageEval on that many threads instead of the tape.
+static const bool stage_eval = getenv("MPC_STAGE_THREADS") != nullptr;
+
+// User scaling (see Scaling.h) is used when a profile was loaded with MPC_SCALING_PROFILE, or with MPC_SCALING=online
+// once the profile recorded from this run's solves has enough samples.
+static bool loadScalingProfile() {
+    const char *path = getenv("MPC_SCALING_PROFILE");
+    if (path == nullptr) {
+        return false;
+    }
+    std::ifstream in(path);
+    std::stringstream text;
+    text << in.rdbuf();
+    if (!in || !GlobalScalingProfile().Load(text.str())) {
+        std::cerr << "Could not load scaling profile " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static const bool scaling_profile_loaded = loadScalingProfile();
+static const bool scaling_online = getenv("MPC_SCALING") != nullptr && std::string(getenv("MPC_SCALING")) == "online";
+static const double kMinScalingSamples = 100;
+
+// Steering above this curvature anywhere over the horizon counts as a bend in the feed-forward metrics (1/m).
+static const double kCurveCurvature = 0.02;
+
+// With MPC_SOLUTION_CACHE=on one hit in this many is solved anyway, warm started from the cached plan as with =warm,
+// so that the error of the applied plans keeps being measured.
+static const uint64_t kCacheAuditEvery = 32;
+static std::atomic<uint64_t> cache_hits_applied(0);
+
+MPC::MPC() : latency(0.1), solve_time(0), steer(0), throttle(0), last_solve(), horizon(N) {
+    // Room for the largest horizon up front: the buffers never grow after this, whatever the governor picks.
+    Layout largest(governor.MaxHorizon());
+    last_x.reserve(largest.n_vars);
+    last_zl.reserve(largest.n_vars - largest.delta_start);
+    last_zu.reserve(largest.n_vars - largest.delta_start);
+    last_lambda.reserve(largest.n_constraints);
+    last_delta_ff.reserve(largest.N - 1);
+    last_v_ref.reserve(largest.N);
+}
+
+size_t MPC::HeapBytes() const {
+    return (last_x.capacity() + last_zl.capacity() + last_zu.capacity() + last_lambda.capacity() +
+            last_delta_ff.capacity() + last_v_ref.capacity()) * sizeof(double);
+}
 
 MPC::~MPC() {}
 
-vector<double> MPC::Solve(Eigen::VectorXd state, Eigen::VectorXd coeffs) {
+vector<double> MPC::Solve(Eigen::VectorXd state, Eigen::VectorXd coeffs, const Reference &reference) {
 
+    StageScope solve_stage(kStageSolve);
     bool ok = true;
+    auto solve_begin = std::chrono::steady_clock::now();
+    const SolverEffort &effort = governor.Effort();
+    const size_t tier = governor.Tier();
+    Layout layout(effort.N);
     // To use CppAD effectively (library for automatic differentiation), we have to use its types instead of
     // regular std::vector types.
     typedef CPPAD_TESTVECTOR(double) Dvector;
 
-    double x = state[0];
-    double y = state[1];
-    double psi = state[2];
+    // x, y and psi are 0 in the car frame; the whole state goes to FG_eval.
     double v = state[3];
     double cte = state[4];
     double epsi = state[5];
 
-    // N timesteps ==> N - 1 actuations
-    // number of independent variables:
-    size_t n_vars = N * 6 + (N - 1) * 2;
-    // Number of constraints: (constraints != actuations)
-    size_t n_constraints = N * 6;
+    // number of independent variables and constraints:
+    size_t n_vars = layout.n_vars;
+    size_t n_constraints = layout.n_constraints;
+    // Bound multipliers kept between solves (see compactBounds).
+    size_t n_bounds = n_vars - layout.delta_start;
 
     // Initial value of the independent variables.
-    // Should be 0 except for the initial values.
     Dvector vars(n_vars);
     for (size_t i = 0; i < n_vars; i++) {
         vars[i] = 0.0;
     }
-    // Set the initial variable values
-    //vars[x_start] = x;
-    //vars[y_start] = y;
-    //vars[psi_start] = psi;
-    //vars[v_start] = v;
-    //vars[cte_start] = cte;
-    //vars[epsi_start] = epsi;
+
+    // Feed-forward steering: what holds the car on the reference curvature at the distance it is expected to have
+    // travelled by each actuation. With delta > 0 turning right, a left bend (curvature > 0) needs delta < 0.
+    vector<double> delta_ff(layout.N - 1, 0.0);
+    bool feedforward = FeedForwardEnabled() && !reference.curvature.empty();
+    double max_curvature = 0;
+    for (size_t t = 0; t < layout.N - 1; t++) {
+        double curvature = reference.Curvature(v * dt * t);
+        max_curvature = std::max(max_curvature, fabs(curvature));
+        if (feedforward) {
+            delta_ff[t] = std::min(std::max(-Lf * curvature, -0.436332 * Lf), 0.436332 * Lf);
+        }
+    }
+
+    // Reference speed of every stage: ref_v, or the speed profile of the track at the stage's distance, which slows
+    // down ahead of bends instead of fighting weight_v through them.
+    vector<double> v_ref(layout.N, ref_v);
+    if (!reference.speed.empty()) {
+        for (size_t t = 0; t < layout.N; t++) {
+            v_ref[t] = std::min(reference.Speed(v * dt * t), ref_v);
+        }
+    }
+
+    // Event trigger (see EventTrigger.h): while the car is where the last plan said it would be and the references
+    // haven't moved, the plan shifted by one step is as good as a new one.
+    bool reusable = false;
+    if (trigger.mode != EventTrigger::OFF && last_x.size() == n_vars && last_delta_ff.size() == delta_ff.size() &&
+        last_v_ref.size() == v_ref.size()) {
+        const double predicted[3] = {last_x[layout.v_start], last_x[layout.cte_start], last_x[layout.epsi_start]};
+        const double measured[3] = {v, cte, epsi};
+        reusable = trigger.Reusable(predicted, measured, delta_ff, shifted(last_delta_ff), v_ref, shifted(last_v_ref));
+    }
+    if (reusable && trigger.mode == EventTrigger::ON) {
+        // The car is now where the plan had it at t = 1, the first of its stages.
+        double x1 = last_x[layout.x_start], y1 = last_x[layout.y_start], psi1 = last_x[layout.psi_start];
+        vector<double> plan(n_vars);
+        shiftStages(layout, last_x, plan);
+        last_x.assign(plan.begin(), plan.end());
+        if (last_zl.size() == n_bounds && last_lambda.size() == n_constraints) {
+            vector<double> zl(n_vars), zu(n_vars), lambda(n_constraints);
+            shiftStages(layout, expandBounds(layout, last_zl), zl);
+            shiftStages(layout, expandBounds(layout, last_zu), zu);
+            shiftStages(layout, last_lambda, lambda);
+            compactBounds(layout, zl, last_zl);
+            compactBounds(layout, zu, last_zu);
+            last_lambda.assign(lambda.begin(), lambda.end());
+        }
+        // assign() rather than moves keep the buffers reserved in the constructor.
+        vector<double> delta_ff_next = shifted(last_delta_ff), v_ref_next = shifted(last_v_ref);
+        last_delta_ff.assign(delta_ff_next.begin(), delta_ff_next.end());
+        last_v_ref.assign(v_ref_next.begin(), v_ref_next.end());
+        last_solve.ok = true;
+        last_solve.reused = true;
+        last_solve.iterations = 0;
+        last_solve.horizon = layout.N;
+        last_solve.tier = tier;
+        trigger.Record(EventTrigger::REUSE, cte);
+        return actuationsAndPath(layout, last_x, x1, y1, psi1);
+    }
+
+    // Solution cache (see SolutionCache.h): a plan solved earlier for inputs in the same cells, by this session or
+    // another one, is applied as it is or warm starts this solve.
+    SolutionCache &cache = GlobalSolutionCache();
+    SolutionKey cache_key;
+    shared_ptr<const vector<double>> cached;
+    if (cache.mode != SolutionCache::OFF) {
+        cache_key = cache.Key(layout.N, v, cte, epsi, coeffs, delta_ff, v_ref);
+        cached = cache.Find(cache_key);
+        if (cached && cached->size() != n_vars) {
+            cached.reset();
+        }
+    }
+    bool audit = false;
+    if (cached && cache.mode == SolutionCache::ON) {
+        audit = ++cache_hits_applied % kCacheAuditEvery == 0;
+        if (audit) {
+            GlobalMetrics().Add("mpc_solution_cache_audits_total");
+        }
+    }
+    if (cached && cache.mode == SolutionCache::ON && !audit) {
+        last_x = *cached;
+        // The multipliers of the last solve belong to another plan.
+        last_zl.clear();
+        last_zu.clear();
+        last_lambda.clear();
+        last_delta_ff = delta_ff;
+        last_v_ref = v_ref;
+        last_solve.ok = true;
+        last_solve.reused = true;
+        last_solve.iterations = 0;
+        last_solve.horizon = layout.N;
+        last_solve.tier = tier;
+        if (trigger.mode != EventTrigger::OFF) {
+            trigger.Record(EventTrigger::CACHE, cte);
+        }
+        return actuationsAndPath(layout, last_x);
+    }
+
+    // Warm start from the previous solution, shifted by one step. Only the frame independent parts are reused
+    // (speed, errors and actuations): x, y and psi of the last plan were expressed in the previous car frame. The
+    // steering of the last actuation, which the shift only repeats, and a cold start take the feed-forward instead.
+    if (last_x.size() == n_vars) {
+        shiftStages(layout, last_x, vars);
+        for (size_t i = layout.x_start; i < layout.v_start; i++) {
+            vars[i] = 0.0;
+        }
+        if (feedforward) {
+            vars[layout.a_start - 1] = delta_ff[layout.N - 2];
+        }
+    } else {
+        for (size_t t = 0; t < layout.N - 1; t++) {
+            vars[layout.delta_start + t] = delta_ff[t];
+        }
+    }
+    if (cached) {
+        for (size_t i = 0; i < n_vars; i++) {
+            vars[i] = (*cached)[i];
+        }
+    }
 
     // Lower and upper limits for variables
     Dvector vars_lowerbound(n_vars);
     Dvector vars_upperbound(n_vars);
     // Set all non-actuators upper and lowerlimits
     // to the max negative and positive values.
-    for (size_t i = 0; i < delta_start; i++) {
+    for (size_t i = 0; i < layout.delta_start; i++) {
         vars_lowerbound[i] = -1.0e19;
         vars_upperbound[i] = 1.0e19;
     }
     // The upper and lower limits of delta are set to -25 and 25 degrees (values in radians).
-    for (size_t i = delta_start; i < a_start; i++) {
+    for (size_t i = layout.delta_start; i < layout.a_start; i++) {
         vars_lowerbound[i] = -0.436332 * Lf;
         vars_upperbound[i] = 0.436332 * Lf;
     }
     // Acceleration upper and lower limits.
-    for (size_t i = a_start; i < n_vars; i++) {
+    for (size_t i = layout.a_start; i < n_vars; i++) {
         vars_lowerbound[i] = -1.0;
         vars_upperbound[i] = 1.0;
     }
@@ -206,79 +1027,247 @@ vector<double> MPC::Solve(Eigen::VectorXd state, Eigen::VectorXd coeffs) {
     ////////////////////////////
 
     // Lower and upper limits for constraints
-    // All of these should be 0 except the initial state indices.
+    // All of these are 0: the dynamics hold exactly.
     Dvector constraints_lowerbound(n_constraints);
     Dvector constraints_upperbound(n_constraints);
     for (size_t i = 0; i < n_constraints; i++) {
         constraints_lowerbound[i] = 0;
         constraints_upperbound[i] = 0;
     }
-    constraints_lowerbound[x_start] = x;
-    constraints_lowerbound[y_start] = y;
-    constraints_lowerbound[psi_start] = psi;
-    constraints_lowerbound[v_start] = v;
-    constraints_lowerbound[cte_start] = cte;
-    constraints_lowerbound[epsi_start] = epsi;
-
-    constraints_upperbound[x_start] = x;
-    constraints_upperbound[y_start] = y;
-    constraints_upperbound[psi_start] = psi;
-    constraints_upperbound[v_start] = v;
-    constraints_upperbound[cte_start] = cte;
-    constraints_upperbound[epsi_start] = epsi;
 
     ////////////////////////////
 
     // object that computes objective and constraints
-    FG_eval fg_eval(coeffs);
+    FG_eval fg_eval(coeffs, state, delta_ff, v_ref, layout);
+
+    // The NLP Ipopt works on (see MPC_NLP.h). Ipopt's SmartPtr owns it, we keep a reference to read the results.
+    // Stage by stage evaluation, if enabled, has to outlive the NLP.
+    StageScope tape_stage(kStageTape);
+    std::unique_ptr<StageEval> stages;
+    std::shared_ptr<const ProblemTape> tape;
+    if (stage_eval) {
+        stages.reset(new StageEval(fg_eval, GlobalStagePool()));
+    } else {
+        // Recorded by the first solve of this shape in the process, shared with all the others.
+        tape = GlobalProblemRegistry().Get(fg_eval.Key(), [&] {
+            return new ProblemTape(fg_eval, vars, fg_eval.parameters, n_constraints);
+        });
+    }
+    MPC_NLP<FG_eval> *nlp = new MPC_NLP<FG_eval>(fg_eval, vars, vars_lowerbound, vars_upperbound,
+                                                 constraints_lowerbound, constraints_upperbound, tape,
+                                                 fg_eval.parameters, stages.get());
+    tape_stage.End();
+    Ipopt::SmartPtr<Ipopt::TNLP> nlp_owner = nlp;
+    MPC_NLP<FG_eval> &solution = *nlp;
+    nlp->direct_eval = direct_eval;
+    nlp->early_exit = early_exit;
+    nlp->delta_index = layout.delta_start;
+    nlp->a_index = layout.a_start;
 
     //
     // NOTE: You don't have to worry about these options
     //
     // options for IPOPT solver
-    std::string options;
-    // Uncomment this if you'd like more print information
-    options += "Integer print_level  0\n";
-    // NOTE: Setting sparse to true allows the solver to take advantage
-    // of sparse routines, this makes the computation MUCH FASTER. If you
-    // can uncomment 1 of these and see if it makes a difference or not but
-    // if you uncomment both the computation time should go up in orders of
-    // magnitude.
-    options += "Sparse  true        forward\n";
-    options += "Sparse  true        reverse\n";
-    // NOTE: Currently the solver has a maximum time limit of 0.5 seconds.
-    // Change this as you see fit.
-
-    options += "Numeric max_cpu_time          0.5\n";
-
-    // place to return solution
-    CppAD::ipopt::solve_result<Dvector> solution;
+    Ipopt::SmartPtr<Ipopt::IpoptApplication> app = IpoptApplicationFactory();
+    // Raise this if you'd like more print information
+    app->Options()->SetIntegerValue("print_level", 0);
+    app->Options()->SetStringValue("sb", "yes");
+    // NOTE: The time limit, iteration cap and tolerances come from the governor: 0.5 seconds and Ipopt's defaults
+    // while the host is quiet, less when we are missing deadlines. The acceptable tier lets Ipopt stop after a few
+    // iterations at a looser tolerance when it can't make the tight one.
+    app->Options()->SetNumericValue("max_cpu_time", effort.max_cpu_time);
+    app->Options()->SetIntegerValue("max_iter", effort.max_iter);
+    app->Options()->SetNumericValue("tol", effort.tol);
+    app->Options()->SetNumericValue("acceptable_tol", effort.acceptable_tol);
+    app->Options()->SetIntegerValue("acceptable_iter", effort.acceptable_iter);
+
+    // Continue from the multipliers of the last solve, shifted like the variables.
+    if (warm_start_multipliers && last_zl.size() == n_bounds && last_lambda.size() == n_constraints) {
+        Dvector zl(n_vars), zu(n_vars), lambda(n_constraints);
+        shiftStages(layout, expandBounds(layout, last_zl), zl);
+        shiftStages(layout, expandBounds(layout, last_zu), zu);
+        shiftStages(layout, last_lambda, lambda);
+        nlp->WarmStart(zl, zu, lambda);
+        app->Options()->SetStringValue("warm_start_init_point", "yes");
+    }
+
+    // Scale every variable and every dynamics constraint by the typical magnitude of its kind.
+    ScalingProfile &profile = GlobalScalingProfile();
+    bool scaled = scaling_profile_loaded || (scaling_online && profile.Samples() >= kMinScalingSamples);
+    if (scaled) {
+        Dvector x_scaling(n_vars), g_scaling(n_constraints);
+        for (size_t kind = 0; kind < kNumKinds; kind++) {
+            double scale = profile.VarScale(kind);
+            for (size_t t = 0; t < layout.Length(kind); t++) {
+                x_scaling[layout.Start(kind) + t] = scale;
+                if (kind < kDelta) {
+                    g_scaling[layout.Start(kind) + t] = scale;
+                }
+            }
+        }
+        nlp->Scale(profile.ObjectiveScale(), x_scaling, g_scaling);
+        app->Options()->SetStringValue("nlp_scaling_method", "user-scaling");
+    }
 
     // solve the problem
-    CppAD::ipopt::solve<Dvector, FG_eval>(
-      options, vars, vars_lowerbound, vars_upperbound, constraints_lowerbound,
-      constraints_upperbound, fg_eval, solution);
+    bool initialized = app->Initialize() == Ipopt::Solve_Succeeded;
+    StageScope ipopt_stage(kStageIpopt);
+    if (initialized) {
+        app->OptimizeTNLP(nlp_owner);
+    } else {
+        // Bad options: fail the solve and fall back on the warm start.
+        GlobalMetrics().Add("mpc_ipopt_initialize_failed_total");
+        solution.x = vars;
+        ok = false;
+    }
+    ipopt_stage.End();
 
-    // Check some of the solution values
-    ok &= solution.status == CppAD::ipopt::solve_result<Dvector>::success;
+    // Check some of the solution values. Stopping early on purpose is as good as converging.
+    ok &= solution.status == Ipopt::SUCCESS || solution.stopped_early;
 
     // Cost
     auto cost = solution.obj_value;
     std::cout << "Cost " << cost << std::endl;
 
-    // Return the first actuator values. The variables can be accessed with `solution.x[i]`.
-    //
-    // {...} is shorthand for creating a vector, so auto x1 = {1.0,2.0} creates a 2 element double vector.
+    GlobalMetrics().Add("mpc_solves_total");
+    GlobalMetrics().Add("mpc_ipopt_iterations_total", solution.iterations);
+    GlobalMetrics().Observe("mpc_ipopt_iterations", solution.iterations, CountBounds());
+    if (solution.stopped_early) {
+        GlobalMetrics().Add("mpc_early_exit_total");
+    } else if (early_exit.mode == EarlyExit::SHADOW && solution.exit_iteration >= 0) {
+        // What stopping early would have saved, and how far off the first move would have been.
+        GlobalMetrics().Add("mpc_early_exit_shadow_total");
+        GlobalMetrics().Add("mpc_early_exit_saved_iterations_total", solution.iterations - solution.exit_iteration);
+        GlobalMetrics().Observe("mpc_early_exit_delta_error",
+                                fabs(solution.exit_delta - solution.x[layout.delta_start]));
+        GlobalMetrics().Observe("mpc_early_exit_a_error", fabs(solution.exit_a - solution.x[layout.a_start]));
+    }
 
-    vector<double> result;
+    // How far the cached plan was from the full solve, and keep this one for inputs like these.
+    if (cached) {
+        GlobalMetrics().Observe("mpc_solution_cache_delta_error",
+                                fabs((*cached)[layout.delta_start] - solution.x[layout.delta_start]));
+        GlobalMetrics().Observe("mpc_solution_cache_a_error",
+                                fabs((*cached)[layout.a_start] - solution.x[layout.a_start]));
+    }
+    if (ok && cache.mode != SolutionCache::OFF) {
+        cache.Insert(cache_key, make_shared<const vector<double>>(solution.x.data(), solution.x.data() + n_vars));
+    }
 
-    result.push_back(solution.x[delta_start]);
-    result.push_back(solution.x[a_start]);
+    // What applying the shifted plan would have cost in the first actuations.
+    if (reusable && trigger.mode == EventTrigger::SHADOW) {
+        GlobalMetrics().Add("mpc_event_trigger_shadow_reusable_total");
+        GlobalMetrics().Observe("mpc_event_trigger_delta_error",
+                                fabs(last_x[layout.delta_start + 1] - solution.x[layout.delta_start]));
+        GlobalMetrics().Observe("mpc_event_trigger_a_error",
+                                fabs(last_x[layout.a_start + 1] - solution.x[layout.a_start]));
+    }
+    if (trigger.mode != EventTrigger::OFF) {
+        trigger.Record(EventTrigger::SOLVE, cte);
+    }
 
-    for (size_t i = 0; i < N - 1; i++) {
-        result.push_back(solution.x[x_start + i + 1]);
-        result.push_back(solution.x[y_start + i + 1]);
+    // Keep the solution around for the next warm start and for session snapshots, and learn the magnitudes of the
+    // variables for scaling.
+    if (ok) {
+        for (size_t kind = 0; kind < kNumKinds; kind++) {
+            for (size_t t = 0; t < layout.Length(kind); t++) {
+                profile.Observe(kind, solution.x[layout.Start(kind) + t]);
+            }
+        }
+        profile.ObserveObjective(cost);
+        horizon = layout.N;
+        last_x.assign(solution.x.data(), solution.x.data() + solution.x.size());
+        compactBounds(layout, solution.zl, last_zl);
+        compactBounds(layout, solution.zu, last_zu);
+        last_lambda.assign(solution.lambda.data(), solution.lambda.data() + solution.lambda.size());
+        last_delta_ff = delta_ff;
+        last_v_ref = v_ref;
     }
 
-    return result;
+    last_solve.ok = ok;
+    last_solve.reused = false;
+    last_solve.iterations = solution.iterations;
+    last_solve.horizon = layout.N;
+    last_solve.tier = tier;
+    last_solve.cost = cost;
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - solve_begin).count();
+    solve_time = (solve_time == 0) ? elapsed : 0.9 * solve_time + 0.1 * elapsed;
+    governor.Record(elapsed);
+    RecordLiveSolve(solution.iterations, elapsed > governor.deadline);
+    GlobalMetrics().Observe("mpc_solve_seconds", elapsed);
+    // Totals per scaling mode, to compare iterations and solve time with and without user scaling.
+    const std::string scaling_label = scaled ? "{scaling=\"user\"}" : "{scaling=\"ipopt\"}";
+    GlobalMetrics().Add("mpc_scaling_solves_total" + scaling_label);
+    GlobalMetrics().Add("mpc_scaling_iterations_total" + scaling_label, solution.iterations);
+    GlobalMetrics().Add("mpc_scaling_solve_seconds_total" + scaling_label, elapsed);
+    // Values-only evaluations, on doubles, on the tape or stage by stage.
+    const std::string eval_label = stages        ? "{path=\"stages\"}"
+                                   : direct_eval ? "{path=\"direct\"}"
+                                                 : "{path=\"tape\"}";
+    GlobalMetrics().Add("mpc_nlp_value_evals_total" + eval_label, solution.value_evals);
+    GlobalMetrics().Add("mpc_nlp_value_eval_seconds_total" + eval_label, solution.value_eval_seconds);
+    // Gradient, Jacobian and Hessian evaluations by path, threads and horizon: the speedup of the stages over the
+    // tape, and of more threads, at every horizon.
+    std::ostringstream derivative_label;
+    derivative_label << "{path=\"" << (stages ? "stages" : "tape") << "\",threads=\""
+                     << (stages ? stages->Threads() : 1) << "\",horizon=\"" << layout.N << "\"}";
+    GlobalMetrics().Add("mpc_nlp_derivative_evals_total" + derivative_label.str(), solution.derivative_evals);
+    GlobalMetrics().Add("mpc_nlp_derivative_seconds_total" + derivative_label.str(), solution.derivative_seconds);
+    if (!ok) {
+        GlobalMetrics().Add("mpc_solve_failed_total");
+    }
+    // Totals with and without the feed-forward, in bends and on straights, to see what it saves where it matters.
+    const std::string feedforward_label = std::string("{feedforward=\"") + (feedforward ? "on" : "off") +
+                                          "\",segment=\"" + (max_curvature > kCurveCurvature ? "curve" : "straight") +
+                                          "\"}";
+    GlobalMetrics().Add("mpc_feedforward_solves_total" + feedforward_label);
+    GlobalMetrics().Add("mpc_feedforward_iterations_total" + feedforward_label, solution.iterations);
+
+    // Return the first actuator values. The variables can be accessed with `solution.x[i]`.
+    return actuationsAndPath(layout, solution.x);
+}
+
+SessionState MPC::ExportState() const {
+    SessionState state;
+    state.N = horizon;
+    state.dt = dt;
+    state.latency = latency;
+    state.solve_time = solve_time;
+    state.steer = steer;
+    state.throttle = throttle;
+    state.x = last_x;
+    // The snapshot has the full multipliers, as Ipopt gave them.
+    if (!last_zl.empty()) {
+        state.zl = expandBounds(Layout(horizon), last_zl);
+        state.zu = expandBounds(Layout(horizon), last_zu);
+    }
+    state.lambda = last_lambda;
+    return state;
+}
+
+bool MPC::ImportState(const SessionState &state) {
+    // A solution for another time step can't be used as a warm start here. Another horizon is fine, the warm start
+    // is simply skipped until the governor picks that horizon again.
+    if (state.dt != dt) {
+        return false;
+    }
+    horizon = state.N;
+    latency = state.latency;
+    solve_time = state.solve_time;
+    steer = state.steer;
+    throttle = state.throttle;
+    last_x = state.x;
+    Layout layout(state.N);
+    last_zl.clear();
+    last_zu.clear();
+    if (state.N >= 2 && state.zl.size() == layout.n_vars && state.zu.size() == layout.n_vars) {
+        compactBounds(layout, state.zl, last_zl);
+        compactBounds(layout, state.zu, last_zu);
+    }
+    last_lambda = state.lambda;
+    // The snapshot doesn't carry the references the plan was solved for, so the next cycle solves.
+    last_delta_ff.clear();
+    last_v_ref.clear();
+    return true;
 }
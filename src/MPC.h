@@ -3,6 +3,10 @@
 
 #include <vector>
 #include "Eigen-3.3/Eigen/Core"
+#include "EventTrigger.h"
+#include "Governor.h"
+#include "Reference.h"
+#include "SessionState.h"
 
 using namespace std;
 
@@ -14,7 +18,55 @@ class MPC {
 
   // Solve the model given an initial state and polynomial coefficients.
   // Return the first actuatotions.
-  vector<double> Solve(Eigen::VectorXd state, Eigen::VectorXd coeffs);
+  // The reference (see Reference.h) gives the feed-forward steering the solve starts from.
+  vector<double> Solve(Eigen::VectorXd state, Eigen::VectorXd coeffs, const Reference &reference = Reference());
+
+  // Snapshot of the warm-start data and latency model, so the session can be continued by another MPC instance
+  // (possibly in another process). ImportState returns false if the snapshot does not match our horizon.
+  SessionState ExportState() const;
+  bool ImportState(const SessionState &state);
+
+  // Bytes of the warm-start buffers. They are reserved for the largest horizon of the governor up front, so this
+  // doesn't change from solve to solve.
+  size_t HeapBytes() const;
+
+  // Actuation latency we predict the state over (s).
+  double latency;
+  // Exponential moving average of the measured solve time (s).
+  double solve_time;
+  // Last actuations sent back to the simulator, kept for the snapshot.
+  double steer;
+  double throttle;
+
+  // Statistics of the last solve. A reused plan (see EventTrigger.h) or a cached one (see SolutionCache.h) counts as
+  // a solve of no iterations.
+  struct SolveStats {
+    bool ok;
+    bool reused;
+    int iterations;
+    size_t horizon;
+    // Governor tier the solve ran at; the governor may have moved on since (see Governor::Record).
+    size_t tier;
+    double cost;
+  } last_solve;
+
+  // Chooses horizon, iteration cap and tolerances of every solve.
+  Governor governor;
+  // Decides when the last plan can be reused instead of solving.
+  EventTrigger trigger;
+
+ private:
+  // Horizon of the last solution.
+  size_t horizon;
+  // Last solution and multipliers, used to warm start the next solve. Only the bound multipliers of the actuations
+  // are kept, the states have no bounds.
+  vector<double> last_x;
+  vector<double> last_zl;
+  vector<double> last_zu;
+  vector<double> last_lambda;
+  // Feed-forward steering and reference speeds the last solution was solved for, shifted along with it.
+  vector<double> last_delta_ff;
+  vector<double> last_v_ref;
 };
 
 #endif /* MPC_H */
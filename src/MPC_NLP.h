@@ -0,0 +1,463 @@
+#ifndef MPC_NLP_H
+#define MPC_NLP_H
+
+#include <math.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <set>
+#include <vector>
+#include <coin/IpIpoptApplication.hpp>
+#include <coin/IpTNLP.hpp>
+#include <cppad/cppad.hpp>
+#include "ProblemTape.h"
+
+using namespace std;
+
+// When to stop before Ipopt has converged the whole trajectory. Only the first steering and throttle values are
+// ever applied, so once they stop moving between iterations (within what the actuators can resolve) the rest of the
+// iterations don't change what the car does.
+struct EarlyExit {
+  enum Mode {
+    OFF,
+    ON,
+    // Run to convergence, but record when we would have stopped (to measure the savings and the error).
+    SHADOW,
+  };
+  Mode mode;
+  // Changes of the first actuations smaller than these are invisible to the car.
+  double delta_resolution;
+  double a_resolution;
+  // Consecutive stable iterations required.
+  int stable_iterations;
+  // Dynamics must hold at least this well before we trust the first move.
+  double max_infeasibility;
+};
+
+// Values and derivatives computed outside the tape, stage by stage (StageEval in MPC.cpp). The sparsity structure
+// is fixed: it is read once, when the NLP is built.
+class StageDerivatives {
+ public:
+  virtual ~StageDerivatives() {}
+  // Entries of the constraint Jacobian (constraint rows counted from 0) and of the lower triangle of the Hessian of
+  // the Lagrangian, in the order of the values below.
+  virtual void Structure(vector<size_t> &jac_row, vector<size_t> &jac_col, vector<size_t> &hes_row,
+                         vector<size_t> &hes_col) = 0;
+  // The cost in fg[0] and the constraints in fg[1...], like FG_eval.
+  virtual void Values(const double *x, double *fg) = 0;
+  virtual void Gradient(const double *x, double *grad_f) = 0;
+  virtual void Jacobian(const double *x, double *values) = 0;
+  virtual void Hessian(const double *x, double obj_factor, const double *lambda, double *values) = 0;
+};
+
+// The NLP handed to Ipopt. This plays the role of CppAD::ipopt::solve, with two additions we need: an iteration
+// callback (for EarlyExit and iteration counts) and warm starting of the multipliers.
+//
+// FG_eval is the same kind of functor CppAD::ipopt::solve takes: fg_eval(fg, vars) computes the cost in fg[0] and
+// the constraints in fg[1...]. The derivatives come from its tape (ProblemTape.h), recorded once per problem shape
+// with fg_eval(fg, vars, params) and shared by all solves of that shape; the solve's own parameters are set on the
+// calling thread's copy of it. If its operator() is a template over the vector type, the values Ipopt asks for
+// without derivatives (eval_f, eval_g, most of them from the line search) are computed by calling it on doubles
+// instead of a zero order sweep of the tape.
+//
+// Given StageDerivatives, nothing is taped: values and derivatives all come from it.
+template <class FG_eval>
+class MPC_NLP : public Ipopt::TNLP {
+ public:
+  typedef CPPAD_TESTVECTOR(double) Dvector;
+  typedef CPPAD_TESTVECTOR(CppAD::AD<double>) ADvector;
+  typedef Ipopt::Index Index;
+  typedef Ipopt::Number Number;
+
+  // The tape of the problem and the parameters of this solve, or the stage derivatives and no tape.
+  MPC_NLP(FG_eval &fg_eval, const Dvector &xi, const Dvector &xl, const Dvector &xu, const Dvector &gl,
+          const Dvector &gu, shared_ptr<const ProblemTape> tape, const Dvector &params,
+          StageDerivatives *stages = nullptr)
+      : direct_eval(true), value_evals(0), value_eval_seconds(0), derivative_evals(0), derivative_seconds(0),
+        delta_index(0), a_index(0),
+        status(Ipopt::UNASSIGNED), obj_value(0), iterations(0), stopped_early(false),
+        exit_iteration(-1), exit_delta(0), exit_a(0), n(xi.size()), m(gl.size()), xi(xi), xl(xl), xu(xu), gl(gl),
+        gu(gu), warm_multipliers(false), scaled(false), obj_scaling(1), stable_count(0), last_delta(0), last_a(0),
+        have_iterate(false), iterate_delta(0), iterate_a(0), eval(fg_eval), stages(stages), tape(tape), params(params), id(nextId()), have_fg(false), tape_at_x(false) {
+    early_exit.mode = EarlyExit::OFF;
+    if (stages != nullptr) {
+      Structure();
+    } else {
+      jac_row = tape->jac_row;
+      jac_col = tape->jac_col;
+      hes_row = tape->hes_row;
+      hes_col = tape->hes_col;
+    }
+  }
+
+  // Optional starting values for the bound multipliers and the constraint multipliers.
+  void WarmStart(const Dvector &zl0, const Dvector &zu0, const Dvector &lambda0) {
+    zl = zl0;
+    zu = zu0;
+    lambda = lambda0;
+    warm_multipliers = true;
+  }
+
+  // Optional user scaling of the objective, the variables and the constraints (for Ipopt's
+  // nlp_scaling_method user-scaling).
+  void Scale(double obj, const Dvector &x_scaling, const Dvector &g_scaling) {
+    obj_scaling = obj;
+    var_scaling = x_scaling;
+    constraint_scaling = g_scaling;
+    scaled = true;
+  }
+
+  // Compute values on doubles (see above) rather than with Forward(0) on the tape.
+  bool direct_eval;
+  // Evaluations of values only and the time they took (s), to compare both ways.
+  int value_evals;
+  double value_eval_seconds;
+  // Evaluations of the gradient, the Jacobian and the Hessian and the time they took (s).
+  int derivative_evals;
+  double derivative_seconds;
+
+  // Early exit watches vars[delta_index] and vars[a_index].
+  EarlyExit early_exit;
+  size_t delta_index;
+  size_t a_index;
+
+  // Results, valid after Ipopt returned.
+  Ipopt::SolverReturn status;
+  Dvector x;
+  Dvector zl;
+  Dvector zu;
+  Dvector g;
+  Dvector lambda;
+  double obj_value;
+  int iterations;
+  bool stopped_early;
+  // Iteration at which early exit triggered (or would have, in shadow mode), -1 if it didn't, and the first moves
+  // at that point.
+  int exit_iteration;
+  double exit_delta;
+  double exit_a;
+
+  bool get_nlp_info(Index &n_, Index &m_, Index &nnz_jac_g, Index &nnz_h_lag, IndexStyleEnum &index_style) {
+    n_ = n;
+    m_ = m;
+    nnz_jac_g = jac_row.size();
+    nnz_h_lag = hes_row.size();
+    index_style = C_STYLE;
+    return true;
+  }
+
+  bool get_bounds_info(Index, Number *x_l, Number *x_u, Index, Number *g_l, Number *g_u) {
+    for (size_t j = 0; j < n; j++) {
+      x_l[j] = xl[j];
+      x_u[j] = xu[j];
+    }
+    for (size_t i = 0; i < m; i++) {
+      g_l[i] = gl[i];
+      g_u[i] = gu[i];
+    }
+    return true;
+  }
+
+  bool get_scaling_parameters(Number &obj_scaling_, bool &use_x_scaling, Index, Number *x_scaling,
+                              bool &use_g_scaling, Index, Number *g_scaling) {
+    if (!scaled) {
+      return false;
+    }
+    obj_scaling_ = obj_scaling;
+    use_x_scaling = true;
+    use_g_scaling = true;
+    for (size_t j = 0; j < n; j++) {
+      x_scaling[j] = var_scaling[j];
+    }
+    for (size_t i = 0; i < m; i++) {
+      g_scaling[i] = constraint_scaling[i];
+    }
+    return true;
+  }
+
+  bool get_starting_point(Index, bool init_x, Number *x0, bool init_z, Number *z_L, Number *z_U, Index,
+                          bool init_lambda, Number *lambda0) {
+    if (init_x) {
+      for (size_t j = 0; j < n; j++) {
+        x0[j] = xi[j];
+      }
+    }
+    if ((init_z || init_lambda) && !warm_multipliers) {
+      return false;
+    }
+    if (init_z) {
+      for (size_t j = 0; j < n; j++) {
+        z_L[j] = zl[j];
+        z_U[j] = zu[j];
+      }
+    }
+    if (init_lambda) {
+      for (size_t i = 0; i < m; i++) {
+        lambda0[i] = lambda[i];
+      }
+    }
+    return true;
+  }
+
+  bool eval_f(Index, const Number *x_, bool new_x, Number &obj) {
+    Evaluate(x_, new_x);
+    obj = fg[0];
+    return true;
+  }
+
+  bool eval_grad_f(Index, const Number *x_, bool new_x, Number *grad_f) {
+    Evaluate(x_, new_x, false);
+    noteIterate();
+    Timer timer(*this);
+    if (stages != nullptr) {
+      stages->Gradient(xcur.data(), grad_f);
+      return true;
+    }
+    // The reverse sweep needs the tape's own values at x.
+    CppAD::ADFun<double> &fun = Workspace().fun;
+    if (!tape_at_x) {
+      fun.Forward(0, xcur);
+      tape_at_x = true;
+    }
+    Dvector w(m + 1);
+    for (size_t i = 0; i <= m; i++) {
+      w[i] = 0;
+    }
+    w[0] = 1;
+    Dvector dw = fun.Reverse(1, w);
+    for (size_t j = 0; j < n; j++) {
+      grad_f[j] = dw[j];
+    }
+    return true;
+  }
+
+  bool eval_g(Index, const Number *x_, bool new_x, Index, Number *g_) {
+    Evaluate(x_, new_x);
+    for (size_t i = 0; i < m; i++) {
+      g_[i] = fg[i + 1];
+    }
+    return true;
+  }
+
+  bool eval_jac_g(Index, const Number *x_, bool new_x, Index, Index, Index *iRow, Index *jCol, Number *values) {
+    if (values == nullptr) {
+      // The range of the tape includes the cost, constraint i is row i + 1.
+      for (size_t k = 0; k < jac_row.size(); k++) {
+        iRow[k] = jac_row[k] - 1;
+        jCol[k] = jac_col[k];
+      }
+      return true;
+    }
+    Evaluate(x_, new_x, false);
+    noteIterate();
+    Timer timer(*this);
+    if (stages != nullptr) {
+      stages->Jacobian(xcur.data(), values);
+      return true;
+    }
+    ProblemTape::Workspace &workspace = Workspace();
+    Dvector jac(jac_row.size());
+    workspace.fun.SparseJacobianReverse(xcur, tape->jac_pattern, jac_row, jac_col, jac, workspace.jac_work);
+    tape_at_x = true;
+    for (size_t k = 0; k < jac_row.size(); k++) {
+      values[k] = jac[k];
+    }
+    return true;
+  }
+
+  bool eval_h(Index, const Number *x_, bool new_x, Number obj_factor, Index, const Number *lambda_, bool, Index,
+              Index *iRow, Index *jCol, Number *values) {
+    if (values == nullptr) {
+      for (size_t k = 0; k < hes_row.size(); k++) {
+        iRow[k] = hes_row[k];
+        jCol[k] = hes_col[k];
+      }
+      return true;
+    }
+    Evaluate(x_, new_x, false);
+    Timer timer(*this);
+    if (stages != nullptr) {
+      stages->Hessian(xcur.data(), obj_factor, lambda_, values);
+      return true;
+    }
+    Dvector w(m + 1);
+    w[0] = obj_factor;
+    for (size_t i = 0; i < m; i++) {
+      w[i + 1] = lambda_[i];
+    }
+    ProblemTape::Workspace &workspace = Workspace();
+    Dvector hes(hes_row.size());
+    workspace.fun.SparseHessian(xcur, w, tape->hes_pattern, hes_row, hes_col, hes, workspace.hes_work);
+    for (size_t k = 0; k < hes_row.size(); k++) {
+      values[k] = hes[k];
+    }
+    return true;
+  }
+
+  void finalize_solution(Ipopt::SolverReturn status_, Index, const Number *x_, const Number *z_L,
+                         const Number *z_U, Index, const Number *g_, const Number *lambda_, Number obj,
+                         const Ipopt::IpoptData *, Ipopt::IpoptCalculatedQuantities *) {
+    status = status_;
+    x.resize(n);
+    zl.resize(n);
+    zu.resize(n);
+    g.resize(m);
+    lambda.resize(m);
+    for (size_t j = 0; j < n; j++) {
+      x[j] = x_[j];
+      zl[j] = z_L[j];
+      zu[j] = z_U[j];
+    }
+    for (size_t i = 0; i < m; i++) {
+      g[i] = g_[i];
+      lambda[i] = lambda_[i];
+    }
+    obj_value = obj;
+  }
+
+  bool intermediate_callback(Ipopt::AlgorithmMode mode, Index iter, Number, Number inf_pr, Number, Number,
+                             Number, Number, Number, Number, Index, const Ipopt::IpoptData *,
+                             Ipopt::IpoptCalculatedQuantities *) {
+    iterations = iter;
+    if (early_exit.mode == EarlyExit::OFF || exit_iteration >= 0 || mode != Ipopt::RegularMode || !have_iterate) {
+      return true;
+    }
+    // Not xcur: the line search may have evaluated (and rejected) trial points since the iterate was accepted.
+    double delta = iterate_delta;
+    double a = iterate_a;
+    bool stable = iter > 0 && inf_pr <= early_exit.max_infeasibility &&
+                  fabs(delta - last_delta) <= early_exit.delta_resolution &&
+                  fabs(a - last_a) <= early_exit.a_resolution;
+    stable_count = stable ? stable_count + 1 : 0;
+    last_delta = delta;
+    last_a = a;
+    if (stable_count < early_exit.stable_iterations) {
+      return true;
+    }
+    exit_iteration = iter;
+    exit_delta = delta;
+    exit_a = a;
+    stopped_early = early_exit.mode == EarlyExit::ON;
+    // Returning false makes Ipopt stop with User_Requested_Stop and hand us the current iterate.
+    return !stopped_early;
+  }
+
+ private:
+  size_t n;
+  size_t m;
+  Dvector xi, xl, xu, gl, gu;
+  bool warm_multipliers;
+  bool scaled;
+  double obj_scaling;
+  Dvector var_scaling, constraint_scaling;
+
+  int stable_count;
+  double last_delta;
+  double last_a;
+  // The first actuations of the current iterate. Ipopt evaluates derivatives at accepted iterates only, never at
+  // trial points, and it has evaluated them at the current one by the time it calls intermediate_callback.
+  bool have_iterate;
+  double iterate_delta;
+  double iterate_a;
+
+  FG_eval eval;
+  StageDerivatives *stages;
+  shared_ptr<const ProblemTape> tape;
+  Dvector params;
+  // Tells the workspaces which NLP last set their parameters.
+  uint64_t id;
+  CPPAD_TESTVECTOR(size_t) jac_row, jac_col;
+  CPPAD_TESTVECTOR(size_t) hes_row, hes_col;
+
+  // Point of the last evaluation and fg there, and whether the tape holds a zero order sweep at that point.
+  Dvector xcur;
+  Dvector fg;
+  bool have_fg;
+  bool tape_at_x;
+
+  static uint64_t nextId() {
+    static atomic<uint64_t> last(0);
+    return ++last;
+  }
+
+  // The calling thread's copy of the tape, at the parameters of this solve. Other solves may have used it since the
+  // last call, in which case its last sweep isn't ours either.
+  ProblemTape::Workspace &Workspace() {
+    ProblemTape::Workspace &workspace = tape->ThreadWorkspace();
+    if (workspace.owner != id) {
+      workspace.fun.new_dynamic(params);
+      workspace.owner = id;
+      tape_at_x = false;
+    }
+    return workspace;
+  }
+
+  // The patterns of the stage derivatives, in the form Tape leaves them in.
+  void Structure() {
+    vector<size_t> jr, jc, hr, hc;
+    stages->Structure(jr, jc, hr, hc);
+    jac_row.resize(jr.size());
+    jac_col.resize(jc.size());
+    for (size_t k = 0; k < jr.size(); k++) {
+      jac_row[k] = jr[k] + 1;
+      jac_col[k] = jc[k];
+    }
+    hes_row.resize(hr.size());
+    hes_col.resize(hc.size());
+    for (size_t k = 0; k < hr.size(); k++) {
+      hes_row[k] = hr[k];
+      hes_col[k] = hc[k];
+    }
+  }
+
+  // Adds the time until it goes out of scope to the derivative totals.
+  struct Timer {
+    MPC_NLP &nlp;
+    chrono::steady_clock::time_point begin;
+    explicit Timer(MPC_NLP &nlp) : nlp(nlp), begin(chrono::steady_clock::now()) {}
+    ~Timer() {
+      nlp.derivative_evals++;
+      nlp.derivative_seconds += chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    }
+  };
+
+  // Keeps the first actuations of xcur as those of the current iterate, from a derivative evaluation.
+  void noteIterate() {
+    have_iterate = true;
+    iterate_delta = xcur[delta_index];
+    iterate_a = xcur[a_index];
+  }
+
+  // Moves to the point x_ if it is new, and computes fg there unless only derivatives are wanted (those come from
+  // the tape, which does its own zero order sweep).
+  void Evaluate(const Number *x_, bool new_x, bool values = true) {
+    if (new_x || xcur.size() != n) {
+      xcur.resize(n);
+      for (size_t j = 0; j < n; j++) {
+        xcur[j] = x_[j];
+      }
+      have_fg = false;
+      tape_at_x = false;
+    }
+    if (!values || have_fg) {
+      return;
+    }
+    auto begin = chrono::steady_clock::now();
+    if (stages != nullptr) {
+      fg.resize(m + 1);
+      stages->Values(xcur.data(), fg.data());
+    } else if (direct_eval) {
+      fg.resize(m + 1);
+      eval(fg, xcur);
+    } else {
+      fg = Workspace().fun.Forward(0, xcur);
+      tape_at_x = true;
+    }
+    have_fg = true;
+    value_evals++;
+    value_eval_seconds += chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+  }
+};
+
+#endif /* MPC_NLP_H */
@@ -0,0 +1,90 @@
+#include "Metrics.h"
+#include <sstream>
+
+const vector<double> &HistogramBounds() {
+  static const vector<double> bounds = [] {
+    vector<double> b;
+    for (double le = 0.0001; le < 4; le *= 2) {
+      b.push_back(le);
+    }
+    return b;
+  }();
+  return bounds;
+}
+
+const vector<double> &CountBounds() {
+  static const vector<double> bounds = [] {
+    vector<double> b;
+    for (double le = 1; le <= 4096; le *= 2) {
+      b.push_back(le);
+    }
+    return b;
+  }();
+  return bounds;
+}
+
+void Metrics::Add(const string &name, double value) {
+  lock_guard<mutex> guard(lock);
+  counters[name] += value;
+}
+
+void Metrics::Set(const string &name, double value) {
+  lock_guard<mutex> guard(lock);
+  gauges[name] = value;
+}
+
+void Metrics::Observe(const string &name, double value, const vector<double> &bounds) {
+  lock_guard<mutex> guard(lock);
+  Histogram &h = histograms[name];
+  if (h.counts.empty()) {
+    h.bounds = &bounds;
+    h.counts.assign(bounds.size(), 0);
+    h.sum = 0;
+    h.count = 0;
+  }
+  for (size_t i = 0; i < h.counts.size(); i++) {
+    if (value <= (*h.bounds)[i]) {
+      h.counts[i] += 1;
+    }
+  }
+  h.sum += value;
+  h.count += 1;
+}
+
+void Metrics::Remove(const string &name) {
+  lock_guard<mutex> guard(lock);
+  counters.erase(name);
+  gauges.erase(name);
+  histograms.erase(name);
+}
+
+string Metrics::Render() const {
+  ostringstream out;
+  lock_guard<mutex> guard(lock);
+  for (auto &c : counters) {
+    out << c.first << " " << c.second << "\n";
+  }
+  for (auto &g : gauges) {
+    out << g.first << " " << g.second << "\n";
+  }
+  for (auto &h : histograms) {
+    // The bucket label goes next to the labels of the series, if it has any.
+    size_t brace = h.first.find('{');
+    string base = h.first.substr(0, brace);
+    string labels = (brace == string::npos) ? "" : h.first.substr(brace + 1, h.first.size() - brace - 2) + ",";
+    string suffix = (brace == string::npos) ? "" : h.first.substr(brace);
+    const vector<double> &bounds = *h.second.bounds;
+    for (size_t i = 0; i < bounds.size(); i++) {
+      out << base << "_bucket{" << labels << "le=\"" << bounds[i] << "\"} " << h.second.counts[i] << "\n";
+    }
+    out << base << "_bucket{" << labels << "le=\"+Inf\"} " << h.second.count << "\n";
+    out << base << "_sum" << suffix << " " << h.second.sum << "\n";
+    out << base << "_count" << suffix << " " << h.second.count << "\n";
+  }
+  return out.str();
+}
+
+Metrics &GlobalMetrics() {
+  static Metrics metrics;
+  return metrics;
+}
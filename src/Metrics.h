@@ -0,0 +1,49 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Upper bounds of the histogram buckets, from 100 us to ~3 s.
+const vector<double> &HistogramBounds();
+// Upper bounds for counts (e.g. solver iterations), 1 to 4096.
+const vector<double> &CountBounds();
+
+// Process-wide counters, gauges and latency histograms, rendered in the Prometheus text format on GET /metrics.
+// Series names may carry labels, e.g. `mpc_governor_tier{session="3"}`.
+class Metrics {
+ public:
+  // Counters only go up.
+  void Add(const string &name, double value = 1);
+  // Gauges hold the last value set.
+  void Set(const string &name, double value);
+  // Histograms collect observations into fixed exponential buckets: seconds by default, see the bounds above.
+  void Observe(const string &name, double value, const vector<double> &bounds);
+  void Observe(const string &name, double value) { Observe(name, value, HistogramBounds()); }
+  // Drops the series `name`, whatever its kind, e.g. the series of a session that ended.
+  void Remove(const string &name);
+
+  string Render() const;
+
+ private:
+  struct Histogram {
+    const vector<double> *bounds;
+    vector<double> counts;
+    double sum;
+    double count;
+  };
+
+  mutable mutex lock;
+  map<string, double> counters;
+  map<string, double> gauges;
+  map<string, Histogram> histograms;
+};
+
+// The metrics every part of the controller reports to.
+Metrics &GlobalMetrics();
+
+#endif /* METRICS_H */
@@ -0,0 +1,439 @@
+#ifndef MODEL_DSL_H
+#define MODEL_DSL_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A small expression-template language for the cost terms and the dynamics of the model. A term is written once, as
+// an expression over the inputs of the term (In<0>, In<1>, ...) and named constants:
+//
+//   const dsl::In<0> v;
+//   const dsl::In<1> v_ref;
+//   const auto speed_cost = dsl::Ref(weight_v) * dsl::square(v - v_ref);
+//
+// and evaluated for any scalar type S with term(in), in pointing to its inputs as S. The expression is a type, so
+// every backend is generated by the compiler from the same declaration:
+//   * S = double: plain arithmetic, inlined, no tape (eval_f, eval_g),
+//   * S = CppAD::AD<double>: records the term on the CppAD tape,
+//   * S = Dual<double, K>: forward-mode derivatives with respect to the first K inputs, in fixed-size arrays
+//     (Gradient below); nested Dual<Dual<double, K>, K> gives second derivatives,
+//   * S = Sparsity: which inputs and pairs of inputs the derivatives can involve.
+// Adding a term adds exactly its own operations to each of them.
+namespace dsl {
+
+// Base of all expressions, so the operators below only apply to them.
+template <class E>
+struct Expr {
+  const E &self() const { return static_cast<const E &>(*this); }
+};
+
+// Input I of the term.
+template <int I>
+struct In : Expr<In<I> > {
+  In() {}
+  template <class S>
+  S operator()(const S *in) const {
+    return in[I];
+  }
+};
+
+// A constant, by value.
+struct Const : Expr<Const> {
+  double value;
+  explicit Const(double value) : value(value) {}
+  template <class S>
+  S operator()(const S *) const {
+    return S(value);
+  }
+};
+
+// A named constant, read when the term is evaluated (tuning parameters, dt).
+struct Ref : Expr<Ref> {
+  const double *value;
+  explicit Ref(const double &value) : value(&value) {}
+  template <class S>
+  S operator()(const S *) const {
+    return S(*value);
+  }
+};
+
+#define DSL_BINARY(Name, op)                                                                      \
+  template <class A, class B>                                                                     \
+  struct Name : Expr<Name<A, B> > {                                                               \
+    A a;                                                                                          \
+    B b;                                                                                          \
+    Name(const A &a, const B &b) : a(a), b(b) {}                                                  \
+    template <class S>                                                                            \
+    S operator()(const S *in) const {                                                             \
+      return a(in) op b(in);                                                                      \
+    }                                                                                             \
+  };                                                                                              \
+  template <class A, class B>                                                                     \
+  Name<A, B> operator op(const Expr<A> &a, const Expr<B> &b) {                                    \
+    return Name<A, B>(a.self(), b.self());                                                        \
+  }                                                                                               \
+  template <class A>                                                                              \
+  Name<A, Const> operator op(const Expr<A> &a, double b) {                                        \
+    return Name<A, Const>(a.self(), Const(b));                                                    \
+  }                                                                                               \
+  template <class B>                                                                              \
+  Name<Const, B> operator op(double a, const Expr<B> &b) {                                        \
+    return Name<Const, B>(Const(a), b.self());                                                    \
+  }
+
+DSL_BINARY(Add, +)
+DSL_BINARY(Sub, -)
+DSL_BINARY(Mul, *)
+DSL_BINARY(Div, /)
+
+#undef DSL_BINARY
+
+// Unary functions. The block-scope using declarations find the standard function for double, argument-dependent
+// lookup finds CppAD's for AD<double> and ours for Dual.
+#define DSL_UNARY(Name, f)                  \
+  template <class A>                        \
+  struct Name : Expr<Name<A> > {            \
+    A a;                                    \
+    explicit Name(const A &a) : a(a) {}     \
+    template <class S>                      \
+    S operator()(const S *in) const {       \
+      using ::f;                            \
+      return f(a(in));                      \
+    }                                       \
+  };                                        \
+  template <class A>                        \
+  Name<A> f(const Expr<A> &a) {             \
+    return Name<A>(a.self());               \
+  }
+
+DSL_UNARY(Sin, sin)
+DSL_UNARY(Cos, cos)
+DSL_UNARY(Atan, atan)
+DSL_UNARY(Sqrt, sqrt)
+
+#undef DSL_UNARY
+
+template <class A>
+struct Neg : Expr<Neg<A> > {
+  A a;
+  explicit Neg(const A &a) : a(a) {}
+  template <class S>
+  S operator()(const S *in) const {
+    return -a(in);
+  }
+};
+
+template <class A>
+Neg<A> operator-(const Expr<A> &a) {
+  return Neg<A>(a.self());
+}
+
+// a^2, evaluating a once.
+template <class A>
+struct Square : Expr<Square<A> > {
+  A a;
+  explicit Square(const A &a) : a(a) {}
+  template <class S>
+  S operator()(const S *in) const {
+    S value = a(in);
+    return value * value;
+  }
+};
+
+template <class A>
+Square<A> square(const Expr<A> &a) {
+  return Square<A>(a.self());
+}
+
+// F()(in, a(in), b(in)) for a function object F with a templated operator(), for parts of a term that are better
+// written as code (loops, fixed-point iterations). F has to work for every scalar type the term is evaluated with.
+template <class F, class A, class B>
+struct Apply : Expr<Apply<F, A, B> > {
+  A a;
+  B b;
+  Apply(const A &a, const B &b) : a(a), b(b) {}
+  template <class S>
+  S operator()(const S *in) const {
+    return F()(in, a(in), b(in));
+  }
+};
+
+template <class F, class A, class B>
+Apply<F, A, B> apply(const Expr<A> &a, const Expr<B> &b) {
+  return Apply<F, A, B>(a.self(), b.self());
+}
+
+// Forward-mode dual number: a value and its derivatives with respect to N inputs. T is double, or Dual itself for
+// second derivatives.
+template <class T, int N>
+struct Dual {
+  T v;
+  T d[N];
+
+  Dual() : v(0) {
+    for (int i = 0; i < N; i++) {
+      d[i] = T(0);
+    }
+  }
+  Dual(double value) : v(value) {
+    for (int i = 0; i < N; i++) {
+      d[i] = T(0);
+    }
+  }
+  // Input i of N, with value `value`.
+  Dual(const T &value, int i) : v(value) {
+    for (int k = 0; k < N; k++) {
+      d[k] = T(k == i ? 1 : 0);
+    }
+  }
+
+  Dual &operator+=(const Dual &o) { return *this = *this + o; }
+  Dual &operator-=(const Dual &o) { return *this = *this - o; }
+  Dual &operator*=(const Dual &o) { return *this = *this * o; }
+  Dual &operator/=(const Dual &o) { return *this = *this / o; }
+};
+
+// Value and derivative of f(x) from f(x.v) and f'(x.v).
+template <class T, int N>
+Dual<T, N> chain(const Dual<T, N> &x, const T &value, const T &derivative) {
+  Dual<T, N> r;
+  r.v = value;
+  for (int i = 0; i < N; i++) {
+    r.d[i] = derivative * x.d[i];
+  }
+  return r;
+}
+
+template <class T, int N>
+Dual<T, N> operator+(const Dual<T, N> &a, const Dual<T, N> &b) {
+  Dual<T, N> r;
+  r.v = a.v + b.v;
+  for (int i = 0; i < N; i++) {
+    r.d[i] = a.d[i] + b.d[i];
+  }
+  return r;
+}
+
+template <class T, int N>
+Dual<T, N> operator-(const Dual<T, N> &a, const Dual<T, N> &b) {
+  Dual<T, N> r;
+  r.v = a.v - b.v;
+  for (int i = 0; i < N; i++) {
+    r.d[i] = a.d[i] - b.d[i];
+  }
+  return r;
+}
+
+template <class T, int N>
+Dual<T, N> operator*(const Dual<T, N> &a, const Dual<T, N> &b) {
+  Dual<T, N> r;
+  r.v = a.v * b.v;
+  for (int i = 0; i < N; i++) {
+    r.d[i] = a.d[i] * b.v + a.v * b.d[i];
+  }
+  return r;
+}
+
+template <class T, int N>
+Dual<T, N> operator/(const Dual<T, N> &a, const Dual<T, N> &b) {
+  Dual<T, N> r;
+  r.v = a.v / b.v;
+  for (int i = 0; i < N; i++) {
+    r.d[i] = (a.d[i] - r.v * b.d[i]) / b.v;
+  }
+  return r;
+}
+
+template <class T, int N>
+Dual<T, N> operator-(const Dual<T, N> &a) {
+  return chain(a, T(-a.v), T(-1.0));
+}
+
+// Mixed with constants (and ints, as in 2 * x).
+template <class T, int N>
+Dual<T, N> operator+(const Dual<T, N> &a, double b) { return a + Dual<T, N>(b); }
+template <class T, int N>
+Dual<T, N> operator+(double a, const Dual<T, N> &b) { return Dual<T, N>(a) + b; }
+template <class T, int N>
+Dual<T, N> operator-(const Dual<T, N> &a, double b) { return a - Dual<T, N>(b); }
+template <class T, int N>
+Dual<T, N> operator-(double a, const Dual<T, N> &b) { return Dual<T, N>(a) - b; }
+template <class T, int N>
+Dual<T, N> operator*(const Dual<T, N> &a, double b) { return chain(a, T(a.v * b), T(b)); }
+template <class T, int N>
+Dual<T, N> operator*(double a, const Dual<T, N> &b) { return chain(b, T(a * b.v), T(a)); }
+template <class T, int N>
+Dual<T, N> operator/(const Dual<T, N> &a, double b) { return chain(a, T(a.v / b), T(1.0 / b)); }
+template <class T, int N>
+Dual<T, N> operator/(double a, const Dual<T, N> &b) { return Dual<T, N>(a) / b; }
+
+template <class T, int N>
+Dual<T, N> sin(const Dual<T, N> &x) {
+  using ::sin;
+  using ::cos;
+  return chain(x, T(sin(x.v)), T(cos(x.v)));
+}
+
+template <class T, int N>
+Dual<T, N> cos(const Dual<T, N> &x) {
+  using ::sin;
+  using ::cos;
+  return chain(x, T(cos(x.v)), T(-sin(x.v)));
+}
+
+template <class T, int N>
+Dual<T, N> atan(const Dual<T, N> &x) {
+  using ::atan;
+  return chain(x, T(atan(x.v)), T(1.0 / (1.0 + x.v * x.v)));
+}
+
+template <class T, int N>
+Dual<T, N> sqrt(const Dual<T, N> &x) {
+  using ::sqrt;
+  T root = sqrt(x.v);
+  return chain(x, root, T(0.5 / root));
+}
+
+// Inputs of a term as dual numbers: the first N are the variables, the rest (up to M) parameters.
+template <int N, int M>
+void Seed(const double (&in)[M], Dual<double, N> (&x)[M]) {
+  for (int i = 0; i < M; i++) {
+    x[i] = (i < N) ? Dual<double, N>(in[i], i) : Dual<double, N>(in[i]);
+  }
+}
+
+// The same for second derivatives.
+template <int N, int M>
+void Seed(const double (&in)[M], Dual<Dual<double, N>, N> (&x)[M]) {
+  typedef Dual<double, N> D1;
+  for (int i = 0; i < M; i++) {
+    x[i].v = (i < N) ? D1(in[i], i) : D1(in[i]);
+    if (i < N) {
+      x[i].d[i] = D1(1.0);
+    }
+  }
+}
+
+// The same with the derivative directions given per input: input i is variable direction[i] (of N), or a parameter
+// if that is negative. For terms that only involve a few of many inputs.
+template <int N, int M>
+void Seed(const double (&in)[M], const int (&direction)[M], Dual<double, N> (&x)[M]) {
+  for (int i = 0; i < M; i++) {
+    x[i] = (direction[i] >= 0) ? Dual<double, N>(in[i], direction[i]) : Dual<double, N>(in[i]);
+  }
+}
+
+template <int N, int M>
+void Seed(const double (&in)[M], const int (&direction)[M], Dual<Dual<double, N>, N> (&x)[M]) {
+  typedef Dual<double, N> D1;
+  for (int i = 0; i < M; i++) {
+    x[i].v = (direction[i] >= 0) ? D1(in[i], direction[i]) : D1(in[i]);
+    if (direction[i] >= 0) {
+      x[i].d[direction[i]] = D1(1.0);
+    }
+  }
+}
+
+// Value of a term and its gradient with respect to its first N inputs (of M; the rest are parameters).
+template <int N, int M, class E>
+double Gradient(const Expr<E> &term, const double (&in)[M], double (&gradient)[N]) {
+  Dual<double, N> x[M];
+  Seed(in, x);
+  Dual<double, N> y = term.self()(x);
+  for (int i = 0; i < N; i++) {
+    gradient[i] = y.d[i];
+  }
+  return y.v;
+}
+
+// The same with the Hessian, hessian[i][j] = d2 term / d in_i d in_j.
+template <int N, int M, class E>
+double Hessian(const Expr<E> &term, const double (&in)[M], double (&gradient)[N], double (&hessian)[N][N]) {
+  Dual<Dual<double, N>, N> x[M];
+  Seed(in, x);
+  Dual<Dual<double, N>, N> y = term.self()(x);
+  for (int i = 0; i < N; i++) {
+    gradient[i] = y.v.d[i];
+    for (int j = 0; j < N; j++) {
+      hessian[i][j] = y.d[i].d[j];
+    }
+  }
+  return y.v.v;
+}
+
+// Which of (up to 32) inputs a value depends on, and which pairs of them its second derivatives may involve.
+// Evaluating a term with S = Sparsity, the variables seeded with Input(i), gives the patterns of its gradient and its
+// Hessian. Like CppAD's patterns they are conservative: x * x counts as nonlinear in x whatever its value.
+struct Sparsity {
+  uint32_t first;
+  uint32_t second[32];
+
+  Sparsity(double = 0) : first(0) {
+    for (int i = 0; i < 32; i++) {
+      second[i] = 0;
+    }
+  }
+  static Sparsity Input(int i) {
+    Sparsity s;
+    s.first = uint32_t(1) << i;
+    return s;
+  }
+
+  bool Depends(int i) const { return (first >> i) & 1; }
+  bool Pair(int i, int j) const { return (second[i] >> j) & 1; }
+
+  // Adds the pairs (i, j) and (j, i) for i in a and j in b.
+  void Cross(uint32_t a, uint32_t b) {
+    for (int i = 0; i < 32; i++) {
+      if ((a >> i) & 1) {
+        second[i] |= b;
+      }
+      if ((b >> i) & 1) {
+        second[i] |= a;
+      }
+    }
+  }
+};
+
+inline Sparsity Union(const Sparsity &a, const Sparsity &b) {
+  Sparsity r;
+  r.first = a.first | b.first;
+  for (int i = 0; i < 32; i++) {
+    r.second[i] = a.second[i] | b.second[i];
+  }
+  return r;
+}
+
+// A nonlinear function of a.
+inline Sparsity Nonlinear(const Sparsity &a) {
+  Sparsity r = a;
+  r.Cross(a.first, a.first);
+  return r;
+}
+
+inline Sparsity operator+(const Sparsity &a, const Sparsity &b) { return Union(a, b); }
+inline Sparsity operator-(const Sparsity &a, const Sparsity &b) { return Union(a, b); }
+inline Sparsity operator-(const Sparsity &a) { return a; }
+
+inline Sparsity operator*(const Sparsity &a, const Sparsity &b) {
+  Sparsity r = Union(a, b);
+  r.Cross(a.first, b.first);
+  return r;
+}
+
+inline Sparsity operator/(const Sparsity &a, const Sparsity &b) {
+  Sparsity r = Union(a, b);
+  r.Cross(a.first, b.first);
+  r.Cross(b.first, b.first);
+  return r;
+}
+
+inline Sparsity sin(const Sparsity &a) { return Nonlinear(a); }
+inline Sparsity cos(const Sparsity &a) { return Nonlinear(a); }
+inline Sparsity atan(const Sparsity &a) { return Nonlinear(a); }
+inline Sparsity sqrt(const Sparsity &a) { return Nonlinear(a); }
+
+}  // namespace dsl
+
+#endif /* MODEL_DSL_H */
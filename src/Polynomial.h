@@ -0,0 +1,12 @@
+#ifndef POLYNOMIAL_H
+#define POLYNOMIAL_H
+
+#include "Eigen-3.3/Eigen/Core"
+
+// Evaluate a polynomial.
+double polyeval(Eigen::VectorXd coeffs, double x);
+
+// Fit a polynomial of the given order to the points (least squares).
+Eigen::VectorXd polyfit(Eigen::VectorXd xvals, Eigen::VectorXd yvals, int order);
+
+#endif /* POLYNOMIAL_H */
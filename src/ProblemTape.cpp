@@ -0,0 +1,56 @@
+#include "ProblemTape.h"
+#include <atomic>
+#include "Metrics.h"
+
+// Workspaces of all threads, for the metrics.
+static atomic<size_t> workspaces(0);
+
+ProblemTape::Workspace &ProblemTape::ThreadWorkspace() const {
+  // Tapes live as long as the process (ProblemRegistry), so their addresses are never reused.
+  thread_local unordered_map<const ProblemTape *, unique_ptr<Workspace> > mine;
+  unique_ptr<Workspace> &workspace = mine[this];
+  if (!workspace) {
+    workspace.reset(new Workspace());
+    workspace->fun = fun;
+    workspace->owner = 0;
+    GlobalMetrics().Set("mpc_problem_workspaces", ++workspaces);
+  }
+  return *workspace;
+}
+
+size_t ProblemTape::Bytes() const {
+  size_t bytes = fun.size_op_seq();
+  bytes += (jac_row.size() + jac_col.size() + hes_row.size() + hes_col.size()) * sizeof(size_t);
+  for (const set<size_t> &row : jac_pattern) {
+    bytes += row.size() * (sizeof(size_t) + 4 * sizeof(void *));
+  }
+  for (const set<size_t> &row : hes_pattern) {
+    bytes += row.size() * (sizeof(size_t) + 4 * sizeof(void *));
+  }
+  return bytes;
+}
+
+shared_ptr<const ProblemTape> ProblemRegistry::Get(const string &key, const function<ProblemTape *()> &record) {
+  lock_guard<mutex> guard(lock);
+  auto it = tapes.find(key);
+  if (it != tapes.end()) {
+    GlobalMetrics().Add("mpc_problem_tape_hits_total");
+    return it->second;
+  }
+  // Recording under the lock keeps sessions that want the same shape from recording it twice.
+  GlobalMetrics().Add("mpc_problem_tape_misses_total");
+  shared_ptr<const ProblemTape> tape(record());
+  tapes[key] = tape;
+  size_t bytes = 0;
+  for (auto &entry : tapes) {
+    bytes += entry.second->Bytes();
+  }
+  GlobalMetrics().Set("mpc_problem_tapes", tapes.size());
+  GlobalMetrics().Set("mpc_problem_tape_bytes", bytes);
+  return tape;
+}
+
+ProblemRegistry &GlobalProblemRegistry() {
+  static ProblemRegistry registry;
+  return registry;
+}
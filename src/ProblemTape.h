@@ -0,0 +1,116 @@
+#ifndef PROBLEM_TAPE_H
+#define PROBLEM_TAPE_H
+
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cppad/cppad.hpp>
+
+using namespace std;
+
+// The recorded NLP of one problem shape: the cost and the constraints of an FG_eval (see MPC_NLP.h) as functions of
+// the variables, with everything that changes from solve to solve (the fit, the state, the references) as CppAD
+// dynamic parameters, and the sparsity of the constraint Jacobian and of the Lagrangian Hessian. It is recorded once
+// and never changes after, so every session solving a problem of that shape shares it (ProblemRegistry).
+//
+// Evaluating an ADFun writes to it (the Taylor coefficients of the last sweep, the colorings of the sparse
+// derivatives), so nobody evaluates the shared one: each thread gets a Workspace with its own copy.
+class ProblemTape {
+ public:
+  typedef CPPAD_TESTVECTOR(double) Dvector;
+  typedef CPPAD_TESTVECTOR(CppAD::AD<double>) ADvector;
+
+  // Records fg_eval(fg, vars, params) at x and params, for m constraints.
+  template <class FG_eval>
+  ProblemTape(FG_eval &fg_eval, const Dvector &x, const Dvector &params, size_t m);
+
+  size_t n;
+  size_t m;
+  vector<set<size_t> > jac_pattern;
+  vector<set<size_t> > hes_pattern;
+  // Entries of the Jacobian of fg (constraint i is row i + 1) and of the lower triangle of the Hessian.
+  CPPAD_TESTVECTOR(size_t) jac_row, jac_col;
+  CPPAD_TESTVECTOR(size_t) hes_row, hes_col;
+
+  // Mutable evaluation state of one thread for this tape. `owner` is the NLP whose parameters the function was last
+  // moved to (see MPC_NLP::Workspace).
+  struct Workspace {
+    CppAD::ADFun<double> fun;
+    CppAD::sparse_jacobian_work jac_work;
+    CppAD::sparse_hessian_work hes_work;
+    uint64_t owner;
+  };
+  // The calling thread's workspace, created on first use.
+  Workspace &ThreadWorkspace() const;
+
+  // Approximate size of the recording and the patterns (bytes).
+  size_t Bytes() const;
+
+ private:
+  CppAD::ADFun<double> fun;
+};
+
+template <class FG_eval>
+ProblemTape::ProblemTape(FG_eval &fg_eval, const Dvector &x, const Dvector &params, size_t m) : n(x.size()), m(m) {
+  ADvector avars(n);
+  for (size_t j = 0; j < n; j++) {
+    avars[j] = x[j];
+  }
+  ADvector aparams(params.size());
+  for (size_t j = 0; j < params.size(); j++) {
+    aparams[j] = params[j];
+  }
+  CppAD::Independent(avars, 0, false, aparams);
+  ADvector afg(m + 1);
+  fg_eval(afg, avars, aparams);
+  fun.Dependent(avars, afg);
+
+  // Sparsity of the Jacobian of fg, keep the constraint rows.
+  vector<set<size_t> > r(n);
+  for (size_t j = 0; j < n; j++) {
+    r[j].insert(j);
+  }
+  jac_pattern = fun.ForSparseJac(n, r);
+  for (size_t i = 1; i <= m; i++) {
+    for (size_t j : jac_pattern[i]) {
+      jac_row.push_back(i);
+      jac_col.push_back(j);
+    }
+  }
+
+  // Sparsity of the Hessian of the Lagrangian (all of fg), lower triangle only.
+  vector<set<size_t> > s(1);
+  for (size_t i = 0; i <= m; i++) {
+    s[0].insert(i);
+  }
+  hes_pattern = fun.RevSparseHes(n, s);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j : hes_pattern[i]) {
+      if (j <= i) {
+        hes_row.push_back(i);
+        hes_col.push_back(j);
+      }
+    }
+  }
+}
+
+// The tapes of all problem shapes seen so far, by key (see FG_eval::Key in MPC.cpp). There are only a few shapes
+// (the governor's horizons, the cross-track model), so tapes are kept for the life of the process.
+class ProblemRegistry {
+ public:
+  // The tape of `key`, recorded with `record` if there is none yet.
+  shared_ptr<const ProblemTape> Get(const string &key, const function<ProblemTape *()> &record);
+
+ private:
+  mutex lock;
+  unordered_map<string, shared_ptr<const ProblemTape> > tapes;
+};
+
+ProblemRegistry &GlobalProblemRegistry();
+
+#endif /* PROBLEM_TAPE_H */
@@ -0,0 +1,423 @@
+#include "Profiler.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <zlib.h>
+#include <cxxabi.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Metrics.h"
+#include "Stage.h"
+
+namespace {
+
+const int kMaxDepth = 48;
+const size_t kRingSize = 4096;
+// How often the ring is drained. At 1000 Hz on a few busy threads that is well under kRingSize samples.
+const chrono::milliseconds kDrainInterval(50);
+
+enum SlotState { kEmpty, kWriting, kReady };
+
+struct Slot {
+  atomic<int> state;
+  int stage;
+  unsigned session;
+  int depth;
+  uintptr_t pcs[kMaxDepth];
+};
+
+Slot ring[kRingSize];
+atomic<uint64_t> next_slot(0);
+atomic<uint64_t> dropped(0);
+atomic<bool> running(false);
+
+// Set by SetProfiledSession. The stack bounds are only known for threads that called it; for the others only the
+// interrupted pc is recorded, since following a bogus frame pointer outside the stack would crash the process.
+thread_local unsigned profiled_session = 0;
+thread_local uintptr_t stack_lo = 0;
+thread_local uintptr_t stack_hi = 0;
+
+// Everything below is only touched by StartProfiler, StopProfiler and the drain thread.
+mutex control_lock;
+thread drainer;
+int period_hz = 0;
+chrono::system_clock::time_point started;
+// Key: stage, session, then the pcs of the stack, innermost first.
+map<vector<uintptr_t>, int64_t> stacks;
+mutex stacks_lock;
+
+int walkStack(void *context, uintptr_t *pcs) {
+  const ucontext_t *uc = static_cast<const ucontext_t *>(context);
+  uintptr_t pc, fp, sp;
+#if defined(__linux__) && defined(__x86_64__)
+  pc = uc->uc_mcontext.gregs[REG_RIP];
+  fp = uc->uc_mcontext.gregs[REG_RBP];
+  sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__linux__) && defined(__aarch64__)
+  pc = uc->uc_mcontext.pc;
+  fp = uc->uc_mcontext.regs[29];
+  sp = uc->uc_mcontext.sp;
+#else
+  (void)uc;
+  return 0;
+#endif
+  int depth = 0;
+  pcs[depth++] = pc;
+  if (sp < stack_lo || sp >= stack_hi) {
+    // Not a thread we know the stack of, or on an alternate signal stack.
+    return depth;
+  }
+  // A frame is [saved fp, return address]; the callers' frames lie further up the stack.
+  uintptr_t low = sp;
+  while (depth < kMaxDepth && fp >= low && fp + 2 * sizeof(uintptr_t) <= stack_hi && fp % sizeof(uintptr_t) == 0) {
+    const uintptr_t *frame = reinterpret_cast<const uintptr_t *>(fp);
+    if (frame[1] == 0) {
+      break;
+    }
+    // The return address is past the call; pprof wants an address inside it.
+    pcs[depth++] = frame[1] - 1;
+    low = fp + 2 * sizeof(uintptr_t);
+    fp = frame[0];
+  }
+  return depth;
+}
+
+void onProf(int, siginfo_t *, void *context) {
+  int saved_errno = errno;
+  if (running.load(memory_order_relaxed)) {
+    Slot &slot = ring[next_slot.fetch_add(1, memory_order_relaxed) % kRingSize];
+    int expected = kEmpty;
+    if (slot.state.compare_exchange_strong(expected, kWriting, memory_order_acquire)) {
+      slot.stage = CurrentStage();
+      slot.session = profiled_session;
+      slot.depth = walkStack(context, slot.pcs);
+      slot.state.store(kReady, memory_order_release);
+    } else {
+      dropped.fetch_add(1, memory_order_relaxed);
+    }
+  }
+  errno = saved_errno;
+}
+
+void drain() {
+  lock_guard<mutex> guard(stacks_lock);
+  for (size_t i = 0; i < kRingSize; i++) {
+    Slot &slot = ring[i];
+    if (slot.state.load(memory_order_acquire) != kReady) {
+      continue;
+    }
+    vector<uintptr_t> key(2 + slot.depth);
+    key[0] = slot.stage;
+    key[1] = slot.session;
+    copy(slot.pcs, slot.pcs + slot.depth, key.begin() + 2);
+    slot.state.store(kEmpty, memory_order_release);
+    stacks[key]++;
+  }
+}
+
+void drainLoop() {
+  while (running.load()) {
+    this_thread::sleep_for(kDrainInterval);
+    drain();
+  }
+}
+
+// Just enough of the protobuf wire format for profile.proto.
+class ProtoWriter {
+ public:
+  string out;
+
+  void Varint(uint64_t v) {
+    while (v >= 0x80) {
+      out += static_cast<char>((v & 0x7f) | 0x80);
+      v >>= 7;
+    }
+    out += static_cast<char>(v);
+  }
+
+  // Zero is the default and is left out.
+  void Int(int field, uint64_t v) {
+    if (v != 0) {
+      Varint(field << 3);
+      Varint(v);
+    }
+  }
+
+  void Bytes(int field, const string &bytes) {
+    Varint((field << 3) | 2);
+    Varint(bytes.size());
+    out += bytes;
+  }
+
+  void Packed(int field, const vector<uint64_t> &values) {
+    ProtoWriter body;
+    for (uint64_t v : values) {
+      body.Varint(v);
+    }
+    Bytes(field, body.out);
+  }
+};
+
+class StringTable {
+ public:
+  StringTable() { Index(""); }
+
+  uint64_t Index(const string &s) {
+    auto it = indices.find(s);
+    if (it != indices.end()) {
+      return it->second;
+    }
+    indices[s] = strings.size();
+    strings.push_back(s);
+    return strings.size() - 1;
+  }
+
+  vector<string> strings;
+
+ private:
+  map<string, uint64_t> indices;
+};
+
+struct Mapping {
+  uintptr_t start, limit, offset;
+  string file;
+};
+
+// Executable mappings of the process, so pprof can symbolize what dladdr couldn't.
+vector<Mapping> readMappings() {
+  vector<Mapping> mappings;
+  ifstream maps("/proc/self/maps");
+  string line;
+  while (getline(maps, line)) {
+    unsigned long start, limit, offset;
+    char perms[8];
+    int path_at = 0;
+    if (sscanf(line.c_str(), "%lx-%lx %7s %lx %*s %*s %n", &start, &limit, perms, &offset, &path_at) < 4 ||
+        perms[2] != 'x') {
+      continue;
+    }
+    Mapping m = {start, limit, offset, path_at > 0 ? line.substr(path_at) : ""};
+    mappings.push_back(m);
+  }
+  return mappings;
+}
+
+string functionName(uintptr_t pc) {
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void *>(pc), &info) == 0 || info.dli_sname == nullptr) {
+    return "";
+  }
+  int status;
+  char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+  string name = (status == 0 && demangled != nullptr) ? demangled : info.dli_sname;
+  free(demangled);
+  return name;
+}
+
+string gzip(const string &in) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  // 15 + 16: maximum window, gzip header.
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return "";
+  }
+  string out(deflateBound(&zs, in.size()) + 32, '\0');
+  zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in.data()));
+  zs.avail_in = in.size();
+  zs.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  zs.avail_out = out.size();
+  int ret = deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+  return ret == Z_STREAM_END ? out : "";
+}
+
+string encodeProfile(chrono::nanoseconds duration) {
+  StringTable strings;
+  ProtoWriter profile;
+  int64_t period = 1000000000 / period_hz;
+
+  // sample_type: samples/count and cpu/nanoseconds.
+  ProtoWriter type;
+  type.Int(1, strings.Index("samples"));
+  type.Int(2, strings.Index("count"));
+  profile.Bytes(1, type.out);
+  type.out.clear();
+  type.Int(1, strings.Index("cpu"));
+  type.Int(2, strings.Index("nanoseconds"));
+  profile.Bytes(1, type.out);
+
+  vector<Mapping> mappings = readMappings();
+  map<uintptr_t, uint64_t> locations;  // pc -> location id
+  map<string, uint64_t> functions;     // name -> function id
+  ProtoWriter tables;
+
+  for (auto &entry : stacks) {
+    const vector<uintptr_t> &key = entry.first;
+    vector<uint64_t> location_ids;
+    for (size_t i = 2; i < key.size(); i++) {
+      uintptr_t pc = key[i];
+      auto it = locations.find(pc);
+      if (it == locations.end()) {
+        uint64_t id = locations.size() + 1;
+        it = locations.insert(make_pair(pc, id)).first;
+        ProtoWriter location;
+        location.Int(1, id);
+        for (size_t m = 0; m < mappings.size(); m++) {
+          if (pc >= mappings[m].start && pc < mappings[m].limit) {
+            location.Int(2, m + 1);
+          }
+        }
+        location.Int(3, pc);
+        string name = functionName(pc);
+        if (!name.empty()) {
+          auto f = functions.find(name);
+          if (f == functions.end()) {
+            f = functions.insert(make_pair(name, functions.size() + 1)).first;
+            ProtoWriter function;
+            function.Int(1, f->second);
+            function.Int(2, strings.Index(name));
+            function.Int(3, strings.Index(name));
+            tables.Bytes(5, function.out);
+          }
+          ProtoWriter line;
+          line.Int(1, f->second);
+          location.Bytes(4, line.out);
+        }
+        tables.Bytes(4, location.out);
+      }
+      location_ids.push_back(it->second);
+    }
+
+    ProtoWriter sample;
+    sample.Packed(1, location_ids);
+    vector<uint64_t> values = {static_cast<uint64_t>(entry.second), static_cast<uint64_t>(entry.second * period)};
+    sample.Packed(2, values);
+    ProtoWriter label;
+    label.Int(1, strings.Index("stage"));
+    label.Int(2, strings.Index(StageName(static_cast<Stage>(key[0]))));
+    sample.Bytes(3, label.out);
+    if (key[1] != 0) {
+      label.out.clear();
+      label.Int(1, strings.Index("session"));
+      label.Int(3, key[1]);
+      sample.Bytes(3, label.out);
+    }
+    profile.Bytes(2, sample.out);
+  }
+
+  for (size_t m = 0; m < mappings.size(); m++) {
+    ProtoWriter mapping;
+    mapping.Int(1, m + 1);
+    mapping.Int(2, mappings[m].start);
+    mapping.Int(3, mappings[m].limit);
+    mapping.Int(4, mappings[m].offset);
+    mapping.Int(5, strings.Index(mappings[m].file));
+    profile.Bytes(3, mapping.out);
+  }
+  profile.out += tables.out;
+  profile.Int(9, chrono::duration_cast<chrono::nanoseconds>(started.time_since_epoch()).count());
+  profile.Int(10, duration.count());
+  ProtoWriter period_type;
+  period_type.Int(1, strings.Index("cpu"));
+  period_type.Int(2, strings.Index("nanoseconds"));
+  profile.Bytes(11, period_type.out);
+  profile.Int(12, period);
+  // Last, once every string has its index.
+  for (const string &s : strings.strings) {
+    profile.Bytes(6, s);
+  }
+  return gzip(profile.out);
+}
+
+}  // namespace
+
+void SetProfiledSession(unsigned id) {
+  profiled_session = id;
+  if (stack_hi == 0) {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+      if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+        stack_lo = reinterpret_cast<uintptr_t>(addr);
+        stack_hi = stack_lo + size;
+      }
+      pthread_attr_destroy(&attr);
+    }
+  }
+}
+
+bool ProfilerRunning() { return running.load(); }
+
+bool StartProfiler(int hz) {
+  lock_guard<mutex> guard(control_lock);
+  if (running.load() || hz <= 0 || hz > 1000) {
+    return false;
+  }
+  {
+    lock_guard<mutex> stacks_guard(stacks_lock);
+    stacks.clear();
+  }
+  dropped = 0;
+  period_hz = hz;
+  started = chrono::system_clock::now();
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = onProf;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, nullptr) != 0) {
+    return false;
+  }
+  running = true;
+  drainer = thread(drainLoop);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    running = false;
+    drainer.join();
+    return false;
+  }
+  return true;
+}
+
+string StopProfiler() {
+  lock_guard<mutex> guard(control_lock);
+  if (!running.load()) {
+    return "";
+  }
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  // The handler stays installed: a SIGPROF still in flight finds `running` false and returns.
+  running = false;
+  drainer.join();
+  drain();
+
+  lock_guard<mutex> stacks_guard(stacks_lock);
+  int64_t samples = 0;
+  for (auto &entry : stacks) {
+    samples += entry.second;
+  }
+  GlobalMetrics().Add("mpc_profiler_samples_total", samples);
+  GlobalMetrics().Add("mpc_profiler_dropped_samples_total", dropped.load());
+  return encodeProfile(chrono::system_clock::now() - started);
+}
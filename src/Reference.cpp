@@ -0,0 +1,65 @@
+#include "Reference.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Farther from the track than this, the car is taken to be on another track (m).
+static const double kOnTrackDistance = 5;
+
+static double interpolate(const vector<double> &samples, double at) {
+  if (samples.empty()) {
+    return 0;
+  }
+  if (at <= 0) {
+    return samples.front();
+  }
+  size_t i = static_cast<size_t>(at);
+  if (i + 1 >= samples.size()) {
+    return samples.back();
+  }
+  double t = at - i;
+  return samples[i] + t * (samples[i + 1] - samples[i]);
+}
+
+double Reference::Curvature(double distance) const { return interpolate(curvature, distance / spacing); }
+
+double Reference::Speed(double distance) const { return interpolate(speed, distance / spacing); }
+
+Reference ReferenceAhead(const Track &track, const SpeedProfile &speeds, double px, double py,
+                         const Eigen::VectorXd &coeffs, const WindowGeometry *window, double distance) {
+  Reference reference;
+  size_t n = static_cast<size_t>(distance / reference.spacing) + 1;
+  double off_track = 0;
+  double s = track.Empty() ? 0 : track.Project(px, py, &off_track);
+  if (!track.Empty() && off_track < kOnTrackDistance) {
+    for (size_t i = 0; i < n; i++) {
+      reference.curvature.push_back(track.Curvature(s + i * reference.spacing));
+      if (!speeds.Empty()) {
+        reference.speed.push_back(speeds.Speed(s + i * reference.spacing));
+      }
+    }
+    return reference;
+  }
+  if (window != nullptr) {
+    // The window's tables are sampled by arc length already, nothing to fit or differentiate.
+    double station, offset;
+    window->Frenet(px, py, &station, &offset);
+    for (size_t i = 0; i < n; i++) {
+      reference.curvature.push_back(window->Curvature(station + i * reference.spacing));
+    }
+    return reference;
+  }
+  // Car frame: the path runs roughly along x, so x stands in for the distance travelled.
+  for (size_t i = 0; i < n; i++) {
+    double x = i * reference.spacing;
+    double df = coeffs[1] + 2 * coeffs[2] * x + 3 * coeffs[3] * x * x;
+    double ddf = 2 * coeffs[2] + 6 * coeffs[3] * x;
+    reference.curvature.push_back(ddf / pow(1 + df * df, 1.5));
+  }
+  return reference;
+}
+
+bool FeedForwardEnabled() {
+  static const bool enabled = getenv("MPC_FEEDFORWARD") == nullptr || strcmp(getenv("MPC_FEEDFORWARD"), "off") != 0;
+  return enabled;
+}
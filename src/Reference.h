@@ -0,0 +1,40 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <vector>
+#include "Eigen-3.3/Eigen/Core"
+#include "SpeedProfile.h"
+#include "Track.h"
+#include "WaypointWindow.h"
+
+using namespace std;
+
+// What we know about the path ahead of the car beyond the fitted cubic: its curvature and the speed to drive it at,
+// as functions of the distance travelled. MPC::Solve turns the curvature into a feed-forward steering profile, the
+// steering that would hold the car on a path of that curvature, which seeds the warm start and which the steering
+// cost is centred on. The speed replaces the constant ref_v of every stage.
+struct Reference {
+  // Curvature (1/m, positive turning left) and reference speed (mph) every `spacing` m from the car on. Without
+  // speeds the constant ref_v is used.
+  double spacing;
+  vector<double> curvature;
+  vector<double> speed;
+
+  Reference() : spacing(1) {}
+
+  // Interpolated, held constant past the last sample; 0 without samples.
+  double Curvature(double distance) const;
+  double Speed(double distance) const;
+};
+
+// Reference over the next `distance` m for a car at map-frame (px, py). On the track, the curvature comes from the
+// track's precomputed table (GlobalTrack()) and the speed from the speed profile (GlobalSpeedProfile()) if one was
+// loaded; off it, there are no speeds and the curvature comes from the window cubic (`window`, by arc length from the
+// car's Frenet station) or, without a window, from the fitted cubic (car frame) along its x axis.
+Reference ReferenceAhead(const Track &track, const SpeedProfile &speeds, double px, double py,
+                         const Eigen::VectorXd &coeffs, const WindowGeometry *window, double distance);
+
+// Whether the feed-forward steering is used (MPC_FEEDFORWARD=off disables it, to measure what it saves).
+bool FeedForwardEnabled();
+
+#endif /* REFERENCE_H */
@@ -0,0 +1,106 @@
+#include "Scaling.h"
+#include <math.h>
+#include <sstream>
+
+static const char *kKindNames[kNumKinds] = {"x", "y", "psi", "v", "cte", "epsi", "delta", "a"};
+
+// Magnitudes below this are treated as this (cte and epsi sit near 0 on a straight), and scale factors are kept
+// within [1e-3, 1e3] so a strange profile can't wreck the problem.
+static const double kMinMagnitude = 0.05;
+static const double kMaxScale = 1e3;
+
+static double scaleFor(double sum_sq, double count) {
+  if (count == 0) {
+    return 1;
+  }
+  double rms = sqrt(sum_sq / count);
+  double scale = 1 / (rms > kMinMagnitude ? rms : kMinMagnitude);
+  return scale > kMaxScale ? kMaxScale : (scale < 1 / kMaxScale ? 1 / kMaxScale : scale);
+}
+
+ScalingProfile::ScalingProfile() : obj_sum_sq(0), obj_count(0) {
+  for (size_t k = 0; k < kNumKinds; k++) {
+    sum_sq[k] = 0;
+    count[k] = 0;
+  }
+}
+
+void ScalingProfile::Observe(size_t kind, double value) {
+  lock_guard<mutex> guard(lock);
+  sum_sq[kind] += value * value;
+  count[kind] += 1;
+}
+
+void ScalingProfile::ObserveObjective(double value) {
+  lock_guard<mutex> guard(lock);
+  obj_sum_sq += value * value;
+  obj_count += 1;
+}
+
+double ScalingProfile::Samples() const {
+  lock_guard<mutex> guard(lock);
+  return obj_count;
+}
+
+double ScalingProfile::VarScale(size_t kind) const {
+  lock_guard<mutex> guard(lock);
+  return scaleFor(sum_sq[kind], count[kind]);
+}
+
+double ScalingProfile::ObjectiveScale() const {
+  lock_guard<mutex> guard(lock);
+  return scaleFor(obj_sum_sq, obj_count);
+}
+
+// One line per kind: name, sum of squares, count. The objective is called "cost".
+string ScalingProfile::Save() const {
+  lock_guard<mutex> guard(lock);
+  ostringstream out;
+  out.precision(17);
+  for (size_t k = 0; k < kNumKinds; k++) {
+    out << kKindNames[k] << " " << sum_sq[k] << " " << count[k] << "\n";
+  }
+  out << "cost " << obj_sum_sq << " " << obj_count << "\n";
+  return out.str();
+}
+
+bool ScalingProfile::Load(const string &text) {
+  ScalingProfile loaded;
+  istringstream in(text);
+  string name;
+  double s, c;
+  // Every line has to read in full: a corrupt or truncated file is rejected rather than loaded in part.
+  for (in >> ws; !in.eof(); in >> ws) {
+    if (!(in >> name >> s >> c) || s < 0 || c < 0) {
+      return false;
+    }
+    if (name == "cost") {
+      loaded.obj_sum_sq = s;
+      loaded.obj_count = c;
+      continue;
+    }
+    size_t k = 0;
+    while (k < kNumKinds && name != kKindNames[k]) {
+      k++;
+    }
+    if (k == kNumKinds) {
+      return false;
+    }
+    loaded.sum_sq[k] = s;
+    loaded.count[k] = c;
+  }
+
+  lock_guard<mutex> guard(lock);
+  for (size_t k = 0; k < kNumKinds; k++) {
+    sum_sq[k] = loaded.sum_sq[k];
+    count[k] = loaded.count[k];
+  }
+  obj_sum_sq = loaded.obj_sum_sq;
+  obj_count = loaded.obj_count;
+  return true;
+}
+
+ScalingProfile &GlobalScalingProfile() {
+  static ScalingProfile profile;
+  return profile;
+}
@@ -0,0 +1,47 @@
+#ifndef SCALING_H
+#define SCALING_H
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+
+using namespace std;
+
+// The kinds of variables in the optimizer's `vars`, in the order of their blocks. Constraints come in the same
+// blocks as the states (each one is the residual of that state's dynamics).
+enum VarKind { kX, kY, kPsi, kV, kCte, kEpsi, kDelta, kA, kNumKinds };
+
+// Typical magnitudes of the variables and the cost, recorded from solved problems. The variables differ by orders of
+// magnitude (x up to ~60 m, v ~60 mph, delta ~1, a within +-1) and so do the cost weights, which hurts Ipopt's
+// conditioning. Ipopt gets 1 / RMS magnitude as user scaling factors for each kind and for the objective.
+//
+// The profile can be saved after a run (GET /scaling) and loaded at start-up (MPC_SCALING_PROFILE).
+class ScalingProfile {
+ public:
+  ScalingProfile();
+
+  void Observe(size_t kind, double value);
+  void ObserveObjective(double value);
+
+  // Solves recorded so far.
+  double Samples() const;
+
+  // Scale factors; 1 for kinds we have not seen yet.
+  double VarScale(size_t kind) const;
+  double ObjectiveScale() const;
+
+  string Save() const;
+  bool Load(const string &text);
+
+ private:
+  mutable mutex lock;
+  double sum_sq[kNumKinds];
+  double count[kNumKinds];
+  double obj_sum_sq;
+  double obj_count;
+};
+
+// Shared by all sessions.
+ScalingProfile &GlobalScalingProfile();
+
+#endif /* SCALING_H */
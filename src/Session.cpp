@@ -0,0 +1,49 @@
+#include "Session.h"
+#include <sstream>
+#include "Metrics.h"
+
+// Totals over the live sessions. Sessions are created and dropped on the event loop thread only.
+static size_t sessions = 0;
+static size_t sessions_bytes = 0;
+
+// Label of the series of session `id`.
+static string sessionLabel(unsigned id) {
+  ostringstream label;
+  label << "{session=\"" << id << "\"}";
+  return label.str();
+}
+
+Session::~Session() {
+  // Sessions are exported by id from their first cycle on (see steer in main.cpp), vehicles of a batch included.
+  Governor::Unexport(id);
+  if (accounted > 0) {
+    sessions--;
+    sessions_bytes -= accounted;
+    Metrics &m = GlobalMetrics();
+    m.Remove("mpc_session_bytes" + sessionLabel(id));
+    m.Set("mpc_sessions", sessions);
+    m.Set("mpc_sessions_bytes", sessions_bytes);
+  }
+}
+
+size_t Session::Bytes() const {
+  size_t bytes = sizeof(Session) + mpc.HeapBytes() + fit.HeapBytes();
+  for (auto &vehicle : vehicles) {
+    // The map node and its key.
+    bytes += vehicle.first.capacity() + 4 * sizeof(void *) + sizeof(Vehicle) + vehicle.second.session->Bytes();
+  }
+  return bytes;
+}
+
+void Session::Account() {
+  size_t bytes = Bytes();
+  if (accounted == 0) {
+    sessions++;
+  }
+  sessions_bytes += bytes - accounted;
+  accounted = bytes;
+  Metrics &m = GlobalMetrics();
+  m.Set("mpc_session_bytes" + sessionLabel(id), bytes);
+  m.Set("mpc_sessions", sessions);
+  m.Set("mpc_sessions_bytes", sessions_bytes);
+}
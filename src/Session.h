@@ -0,0 +1,60 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include "MPC.h"
+#include "TimerWheel.h"
+#ifdef MPC_COROUTINES
+#include "SessionRuntime.h"
+#endif
+#include "WaypointFit.h"
+
+// Per-connection state: every simulator connected to us drives its own vehicle with its own controller.
+//
+// A session only holds what is its own: the warm start of its solver and its waypoint fit. The recorded problems
+// (ProblemTape.h) and the caches are shared by all sessions, so thousands of connections cost a few KB each (see
+// "Per-session memory" in the README).
+struct Session {
+  unsigned id;
+  MPC mpc;
+  WaypointFit fit;
+  // A vehicle a client drives through "telemetry_batch" messages, with a controller of its own (steerBatch in
+  // main.cpp), and when a batch last listed it (steady clock, ms).
+  struct Vehicle {
+    unique_ptr<Session> session;
+    uint64_t last_seen = 0;
+  };
+  // The vehicles, by id: at most MPC_BATCH_MAX_VEHICLES, the ones left out of the batches for MPC_BATCH_IDLE_MS
+  // dropped. Their bytes count towards this session's.
+  map<string, Vehicle> vehicles;
+  // Closes the connection when the simulator goes quiet (MPC_IDLE_TIMEOUT_MS), 0 if there is none.
+  TimerWheel::Handle idle_timer;
+#ifdef MPC_COROUTINES
+  // Messages for the session's coroutine (runSession in main.cpp), and whether its cycle is running on the solver
+  // pool, when nothing else may touch the session.
+  Inbox inbox;
+  bool in_cycle = false;
+#endif
+
+  explicit Session(unsigned id) : id(id), idle_timer(0), accounted(0) {}
+  ~Session();
+
+  // Bytes held by this session, its heap buffers included.
+  size_t Bytes() const;
+  // Publishes Bytes() as mpc_session_bytes and keeps the totals over all sessions (mpc_sessions,
+  // mpc_sessions_bytes) up to date. The destructor takes the session back out of them.
+  void Account();
+
+  // WaypointFit holds fixed-size Eigen members.
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+ private:
+  // Bytes() as of the last Account(), 0 before the first.
+  size_t accounted;
+};
+
+#endif /* SESSION_H */
@@ -0,0 +1,59 @@
+#include "SessionRuntime.h"
+#include "Metrics.h"
+
+LoopExecutor::LoopExecutor(uS::Loop *loop) : wakeup(new uS::Async(loop)) {
+  wakeup->setData(this);
+  wakeup->start(drain);
+}
+
+void LoopExecutor::Post(coroutine_handle<> handle) {
+  {
+    lock_guard<mutex> guard(lock);
+    ready.push_back(handle);
+  }
+  wakeup->send();
+}
+
+void LoopExecutor::drain(uS::Async *async) {
+  LoopExecutor *executor = static_cast<LoopExecutor *>(async->getData());
+  vector<coroutine_handle<> > batch;
+  {
+    lock_guard<mutex> guard(executor->lock);
+    batch.swap(executor->ready);
+  }
+  for (coroutine_handle<> handle : batch) {
+    handle.resume();
+  }
+}
+
+void Inbox::Push(string message_) {
+  if (closed) {
+    return;
+  }
+  if (message) {
+    GlobalMetrics().Add("mpc_session_messages_replaced_total");
+  }
+  message = move(message_);
+  wake();
+}
+
+void Inbox::Close() {
+  closed = true;
+  wake();
+}
+
+void Inbox::wake() {
+  coroutine_handle<> handle = waiting;
+  waiting = nullptr;
+  if (handle) {
+    handle.resume();
+  }
+}
+
+optional<string> Inbox::Awaiter::await_resume() {
+  optional<string> next;
+  if (!inbox.closed) {
+    next.swap(inbox.message);
+  }
+  return next;
+}
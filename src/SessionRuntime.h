@@ -0,0 +1,121 @@
+#ifndef SESSION_RUNTIME_H
+#define SESSION_RUNTIME_H
+
+// Coroutine session runtime, only in the C++20 build (cmake -DMPC_COROUTINES=ON).
+//
+// A session's cycle is a sequence of waits: for telemetry, for the solve, for the emulated latency, then the reply.
+// With this runtime each session is a coroutine (see runSession in main.cpp) that co_awaits those steps in order,
+// instead of a chain of callbacks. The coroutines run on the event loop thread and only leave it for the solve, which
+// runs on the solver pool (SolverPool.h) and resumes the coroutine back on the loop. So thousands of sessions
+// interleave on the loop thread and a few solver threads, and each session's state is only touched by one thread at
+// a time.
+
+#if __cplusplus < 202002L
+#error "the session runtime needs C++20, build with -DMPC_COROUTINES=ON"
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <uWS/uWS.h>
+#include "SolverPool.h"
+#include "LoopTimers.h"
+
+using namespace std;
+
+// Resumes coroutines on the event loop thread, whichever thread they were handed over from.
+class LoopExecutor {
+ public:
+  explicit LoopExecutor(uS::Loop *loop);
+
+  // Any thread.
+  void Post(coroutine_handle<> handle);
+
+ private:
+  uS::Async *wakeup;
+  mutex lock;
+  vector<coroutine_handle<> > ready;
+
+  static void drain(uS::Async *async);
+};
+
+// Return type of coroutines nobody waits for: they start right away and free themselves when they return.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    suspend_never initial_suspend() noexcept { return {}; }
+    suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { terminate(); }
+  };
+};
+
+// Messages of one connection for its coroutine. Only the latest message is kept: a cycle started late should work on
+// the freshest telemetry, so messages that arrive while the coroutine is busy replace each other. Loop thread only.
+class Inbox {
+ public:
+  void Push(string message);
+  // No more messages: a waiting Next() gets nullopt, and so do all later ones.
+  void Close();
+  bool Closed() const { return closed; }
+
+  struct Awaiter {
+    Inbox &inbox;
+    bool await_ready() const { return inbox.message || inbox.closed; }
+    void await_suspend(coroutine_handle<> handle) { inbox.waiting = handle; }
+    optional<string> await_resume();
+  };
+  // co_await inbox.Next(): the next message, nullopt once closed.
+  Awaiter Next() { return Awaiter{*this}; }
+
+ private:
+  optional<string> message;
+  bool closed = false;
+  coroutine_handle<> waiting;
+
+  void wake();
+};
+
+// co_await Sleep(timers, ms): resumes from the session timers once `ms` have passed.
+struct Sleep {
+  LoopTimers &timers;
+  uint64_t ms;
+
+  bool await_ready() const { return false; }
+  void await_suspend(coroutine_handle<> handle) {
+    timers.Schedule(ms, [handle] { handle.resume(); });
+  }
+  void await_resume() {}
+};
+
+// Runs fn on the solver pool, then resumes on the loop thread with its result. Await a named one
+// (`OnSolver solve(...); co_await solve;`): GCC 12 destroys the captures of a temporary one twice.
+template <class Fn>
+class OnSolver {
+ public:
+  typedef invoke_result_t<Fn &> Result;
+
+  OnSolver(SolverPool &pool, LoopExecutor &loop, Fn fn) : pool(pool), loop(loop), fn(move(fn)) {}
+
+  bool await_ready() const { return false; }
+  void await_suspend(coroutine_handle<> handle) {
+    pool.Submit([this, handle] {
+      result.emplace(fn());
+      loop.Post(handle);
+    });
+  }
+  Result await_resume() { return move(*result); }
+
+ private:
+  SolverPool &pool;
+  LoopExecutor &loop;
+  Fn fn;
+  optional<Result> result;
+};
+
+#endif /* SESSION_RUNTIME_H */
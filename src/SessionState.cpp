@@ -0,0 +1,99 @@
+#include "SessionState.h"
+#include <string.h>
+
+// Layout: magic, version, then the fields in declaration order. Vectors are a uint32 count followed by the values.
+static const char kMagic[4] = {'M', 'P', 'C', 'S'};
+static const uint16_t kVersion = 1;
+
+namespace {
+
+template <typename T>
+void put(string &out, const T &value) {
+  out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void putVector(string &out, const vector<double> &values) {
+  put(out, static_cast<uint32_t>(values.size()));
+  if (!values.empty()) {
+    out.append(reinterpret_cast<const char *>(&values[0]), values.size() * sizeof(double));
+  }
+}
+
+// Reads from a buffer and remembers if we ever ran past its end.
+struct Reader {
+  const char *p;
+  const char *end;
+  bool ok;
+
+  template <typename T>
+  T get() {
+    T value = T();
+    if (ok && static_cast<size_t>(end - p) >= sizeof(T)) {
+      memcpy(&value, p, sizeof(T));
+      p += sizeof(T);
+    } else {
+      ok = false;
+    }
+    return value;
+  }
+
+  void getVector(vector<double> &values) {
+    uint32_t n = get<uint32_t>();
+    if (!ok || static_cast<size_t>(end - p) / sizeof(double) < n) {
+      ok = false;
+      return;
+    }
+    values.resize(n);
+    if (n > 0) {
+      memcpy(&values[0], p, n * sizeof(double));
+    }
+    p += n * sizeof(double);
+  }
+};
+
+}  // namespace
+
+string SerializeSessionState(const SessionState &state) {
+  string out;
+  out.reserve(64 + sizeof(double) * (state.x.size() + state.zl.size() + state.zu.size() + state.lambda.size()));
+  out.append(kMagic, sizeof(kMagic));
+  put(out, kVersion);
+  put(out, state.N);
+  put(out, state.dt);
+  put(out, state.latency);
+  put(out, state.solve_time);
+  put(out, state.steer);
+  put(out, state.throttle);
+  putVector(out, state.x);
+  putVector(out, state.zl);
+  putVector(out, state.zu);
+  putVector(out, state.lambda);
+  return out;
+}
+
+bool DeserializeSessionState(const string &data, SessionState *state) {
+  if (data.size() < sizeof(kMagic) || memcmp(data.data(), kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+  Reader in = {data.data() + sizeof(kMagic), data.data() + data.size(), true};
+  if (in.get<uint16_t>() != kVersion) {
+    return false;
+  }
+
+  SessionState s;
+  s.N = in.get<uint32_t>();
+  s.dt = in.get<double>();
+  s.latency = in.get<double>();
+  s.solve_time = in.get<double>();
+  s.steer = in.get<double>();
+  s.throttle = in.get<double>();
+  in.getVector(s.x);
+  in.getVector(s.zl);
+  in.getVector(s.zu);
+  in.getVector(s.lambda);
+  if (!in.ok || in.p != in.end) {
+    return false;
+  }
+  *state = s;
+  return true;
+}
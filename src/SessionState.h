@@ -0,0 +1,40 @@
+#ifndef SESSION_STATE_H
+#define SESSION_STATE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Everything an MPC instance has learned while driving one vehicle. It is small enough to be shipped to another
+// controller process within one control period, so a connection can be moved without a cold start.
+struct SessionState {
+  // Horizon configuration the solution below was computed with.
+  uint32_t N;
+  double dt;
+
+  // Latency model: the actuation latency we predict over and the measured solve time estimate (both in s).
+  double latency;
+  double solve_time;
+
+  // Last actuations sent back to the simulator.
+  double steer;
+  double throttle;
+
+  // Last solution of the optimizer and its multipliers (bounds and constraints).
+  vector<double> x;
+  vector<double> zl;
+  vector<double> zu;
+  vector<double> lambda;
+
+  SessionState() : N(0), dt(0), latency(0), solve_time(0), steer(0), throttle(0) {}
+};
+
+// Compact binary encoding of a SessionState. Both ends are expected to run on the same architecture.
+string SerializeSessionState(const SessionState &state);
+
+// Returns false (and leaves `state` untouched) if `data` is not a valid encoding.
+bool DeserializeSessionState(const string &data, SessionState *state);
+
+#endif /* SESSION_STATE_H */
@@ -0,0 +1,138 @@
+#include "SolutionCache.h"
+#include <math.h>
+#include <stdlib.h>
+#include <iostream>
+#include <sstream>
+#include "Metrics.h"
+
+SolutionQuanta::SolutionQuanta() : v(0.5), cte(0.02), epsi(0.005), steer(0.01), speed(0.5) {
+  coeff[0] = 0.02;
+  coeff[1] = 0.005;
+  coeff[2] = 2e-4;
+  coeff[3] = 5e-6;
+}
+
+bool SolutionQuanta::Parse(const string &spec) {
+  istringstream in(spec);
+  string item;
+  while (getline(in, item, ',')) {
+    size_t equals = item.find('=');
+    if (equals == string::npos) {
+      return false;
+    }
+    string name = item.substr(0, equals);
+    double value = atof(item.c_str() + equals + 1);
+    double *cell = name == "v" ? &v : name == "cte" ? &cte : name == "epsi" ? &epsi : name == "steer" ? &steer
+                 : name == "speed" ? &speed : nullptr;
+    if (cell == nullptr && name.size() == 2 && name[0] == 'c' && name[1] >= '0' && name[1] <= '3') {
+      cell = &coeff[name[1] - '0'];
+    }
+    if (cell == nullptr || !(value > 0)) {
+      return false;
+    }
+    *cell = value;
+  }
+  return true;
+}
+
+SolutionCache::SolutionCache(Mode mode, size_t capacity, const SolutionQuanta &quanta)
+    : mode(mode), quanta(quanta), shard_capacity((capacity + kShards - 1) / kShards), hits(0), misses(0), size(0) {}
+
+SolutionKey SolutionCache::Key(size_t N, double v, double cte, double epsi, const Eigen::VectorXd &coeffs,
+                               const vector<double> &delta_ff, const vector<double> &v_ref) const {
+  SolutionKey key;
+  key.reserve(8 + delta_ff.size() + v_ref.size());
+  key.push_back(N);
+  key.push_back(llround(v / quanta.v));
+  key.push_back(llround(cte / quanta.cte));
+  key.push_back(llround(epsi / quanta.epsi));
+  for (int i = 0; i < 4; i++) {
+    key.push_back(llround(coeffs[i] / quanta.coeff[i]));
+  }
+  for (double delta : delta_ff) {
+    key.push_back(llround(delta / quanta.steer));
+  }
+  for (double speed : v_ref) {
+    key.push_back(llround(speed / quanta.speed));
+  }
+  return key;
+}
+
+uint64_t SolutionCache::hash(const SolutionKey &key) {
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *bytes = reinterpret_cast<const unsigned char *>(key.data());
+  for (size_t i = 0; i < key.size() * sizeof(int64_t); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+shared_ptr<const vector<double>> SolutionCache::Find(const SolutionKey &key) {
+  uint64_t h = hash(key);
+  shared_ptr<const vector<double>> plan;
+  {
+    Shard &s = shard(h);
+    lock_guard<mutex> guard(s.lock);
+    auto it = s.index.find(h);
+    if (it != s.index.end() && it->second->key == key) {
+      s.entries.splice(s.entries.begin(), s.entries, it->second);
+      plan = it->second->plan;
+    }
+  }
+  uint64_t hit_count = plan ? ++hits : hits.load();
+  uint64_t miss_count = plan ? misses.load() : ++misses;
+  GlobalMetrics().Add(plan ? "mpc_solution_cache_hits_total" : "mpc_solution_cache_misses_total");
+  GlobalMetrics().Set("mpc_solution_cache_hit_ratio", static_cast<double>(hit_count) / (hit_count + miss_count));
+  return plan;
+}
+
+void SolutionCache::Insert(const SolutionKey &key, shared_ptr<const vector<double>> plan) {
+  uint64_t h = hash(key);
+  size_t entries;
+  {
+    Shard &s = shard(h);
+    lock_guard<mutex> guard(s.lock);
+    size_t before = s.entries.size();
+    auto it = s.index.find(h);
+    if (it != s.index.end()) {
+      // A newer solve of the same cells (or a hash collision): the newer one wins.
+      s.entries.erase(it->second);
+      s.index.erase(it);
+    }
+    Entry entry = {h, key, plan};
+    s.entries.push_front(entry);
+    s.index[h] = s.entries.begin();
+    while (s.entries.size() > shard_capacity) {
+      s.index.erase(s.entries.back().hash);
+      s.entries.pop_back();
+    }
+    entries = (size += s.entries.size() - before);
+  }
+  GlobalMetrics().Set("mpc_solution_cache_entries", entries);
+}
+
+static SolutionCache::Mode modeFromEnv() {
+  const char *mode = getenv("MPC_SOLUTION_CACHE");
+  if (mode != nullptr && string(mode) == "on") {
+    return SolutionCache::ON;
+  } else if (mode != nullptr && string(mode) == "warm") {
+    return SolutionCache::WARM;
+  }
+  return SolutionCache::OFF;
+}
+
+static SolutionQuanta quantaFromEnv() {
+  const char *spec = getenv("MPC_SOLUTION_CACHE_QUANTA");
+  SolutionQuanta quanta;
+  if (spec != nullptr && !quanta.Parse(spec)) {
+    cerr << "Can't parse MPC_SOLUTION_CACHE_QUANTA " << spec << ", using the default cells" << endl;
+    quanta = SolutionQuanta();
+  }
+  return quanta;
+}
+
+SolutionCache &GlobalSolutionCache() {
+  const char *size = getenv("MPC_SOLUTION_CACHE_SIZE");
+  static SolutionCache cache(modeFromEnv(), (size && atoi(size) > 0) ? atoi(size) : 4096, quantaFromEnv());
+  return cache;
+}
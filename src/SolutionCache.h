@@ -0,0 +1,88 @@
+#ifndef SOLUTION_CACHE_H
+#define SOLUTION_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Eigen-3.3/Eigen/Core"
+
+using namespace std;
+
+// Size of a quantization cell of every input of a solve. Inputs in the same cells give the same key.
+struct SolutionQuanta {
+  double v;         // mph
+  double cte;       // m
+  double epsi;      // rad
+  double coeff[4];  // of the cubic in the car frame
+  double steer;     // feed-forward steering, in units of delta
+  double speed;     // reference speeds, mph
+
+  SolutionQuanta();
+
+  // Overrides cells from a comma-separated list like "v=1,cte=0.05,c3=1e-5". Returns false on unknown names.
+  bool Parse(const string &spec);
+};
+
+// Cells of all the inputs of a solve, and the horizon.
+typedef vector<int64_t> SolutionKey;
+
+// Plans (all the variables of a solution, in the car frame) of recently solved inputs, keyed by their quantized
+// values. On repeated laps and in fleet simulations the same inputs come back over and over: a hit is either applied
+// as it is or only used to warm start the solve. Shared by all sessions; keys are hashed and compared in full on a
+// hit, least recently used plans are dropped.
+//
+// Every session looks up the cache every cycle, so lookups must not queue behind each other: the plans are spread
+// over kShards independent LRUs by hash, each with its own lock and its share of the capacity, and the metrics are
+// updated once that lock is released.
+class SolutionCache {
+ public:
+  enum Mode { OFF, WARM, ON };
+
+  SolutionCache(Mode mode, size_t capacity, const SolutionQuanta &quanta);
+
+  SolutionKey Key(size_t N, double v, double cte, double epsi, const Eigen::VectorXd &coeffs,
+                  const vector<double> &delta_ff, const vector<double> &v_ref) const;
+
+  // nullptr on a miss.
+  shared_ptr<const vector<double>> Find(const SolutionKey &key);
+  void Insert(const SolutionKey &key, shared_ptr<const vector<double>> plan);
+
+  const Mode mode;
+
+ private:
+  static const size_t kShards = 16;
+
+  struct Entry {
+    uint64_t hash;
+    SolutionKey key;
+    shared_ptr<const vector<double>> plan;
+  };
+
+  struct Shard {
+    mutex lock;
+    list<Entry> entries;  // most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+  };
+
+  static uint64_t hash(const SolutionKey &key);
+
+  SolutionQuanta quanta;
+  size_t shard_capacity;
+  Shard shards[kShards];
+  atomic<uint64_t> hits, misses;
+  atomic<size_t> size;
+
+  Shard &shard(uint64_t h) { return shards[(h >> 32) % kShards]; }
+};
+
+// MPC_SOLUTION_CACHE=on|warm turns it on, MPC_SOLUTION_CACHE_SIZE plans (4096 by default) quantized with
+// MPC_SOLUTION_CACHE_QUANTA (see SolutionQuanta::Parse).
+SolutionCache &GlobalSolutionCache();
+
+#endif /* SOLUTION_CACHE_H */
@@ -0,0 +1,155 @@
+#include "SolverPool.h"
+#include <stdlib.h>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <cppad/cppad.hpp>
+#include "Metrics.h"
+
+// CppAD's view of the threads (see CppAD::thread_alloc::parallel_setup): workers are 1, 2, ..., the others 0.
+//
+// in_parallel stays true from the setup until the pool is destroyed, whether or not a worker is busy at the time.
+// That is how CppAD's own thread teams (team_pthread.cpp) answer it: what CppAD must not do in parallel mode is
+// initialize its statics and change the setup, and parallel_ad has done the former before it is turned on, the
+// destructor the latter after it is turned off. Answering from the number of busy workers would flip the mode under
+// the loop thread in the middle of its own CppAD calls.
+static thread_local size_t cppad_thread = 0;
+static bool cppad_parallel = false;
+
+static bool cppadInParallel() { return cppad_parallel; }
+static size_t cppadThreadNum() { return cppad_thread; }
+
+SolverPool::SolverPool(size_t threads) : threads(threads), stopping(false) {
+  if (threads > 1) {
+    // Has to happen while only this thread uses CppAD.
+    CppAD::thread_alloc::parallel_setup(threads + 1, cppadInParallel, cppadThreadNum);
+    CppAD::thread_alloc::hold_memory(true);
+    CppAD::parallel_ad<double>();
+    cppad_parallel = true;
+  }
+  GlobalMetrics().Set("mpc_solver_threads", threads);
+}
+
+SolverPool::~SolverPool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (thread &worker : workers) {
+    worker.join();
+  }
+  if (cppad_parallel) {
+    // Back to a single thread, as CppAD's team_destroy does.
+    cppad_parallel = false;
+    CppAD::thread_alloc::parallel_setup(1, nullptr, nullptr);
+    CppAD::thread_alloc::hold_memory(false);
+  }
+}
+
+void SolverPool::Submit(function<void()> job) {
+  size_t queued;
+  {
+    lock_guard<mutex> guard(lock);
+    if (workers.empty()) {
+      for (size_t i = 0; i < threads; i++) {
+        workers.push_back(thread(&SolverPool::work, this, i));
+      }
+    }
+    jobs.push_back(move(job));
+    queued = jobs.size();
+  }
+  wake.notify_one();
+  GlobalMetrics().Set("mpc_solver_queue", queued);
+}
+
+// An ongoing ForEach. Shared with the helper jobs, which may only get to run after it has returned (and then find
+// nothing left to do, which is why no exception may leave an item unfinished: fn lives on the caller's stack).
+struct ForEachState {
+  atomic<size_t> next;
+  size_t n;
+  const function<void(size_t)> *fn;
+  mutex lock;
+  condition_variable all_done;
+  size_t done;
+  exception_ptr error;
+};
+
+// Calls fn(i), keeping the first exception in `error` instead of letting it through.
+static void forEachItem(const function<void(size_t)> &fn, size_t i, mutex &lock, exception_ptr &error) {
+  try {
+    fn(i);
+  } catch (...) {
+    lock_guard<mutex> guard(lock);
+    if (!error) {
+      error = current_exception();
+    }
+  }
+}
+
+// Takes items of `state` until there are none left.
+static void forEachItems(ForEachState &state) {
+  size_t finished = 0;
+  for (size_t i = state.next++; i < state.n; i = state.next++) {
+    forEachItem(*state.fn, i, state.lock, state.error);
+    finished++;
+  }
+  if (finished > 0) {
+    lock_guard<mutex> guard(state.lock);
+    state.done += finished;
+    if (state.done == state.n) {
+      state.all_done.notify_all();
+    }
+  }
+}
+
+void SolverPool::ForEach(size_t n, const function<void(size_t)> &fn) {
+  if (threads <= 1 || n <= 1) {
+    mutex lock;
+    exception_ptr error;
+    for (size_t i = 0; i < n; i++) {
+      forEachItem(fn, i, lock, error);
+    }
+    if (error) {
+      rethrow_exception(error);
+    }
+    return;
+  }
+  shared_ptr<ForEachState> state(new ForEachState());
+  state->next = 0;
+  state->n = n;
+  state->fn = &fn;
+  state->done = 0;
+  size_t helpers = n - 1 < threads ? n - 1 : threads;
+  for (size_t i = 0; i < helpers; i++) {
+    Submit([state] { forEachItems(*state); });
+  }
+  forEachItems(*state);
+  unique_lock<mutex> guard(state->lock);
+  state->all_done.wait(guard, [&state] { return state->done == state->n; });
+  if (state->error) {
+    rethrow_exception(state->error);
+  }
+}
+
+void SolverPool::work(size_t index) {
+  cppad_thread = cppad_parallel ? index + 1 : 0;
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+    if (jobs.empty()) {
+      return;
+    }
+    function<void()> job = move(jobs.front());
+    jobs.pop_front();
+    guard.unlock();
+    job();
+    guard.lock();
+  }
+}
+
+SolverPool &GlobalSolverPool() {
+  const char *threads = getenv("MPC_SOLVER_THREADS");
+  static SolverPool pool((threads && atoi(threads) > 0) ? atoi(threads) : 1);
+  return pool;
+}
@@ -0,0 +1,50 @@
+#ifndef SOLVER_POOL_H
+#define SOLVER_POOL_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Worker threads that run whole solves (as opposed to ThreadPool.h, which splits the stages of one solve), so that
+// the solves of different sessions run side by side. Jobs run in the order they were submitted, each on one worker.
+//
+// CppAD keeps its tapes and its memory pools per thread, but only once it has been told how to tell the threads
+// apart: the pool sets that up when it starts, with the workers as CppAD threads 1, 2, ... and everybody else (the
+// event loop) as thread 0. So there can only be one pool with more than one worker per process (GlobalSolverPool),
+// and it has to be started before any solve. The workers themselves only start with the first job, so a pool whose
+// ForEach runs everything inline (a single worker, the default C++11 build) never starts a thread.
+class SolverPool {
+ public:
+  explicit SolverPool(size_t threads);
+  ~SolverPool();
+
+  size_t Threads() const { return threads; }
+  // Queues job; it runs on one of the workers.
+  void Submit(function<void()> job);
+  // Calls fn(i) for every i in [0, n), on the calling thread and on the workers that are free to help, and returns
+  // once all of them are done. fn has to write item i to its own slots. Runs everything on the calling thread with a
+  // single worker, which is CppAD thread 0 just like the caller then. An exception thrown by fn doesn't stop the
+  // other items; the first one is rethrown on the calling thread once they are all done.
+  void ForEach(size_t n, const function<void(size_t)> &fn);
+
+ private:
+  size_t threads;
+  vector<thread> workers;
+  mutex lock;
+  condition_variable wake;
+  deque<function<void()> > jobs;
+  bool stopping;
+
+  void work(size_t index);
+};
+
+// Pool of MPC_SOLVER_THREADS workers (1 by default).
+SolverPool &GlobalSolverPool();
+
+#endif /* SOLVER_POOL_H */
@@ -0,0 +1,113 @@
+#include "SpeedProfile.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+static const double kMetersPerSecondPerMph = 0.44704;
+
+void SpeedProfile::Compute(const Track &track, const SpeedLimits &limits, double spacing) {
+  this->spacing = spacing;
+  v.clear();
+  if (track.Empty() || spacing <= 0) {
+    return;
+  }
+  size_t n = static_cast<size_t>(ceil(track.Length() / spacing));
+  double ds = track.Length() / n;
+  this->spacing = ds;
+
+  // Curvature limit, in m/s: v^2 |k| <= lateral_accel.
+  vector<double> limit(n);
+  double max_speed = limits.max_speed * kMetersPerSecondPerMph;
+  for (size_t i = 0; i < n; i++) {
+    double k = fabs(track.Curvature(i * ds));
+    limit[i] = (k > 0) ? min(max_speed, sqrt(limits.lateral_accel / k)) : max_speed;
+  }
+
+  // Forward pass under the acceleration limit, backward pass under the braking limit. Starting both from the slowest
+  // point of the loop, which no pass can lower, makes one lap enough.
+  size_t slowest = min_element(limit.begin(), limit.end()) - limit.begin();
+  v = limit;
+  for (size_t step = 1; step <= n; step++) {
+    size_t i = (slowest + step) % n, prev = (slowest + step - 1) % n;
+    v[i] = min(v[i], sqrt(v[prev] * v[prev] + 2 * limits.accel * ds));
+  }
+  for (size_t step = 1; step <= n; step++) {
+    size_t i = (slowest + n - step) % n, next = (slowest + n - step + 1) % n;
+    v[i] = min(v[i], sqrt(v[next] * v[next] + 2 * limits.decel * ds));
+  }
+  for (double &speed : v) {
+    speed /= kMetersPerSecondPerMph;
+  }
+}
+
+bool SpeedProfile::Load(const string &path) {
+  v.clear();
+  ifstream in(path.c_str());
+  string line;
+  if (!getline(in, line)) {
+    return false;
+  }
+  vector<double> s;
+  while (getline(in, line)) {
+    double at, speed;
+    if (sscanf(line.c_str(), "%lf,%lf", &at, &speed) == 2) {
+      s.push_back(at);
+      v.push_back(speed);
+    }
+  }
+  if (v.size() < 2 || s[0] != 0) {
+    v.clear();
+    return false;
+  }
+  spacing = s.back() / (s.size() - 1);
+  for (size_t i = 1; i < s.size(); i++) {
+    if (!(spacing > 0) || fabs(s[i] - i * spacing) > 0.01) {
+      v.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+string SpeedProfile::Csv() const {
+  ostringstream out;
+  out << "s,v\n";
+  char line[64];
+  for (size_t i = 0; i < v.size(); i++) {
+    snprintf(line, sizeof(line), "%.4f,%.3f\n", i * spacing, v[i]);
+    out << line;
+  }
+  return out.str();
+}
+
+double SpeedProfile::Speed(double at) const {
+  if (Empty()) {
+    return 0;
+  }
+  double length = v.size() * spacing;
+  at = fmod(at, length);
+  if (at < 0) {
+    at += length;
+  }
+  size_t i = min(v.size() - 1, static_cast<size_t>(at / spacing));
+  double t = at / spacing - i;
+  return v[i] + t * (v[(i + 1) % v.size()] - v[i]);
+}
+
+static SpeedProfile loadSpeedProfile() {
+  SpeedProfile profile;
+  const char *path = getenv("MPC_SPEED_PROFILE");
+  if (path != nullptr && !profile.Load(path)) {
+    cerr << "Can't load the speed profile from " << path << ", using a constant reference speed" << endl;
+  }
+  return profile;
+}
+
+const SpeedProfile &GlobalSpeedProfile() {
+  static const SpeedProfile profile = loadSpeedProfile();
+  return profile;
+}
@@ -0,0 +1,51 @@
+#ifndef SPEED_PROFILE_H
+#define SPEED_PROFILE_H
+
+#include <string>
+#include <vector>
+#include "Track.h"
+
+using namespace std;
+
+// Limits the speed profile is computed under. Speeds are in the units of the model (mph, like ref_v), accelerations
+// in m/s^2.
+struct SpeedLimits {
+  double max_speed;
+  double lateral_accel;
+  double accel;
+  double decel;
+
+  SpeedLimits() : max_speed(60), lateral_accel(8), accel(3), decel(6) {}
+};
+
+// Reference speed along the whole track, sampled every Spacing() m of arc length: as fast as the curvature allows
+// under a lateral acceleration limit, and reachable from (and able to brake for) its neighbours under the
+// longitudinal limits. It is computed offline by mpc_speed_profile and stored as a table ("s,v" header, one sample
+// per line), which the controller loads with MPC_SPEED_PROFILE.
+class SpeedProfile {
+ public:
+  SpeedProfile() : spacing(1) {}
+
+  void Compute(const Track &track, const SpeedLimits &limits, double spacing);
+
+  // Returns false (and leaves the profile empty) if the table can't be read or isn't evenly spaced.
+  bool Load(const string &path);
+  string Csv() const;
+
+  bool Empty() const { return v.empty(); }
+  double Spacing() const { return spacing; }
+  size_t Size() const { return v.size(); }
+
+  // Speed at arc length `at` (mph), interpolated and wrapping around the loop.
+  double Speed(double at) const;
+
+ private:
+  double spacing;
+  // v[i] is the speed at arc length i * spacing; the loop closes from the last sample back to the first.
+  vector<double> v;
+};
+
+// The profile of MPC_SPEED_PROFILE, empty (constant ref_v) if it is unset or can't be loaded.
+const SpeedProfile &GlobalSpeedProfile();
+
+#endif /* SPEED_PROFILE_H */
@@ -0,0 +1,183 @@
+#include "Stage.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include "LiveStats.h"
+#include "Metrics.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+static const char *kStageNames[kNumStages] = {"idle", "parse", "fit", "solve", "tape", "ipopt", "respond"};
+static const char *kCounterNames[StageScope::kNumCounters] = {"cycles", "instructions", "l1d_misses",
+                                                              "llc_misses", "branch_misses", "context_switches"};
+
+static thread_local Stage current_stage = kStageIdle;
+static thread_local double last_seconds[kNumStages];
+static const bool perf_enabled = getenv("MPC_PERF_COUNTERS") != nullptr;
+
+const char *StageName(Stage stage) { return kStageNames[stage]; }
+
+Stage CurrentStage() { return current_stage; }
+
+double LastStageSeconds(Stage stage) { return last_seconds[stage]; }
+
+namespace {
+
+// The counters of one thread, in a single perf group so they are scheduled together. Counters the kernel or the
+// hardware doesn't offer are left out (fd -1).
+struct PerfGroup {
+  bool opened;
+  int leader;
+  int fds[StageScope::kNumCounters];
+
+  PerfGroup() : opened(false), leader(-1) {
+    for (int c = 0; c < StageScope::kNumCounters; c++) {
+      fds[c] = -1;
+    }
+  }
+
+  ~PerfGroup() {
+    for (int c = 0; c < StageScope::kNumCounters; c++) {
+      if (fds[c] >= 0) {
+        close(fds[c]);
+      }
+    }
+  }
+
+  void Open();
+  bool Read(uint64_t values[StageScope::kNumCounters]);
+};
+
+#ifdef __linux__
+void PerfGroup::Open() {
+  opened = true;
+  struct {
+    uint32_t type;
+    uint64_t config;
+  } events[StageScope::kNumCounters] = {
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                               (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  };
+  for (int c = 0; c < StageScope::kNumCounters; c++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[c].type;
+    attr.config = events[c].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // This thread, any CPU.
+    fds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fds[c] >= 0 && leader < 0) {
+      leader = fds[c];
+    }
+  }
+  if (leader < 0) {
+    static once_flag warned;
+    call_once(warned, [] {
+      cerr << "perf_event_open failed (" << strerror(errno) << "), no hardware counters" << endl;
+    });
+  }
+}
+
+bool PerfGroup::Read(uint64_t values[StageScope::kNumCounters]) {
+  if (!opened) {
+    Open();
+  }
+  if (leader < 0) {
+    return false;
+  }
+  // nr, then (value, id) for every counter of the group in the order they were opened.
+  uint64_t buf[1 + 2 * StageScope::kNumCounters];
+  if (read(leader, buf, sizeof(buf)) < static_cast<ssize_t>(sizeof(uint64_t))) {
+    return false;
+  }
+  uint64_t nr = buf[0];
+  uint64_t k = 0;
+  for (int c = 0; c < StageScope::kNumCounters; c++) {
+    values[c] = (fds[c] >= 0 && k < nr) ? buf[1 + 2 * k++] : 0;
+  }
+  return true;
+}
+#else
+void PerfGroup::Open() { opened = true; }
+bool PerfGroup::Read(uint64_t values[StageScope::kNumCounters]) { return false; }
+#endif
+
+thread_local PerfGroup perf_group;
+
+// Per-stage totals over all threads, for the ratios.
+mutex totals_lock;
+double totals[kNumStages][StageScope::kNumCounters];
+
+void report(Stage stage, const uint64_t delta[StageScope::kNumCounters]) {
+  const string label = string("{stage=\"") + kStageNames[stage] + "\"}";
+  Metrics &m = GlobalMetrics();
+  double t[StageScope::kNumCounters];
+  {
+    lock_guard<mutex> guard(totals_lock);
+    for (int c = 0; c < StageScope::kNumCounters; c++) {
+      totals[stage][c] += delta[c];
+      t[c] = totals[stage][c];
+    }
+  }
+  for (int c = 0; c < StageScope::kNumCounters; c++) {
+    m.Add(string("mpc_stage_") + kCounterNames[c] + "_total" + label, delta[c]);
+  }
+  if (t[StageScope::kCycles] > 0 && t[StageScope::kInstructions] > 0) {
+    double kinstr = t[StageScope::kInstructions] / 1000;
+    m.Set("mpc_stage_ipc" + label, t[StageScope::kInstructions] / t[StageScope::kCycles]);
+    m.Set("mpc_stage_l1d_misses_per_kinstr" + label, t[StageScope::kL1dMisses] / kinstr);
+    m.Set("mpc_stage_llc_misses_per_kinstr" + label, t[StageScope::kLlcMisses] / kinstr);
+    m.Set("mpc_stage_branch_misses_per_kinstr" + label, t[StageScope::kBranchMisses] / kinstr);
+  }
+}
+
+}  // namespace
+
+StageScope::StageScope(Stage stage)
+    : stage(stage), outer(current_stage), begin(chrono::steady_clock::now()), counting(false), ended(false) {
+  current_stage = stage;
+  if (perf_enabled) {
+    counting = perf_group.Read(start);
+  }
+}
+
+StageScope::~StageScope() { End(); }
+
+void StageScope::End() {
+  if (ended) {
+    return;
+  }
+  ended = true;
+  if (counting) {
+    uint64_t end[kNumCounters];
+    if (perf_group.Read(end)) {
+      uint64_t delta[kNumCounters];
+      for (int c = 0; c < kNumCounters; c++) {
+        delta[c] = end[c] - start[c];
+      }
+      report(stage, delta);
+    }
+  }
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+  last_seconds[stage] = elapsed;
+  GlobalMetrics().Observe(string("mpc_stage_seconds{stage=\"") + kStageNames[stage] + "\"}", elapsed);
+  RecordLiveStage(stage, elapsed);
+  current_stage = outer;
+}
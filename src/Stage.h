@@ -0,0 +1,53 @@
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <stdint.h>
+#include <chrono>
+
+// The stages of handling one telemetry message.
+enum Stage {
+  kStageIdle,
+  kStageParse,       // JSON parsing and latency prediction
+  kStageFit,         // waypoint fit and initial state
+  kStageSolve,       // MPC::Solve as a whole
+  kStageTape,        // taping FG_eval and the sparsity patterns
+  kStageIpopt,       // Ipopt iterations (with all derivative evaluations)
+  kStageRespond,     // building the reply
+  kNumStages
+};
+
+const char *StageName(Stage stage);
+
+// The stage the calling thread is in.
+Stage CurrentStage();
+
+// Wall time of the last `stage` that ended on the calling thread (s).
+double LastStageSeconds(Stage stage);
+
+// Measures a stage on the calling thread from construction to destruction: wall time always, and when
+// MPC_PERF_COUNTERS is set also hardware counters from perf_event_open (cycles, instructions, L1D and LLC misses,
+// branch misses, context switches), opened once per thread. Per-stage totals, IPC and miss rates end up in the
+// metrics. Scopes may nest (the solve contains taping and Ipopt); every scope counts everything inside it.
+class StageScope {
+ public:
+  explicit StageScope(Stage stage);
+  ~StageScope();
+
+  // Ends the stage before the end of the scope.
+  void End();
+
+  enum Counter { kCycles, kInstructions, kL1dMisses, kLlcMisses, kBranchMisses, kContextSwitches, kNumCounters };
+
+ private:
+  Stage stage;
+  Stage outer;
+  std::chrono::steady_clock::time_point begin;
+  bool counting;
+  bool ended;
+  uint64_t start[kNumCounters];
+
+  StageScope(const StageScope &);
+  StageScope &operator=(const StageScope &);
+};
+
+#endif /* STAGE_H */
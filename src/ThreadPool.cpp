@@ -0,0 +1,83 @@
+#include "ThreadPool.h"
+#include <stdlib.h>
+
+ThreadPool::ThreadPool(size_t threads)
+    : job(nullptr), job_n(0), job_chunk(0), generation(0), pending(0), stopping(false) {
+  for (size_t i = 1; i < threads; i++) {
+    workers.push_back(thread(&ThreadPool::work, this, i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (thread &worker : workers) {
+    worker.join();
+  }
+}
+
+size_t ThreadPool::Chunks(size_t n, size_t grain) const {
+  if (n == 0) {
+    return 0;
+  }
+  size_t chunks = (grain > 0) ? (n + grain - 1) / grain : n;
+  return chunks < Threads() ? chunks : Threads();
+}
+
+void ThreadPool::ParallelFor(size_t n, size_t grain, const function<void(size_t, size_t)> &fn) {
+  size_t chunks = Chunks(n, grain);
+  unique_lock<mutex> running(busy, try_to_lock);
+  if (chunks <= 1 || !running.owns_lock()) {
+    if (n > 0) {
+      fn(0, n);
+    }
+    return;
+  }
+  size_t chunk = (n + chunks - 1) / chunks;
+  {
+    lock_guard<mutex> guard(lock);
+    job = &fn;
+    job_n = n;
+    job_chunk = chunk;
+    pending = workers.size();
+    generation++;
+  }
+  wake.notify_all();
+  fn(0, chunk < n ? chunk : n);
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [this] { return pending == 0; });
+  job = nullptr;
+}
+
+void ThreadPool::work(size_t index) {
+  size_t seen = 0;
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    wake.wait(guard, [&] { return stopping || generation != seen; });
+    if (stopping) {
+      return;
+    }
+    seen = generation;
+    const function<void(size_t, size_t)> *fn = job;
+    size_t begin = index * job_chunk;
+    size_t end = begin + job_chunk < job_n ? begin + job_chunk : job_n;
+    guard.unlock();
+    // Loops with fewer chunks than threads leave the last workers without items.
+    if (begin < end) {
+      (*fn)(begin, end);
+    }
+    guard.lock();
+    if (--pending == 0) {
+      done.notify_one();
+    }
+  }
+}
+
+ThreadPool &GlobalStagePool() {
+  const char *threads = getenv("MPC_STAGE_THREADS");
+  static ThreadPool pool((threads && atoi(threads) > 0) ? atoi(threads) : 1);
+  return pool;
+}
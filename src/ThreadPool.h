@@ -0,0 +1,56 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A fixed set of threads that stay alive between solves, for splitting the work of one solve (the stages of the
+// horizon, see StageEval in MPC.cpp) without paying for thread creation on every Ipopt iteration.
+//
+// ParallelFor cuts [0, n) into contiguous chunks of at least `grain` items, at most one per thread, the calling
+// thread taking the first. Which items land in which chunk only depends on n, grain and the size of the pool, and
+// the callers write every item to its own slots, so results don't depend on scheduling. The pool runs one
+// ParallelFor at a time: a caller that finds it busy (another session's solve) runs its loop by itself.
+class ThreadPool {
+ public:
+  // threads counts the calling thread, so ThreadPool(1) starts none and runs everything inline.
+  explicit ThreadPool(size_t threads);
+  ~ThreadPool();
+
+  size_t Threads() const { return workers.size() + 1; }
+  // Number of chunks ParallelFor splits n items into.
+  size_t Chunks(size_t n, size_t grain) const;
+
+  // Calls fn(begin, end) for the chunks of [0, n) and returns once all of them are done.
+  void ParallelFor(size_t n, size_t grain, const function<void(size_t, size_t)> &fn);
+
+ private:
+  vector<thread> workers;
+  // Held for a whole ParallelFor.
+  mutex busy;
+
+  mutex lock;
+  condition_variable wake;
+  condition_variable done;
+  // The loop being run, its size and chunk length, bumped generation for every loop.
+  const function<void(size_t, size_t)> *job;
+  size_t job_n;
+  size_t job_chunk;
+  size_t generation;
+  // Workers still running the current loop.
+  size_t pending;
+  bool stopping;
+
+  void work(size_t index);
+};
+
+// Pool of MPC_STAGE_THREADS threads (at least one) for stage-parallel evaluation.
+ThreadPool &GlobalStagePool();
+
+#endif /* THREAD_POOL_H */
@@ -0,0 +1,199 @@
+#include "TimerWheel.h"
+#include <utility>
+
+// vector's fill constructor takes kNone by reference.
+const int32_t TimerWheel::kNone;
+
+TimerWheel::TimerWheel(uint64_t now)
+    : current(now),
+      pending(0),
+      free_list(kNone),
+      heads(kLevels * kSlots, static_cast<int32_t>(kNone)),
+      level_size(kLevels, 0) {}
+
+TimerWheel::Handle TimerWheel::Schedule(uint64_t delay, function<void()> fn) {
+  int32_t index;
+  if (free_list != kNone) {
+    index = free_list;
+    free_list = timers[index].next;
+  } else {
+    index = static_cast<int32_t>(timers.size());
+    timers.push_back(Timer());
+    timers[index].generation = 0;
+  }
+  Timer &timer = timers[index];
+  timer.due = current + (delay > 0 ? delay : 1);
+  timer.fn = move(fn);
+  place(index);
+  pending++;
+  return (static_cast<uint64_t>(timer.generation) << 32) | static_cast<uint64_t>(index + 1);
+}
+
+bool TimerWheel::Cancel(Handle handle) {
+  uint64_t index = (handle & 0xffffffffu) - 1;
+  if (handle == 0 || index >= timers.size()) {
+    return false;
+  }
+  Timer &timer = timers[index];
+  if (timer.generation != static_cast<uint32_t>(handle >> 32) || timer.slot == kFree) {
+    return false;
+  }
+  pending--;
+  if (timer.slot == kExpired) {
+    // Part of the batch being run: Advance releases it without calling it.
+    timer.fn = nullptr;
+    timer.generation++;
+    return true;
+  }
+  unlink(index);
+  release(index);
+  return true;
+}
+
+size_t TimerWheel::Advance(uint64_t now) {
+  const uint64_t mask = kSlots - 1;
+  while (current < now) {
+    // Ticks with nothing to expire or to cascade are skipped: up to the next cascade of the lowest level with timers,
+    // or all the way if there are none.
+    int lowest = 0;
+    while (lowest < kLevels && level_size[lowest] == 0) {
+      lowest++;
+    }
+    if (lowest == kLevels) {
+      current = now;
+      break;
+    }
+    if (lowest > 0) {
+      uint64_t skip = (current | ((uint64_t(1) << (lowest * kLevelBits)) - 1));
+      if (skip >= now) {
+        current = now;
+        break;
+      }
+      current = skip;
+    }
+    current++;
+    // Spread the next slot of every level whose lower levels just wrapped around, top down, so that timers moving
+    // down more than one level in the same tick end up in level 0.
+    int top = 0;
+    while (top + 1 < kLevels && (current & ((uint64_t(1) << ((top + 1) * kLevelBits)) - 1)) == 0) {
+      top++;
+    }
+    for (int level = top; level > 0; level--) {
+      cascade(level);
+    }
+    int32_t slot = static_cast<int32_t>(current & mask);
+    for (int32_t index = heads[slot]; index != kNone; index = timers[index].next) {
+      timers[index].slot = kExpired;
+      expired.push_back(index);
+      level_size[0]--;
+    }
+    heads[slot] = kNone;
+  }
+
+  size_t fired = 0;
+  for (size_t i = 0; i < expired.size(); i++) {
+    int32_t index = expired[i];
+    if (!timers[index].fn) {
+      release(index);
+      continue;
+    }
+    function<void()> fn = move(timers[index].fn);
+    timers[index].fn = nullptr;
+    pending--;
+    release(index);
+    fn();
+    fired++;
+  }
+  expired.clear();
+  return fired;
+}
+
+uint64_t TimerWheel::NextDue() const {
+  const uint64_t mask = kSlots - 1;
+  uint64_t next = kNever;
+  // Level 0: the first slot after the current tick with timers.
+  for (uint64_t k = 1; level_size[0] > 0 && k <= kSlots; k++) {
+    if (heads[(current + k) & mask] != kNone) {
+      next = current + k;
+      break;
+    }
+  }
+  // The levels above: the first tick whose cascade finds timers, at a multiple of the level's slot width.
+  for (int level = 1; level < kLevels; level++) {
+    int shift = level * kLevelBits;
+    for (uint64_t k = 1; level_size[level] > 0 && k <= kSlots; k++) {
+      uint64_t tick = ((current >> shift) + k) << shift;
+      if (tick >= next) {
+        break;
+      }
+      if (heads[level * kSlots + ((tick >> shift) & mask)] != kNone) {
+        next = tick;
+        break;
+      }
+    }
+  }
+  return next;
+}
+
+void TimerWheel::place(int32_t index) {
+  const uint64_t mask = kSlots - 1;
+  // Scheduled timers are due after the current tick, cascaded ones at the current tick at the earliest (and then go
+  // to the slot Advance is about to expire).
+  uint64_t due = timers[index].due;
+  uint64_t delta = due - current;
+  int level = 0;
+  while (level + 1 < kLevels && delta >= (uint64_t(1) << ((level + 1) * kLevelBits))) {
+    level++;
+  }
+  if (level == kLevels - 1 && (delta >> (kLevels * kLevelBits)) != 0) {
+    // Out of reach: wait in the farthest slot and get placed again from there.
+    due = current + (uint64_t(1) << (kLevels * kLevelBits)) - 1;
+  }
+  link(index, static_cast<int32_t>(level * kSlots + ((due >> (level * kLevelBits)) & mask)));
+}
+
+void TimerWheel::link(int32_t index, int32_t slot) {
+  Timer &timer = timers[index];
+  timer.slot = slot;
+  level_size[slot / kSlots]++;
+  timer.prev = kNone;
+  timer.next = heads[slot];
+  if (timer.next != kNone) {
+    timers[timer.next].prev = index;
+  }
+  heads[slot] = index;
+}
+
+void TimerWheel::unlink(int32_t index) {
+  Timer &timer = timers[index];
+  level_size[timer.slot / kSlots]--;
+  if (timer.prev != kNone) {
+    timers[timer.prev].next = timer.next;
+  } else {
+    heads[timer.slot] = timer.next;
+  }
+  if (timer.next != kNone) {
+    timers[timer.next].prev = timer.prev;
+  }
+}
+
+void TimerWheel::cascade(int level) {
+  const uint64_t mask = kSlots - 1;
+  int32_t slot = static_cast<int32_t>(level * kSlots + ((current >> (level * kLevelBits)) & mask));
+  int32_t index = heads[slot];
+  heads[slot] = kNone;
+  while (index != kNone) {
+    level_size[level]--;
+    int32_t next = timers[index].next;
+    place(index);
+    index = next;
+  }
+}
+
+void TimerWheel::release(int32_t index) {
+  Timer &timer = timers[index];
+  timer.slot = kFree;
+  timer.generation++;
+  timer.next = free_list;
+  free_list = index;
+}
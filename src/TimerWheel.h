@@ -0,0 +1,87 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+// Timers of all sessions (the emulated actuation latency, idle timeouts) on one hierarchical timing wheel, driven
+// from the event loop.
+//
+// Time is counted in ticks; the caller decides how long one is (main.cpp uses 1 ms) and calls Advance with the
+// current tick. There are kLevels wheels of kSlots slots: level 0 holds the timers due in the next kSlots ticks, one
+// slot per tick, level 1 the ones due in the next kSlots^2 ticks, one slot per kSlots ticks, and so on. Scheduling
+// and cancelling link or unlink a timer in one slot, so both are O(1) whatever the number of timers. When level 0
+// wraps around, the next slot of level 1 is spread over level 0 (and likewise up the levels), so every timer is
+// moved at most kLevels - 1 times in its life. Timers further out than the top level can reach wait there and are
+// placed again when their slot comes around.
+//
+// Timers live in a pool that is reused, so a steady number of timers doesn't allocate (besides the callbacks' own
+// captures). Not thread safe: schedule, cancel and advance from the loop thread.
+class TimerWheel {
+ public:
+  // Identifies a scheduled timer; 0 is never one. Handles of fired or cancelled timers are never reused.
+  typedef uint64_t Handle;
+
+  static const int kLevelBits = 8;
+  static const int kLevels = 4;
+  static const size_t kSlots = 1 << kLevelBits;
+
+  // `now` is the current tick.
+  explicit TimerWheel(uint64_t now = 0);
+
+  // Calls fn from the first Advance to reach now + delay ticks (the next one for a delay of 0).
+  Handle Schedule(uint64_t delay, function<void()> fn);
+  // Drops a timer that hasn't fired yet and returns true, false if it has fired or been cancelled already.
+  bool Cancel(Handle handle);
+
+  // Moves time forward to `now` and fires the timers due by then, in the order of their ticks. The expired timers
+  // are collected over all the ticks first, then their callbacks run; callbacks may schedule and cancel timers,
+  // including the ones of the same batch that haven't run yet. Returns the number of callbacks run.
+  size_t Advance(uint64_t now);
+
+  uint64_t Now() const { return current; }
+  // Timers scheduled and not fired or cancelled yet.
+  size_t Size() const { return pending; }
+
+  // The first tick after Now() at which Advance has something to do, a timer to fire or timers to move down a
+  // level, or kNever without timers. No timer fires before it, so the caller can sleep until then.
+  static const uint64_t kNever = UINT64_MAX;
+  uint64_t NextDue() const;
+
+ private:
+  static const int32_t kNone = -1;
+  // `slot` of timers that aren't on the wheel: in the pool's free list, or expired and waiting to run.
+  static const int32_t kFree = -1;
+  static const int32_t kExpired = -2;
+
+  struct Timer {
+    uint64_t due;
+    uint32_t generation;
+    int32_t slot;
+    int32_t prev, next;
+    function<void()> fn;
+  };
+
+  uint64_t current;
+  size_t pending;
+  vector<Timer> timers;
+  int32_t free_list;
+  // First timer of every slot, level by level, and the number of timers on every level.
+  vector<int32_t> heads;
+  vector<size_t> level_size;
+  // Timers that expired during the current Advance, in order.
+  vector<int32_t> expired;
+
+  void place(int32_t index);
+  void link(int32_t index, int32_t slot);
+  void unlink(int32_t index);
+  // Moves the timers of one slot of a higher level down to the levels below.
+  void cascade(int level);
+  void release(int32_t index);
+};
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,118 @@
+#include "Track.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fstream>
+#include <iostream>
+
+bool Track::Load(const string &path) {
+  x.clear();
+  y.clear();
+  s.clear();
+  k.clear();
+  ifstream in(path.c_str());
+  string line;
+  if (!getline(in, line)) {
+    return false;
+  }
+  while (getline(in, line)) {
+    double px, py;
+    if (sscanf(line.c_str(), "%lf,%lf", &px, &py) == 2) {
+      x.push_back(px);
+      y.push_back(py);
+    }
+  }
+  if (x.size() < 3) {
+    x.clear();
+    y.clear();
+    return false;
+  }
+  s.push_back(0);
+  for (size_t i = 0; i < x.size(); i++) {
+    size_t j = (i + 1) % x.size();
+    s.push_back(s.back() + sqrt((x[j] - x[i]) * (x[j] - x[i]) + (y[j] - y[i]) * (y[j] - y[i])));
+  }
+
+  // Signed curvature of the circle through three consecutive waypoints: 2 sin(angle at the middle one) over the
+  // distance between the outer ones.
+  size_t n = x.size();
+  vector<double> menger(n);
+  for (size_t i = 0; i < n; i++) {
+    size_t a = (i + n - 1) % n, c = (i + 1) % n;
+    double cross = (x[i] - x[a]) * (y[c] - y[i]) - (y[i] - y[a]) * (x[c] - x[i]);
+    double sides = hypot(x[i] - x[a], y[i] - y[a]) * hypot(x[c] - x[i], y[c] - y[i]) * hypot(x[c] - x[a], y[c] - y[a]);
+    menger[i] = (sides > 0) ? 2 * cross / sides : 0;
+  }
+  k.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    k[i] = 0.25 * menger[(i + n - 1) % n] + 0.5 * menger[i] + 0.25 * menger[(i + 1) % n];
+  }
+  return true;
+}
+
+double Track::Curvature(double at) const {
+  if (Empty()) {
+    return 0;
+  }
+  at = fmod(at, Length());
+  if (at < 0) {
+    at += Length();
+  }
+  size_t i = 0;
+  while (i + 1 < x.size() && s[i + 1] <= at) {
+    i++;
+  }
+  double t = (s[i + 1] > s[i]) ? (at - s[i]) / (s[i + 1] - s[i]) : 0;
+  return k[i] + t * (k[(i + 1) % x.size()] - k[i]);
+}
+
+double Track::Project(double px, double py, double *distance) const {
+  double best = -1, best_s = 0;
+  for (size_t i = 0; i < x.size(); i++) {
+    size_t j = (i + 1) % x.size();
+    double dx = x[j] - x[i], dy = y[j] - y[i];
+    double length_sq = dx * dx + dy * dy;
+    double t = (length_sq > 0) ? ((px - x[i]) * dx + (py - y[i]) * dy) / length_sq : 0;
+    t = (t < 0) ? 0 : (t > 1) ? 1 : t;
+    double ex = x[i] + t * dx - px, ey = y[i] + t * dy - py;
+    double d = ex * ex + ey * ey;
+    if (best < 0 || d < best) {
+      best = d;
+      best_s = s[i] + t * (s[i + 1] - s[i]);
+    }
+  }
+  if (distance != nullptr) {
+    *distance = sqrt(best);
+  }
+  return (best_s >= Length()) ? 0 : best_s;
+}
+
+void Track::Point(double at, double *px, double *py) const {
+  at = fmod(at, Length());
+  if (at < 0) {
+    at += Length();
+  }
+  size_t i = 0;
+  while (i + 1 < x.size() && s[i + 1] <= at) {
+    i++;
+  }
+  size_t j = (i + 1) % x.size();
+  double t = (s[i + 1] > s[i]) ? (at - s[i]) / (s[i + 1] - s[i]) : 0;
+  *px = x[i] + t * (x[j] - x[i]);
+  *py = y[i] + t * (y[j] - y[i]);
+}
+
+static Track loadTrack() {
+  Track track;
+  const char *path = getenv("MPC_TRACK");
+  string file = path ? path : "../lake_track_waypoints.csv";
+  if (!track.Load(file)) {
+    cerr << "Can't load the track from " << file << ", no track profile" << endl;
+  }
+  return track;
+}
+
+const Track &GlobalTrack() {
+  static const Track track = loadTrack();
+  return track;
+}
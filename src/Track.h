@@ -0,0 +1,49 @@
+#ifndef TRACK_H
+#define TRACK_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The whole track as a closed polyline through its waypoints, parametrized by arc length. The waypoint file is the
+// one of the simulator (lake_track_waypoints.csv): an "x,y" header, then one waypoint per line in driving order.
+class Track {
+ public:
+  // Returns false (and leaves the track empty) if the file can't be read or has fewer than 3 waypoints.
+  bool Load(const string &path);
+
+  bool Empty() const { return x.empty(); }
+  size_t Size() const { return x.size(); }
+
+  // Length of the loop (m).
+  double Length() const { return Empty() ? 0 : s.back(); }
+
+  // Arc length of the point of the track closest to (px, py), in [0, Length()), and optionally the distance to it.
+  double Project(double px, double py, double *distance = nullptr) const;
+
+  // Point at arc length `at`, wrapping around the loop.
+  void Point(double at, double *px, double *py) const;
+
+  // Curvature at arc length `at` (1/m, positive turning left), interpolated from the table computed on Load.
+  double Curvature(double at) const;
+
+  // Waypoint i and its arc length.
+  double X(size_t i) const { return x[i]; }
+  double Y(size_t i) const { return y[i]; }
+  double S(size_t i) const { return s[i]; }
+
+ private:
+  vector<double> x, y;
+  // s[i] is the arc length at waypoint i; s[Size()] is the length of the loop (back to waypoint 0).
+  vector<double> s;
+  // Curvature at every waypoint, from the circle through it and its neighbours, smoothed over the neighbours since
+  // the waypoints are coarse.
+  vector<double> k;
+};
+
+// The track of MPC_TRACK, by default ../lake_track_waypoints.csv (relative to the build directory). Empty if it
+// can't be loaded.
+const Track &GlobalTrack();
+
+#endif /* TRACK_H */
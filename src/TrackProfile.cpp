@@ -0,0 +1,128 @@
+#include "TrackProfile.h"
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+
+TrackProfile::TrackProfile(const Track &track, double bin_length) : track(track), bin_length(bin_length) {
+  size_t n = track.Empty() ? 0 : static_cast<size_t>(ceil(track.Length() / bin_length));
+  Bin empty = {vector<double>(), 0, 0, 0, 0, 0};
+  bins.assign(n, empty);
+}
+
+void TrackProfile::Record(double px, double py, double solve_seconds, int iterations, bool failed, bool degraded) {
+  if (bins.empty()) {
+    return;
+  }
+  size_t b = min(bins.size() - 1, static_cast<size_t>(track.Project(px, py) / bin_length));
+  lock_guard<mutex> guard(lock);
+  Bin &bin = bins[b];
+  if (bin.seconds.size() < kSamplesPerBin) {
+    bin.seconds.push_back(solve_seconds);
+  } else {
+    bin.seconds[bin.next] = solve_seconds;
+  }
+  bin.next = (bin.next + 1) % kSamplesPerBin;
+  bin.cycles++;
+  bin.iterations += iterations;
+  bin.failed += failed;
+  bin.degraded += degraded;
+}
+
+TrackProfile::Row TrackProfile::Percentiles(const Bin &bin) const {
+  Row row = {0, 0, 0, 0};
+  if (bin.seconds.empty()) {
+    return row;
+  }
+  vector<double> sorted = bin.seconds;
+  sort(sorted.begin(), sorted.end());
+  size_t n = sorted.size();
+  row.p50 = sorted[min(n - 1, n * 50 / 100)];
+  row.p90 = sorted[min(n - 1, n * 90 / 100)];
+  row.p99 = sorted[min(n - 1, n * 99 / 100)];
+  row.max = sorted[n - 1];
+  return row;
+}
+
+string TrackProfile::Csv() const {
+  ostringstream out;
+  out << "bin,s_begin,s_end,x,y,cycles,p50_ms,p90_ms,p99_ms,max_ms,mean_iterations,failed_rate,degraded_rate\n";
+  lock_guard<mutex> guard(lock);
+  for (size_t b = 0; b < bins.size(); b++) {
+    const Bin &bin = bins[b];
+    Row row = Percentiles(bin);
+    double x, y;
+    track.Point((b + 0.5) * bin_length, &x, &y);
+    double cycles = max(bin.cycles, 1.0);
+    out << b << "," << b * bin_length << "," << min((b + 1) * bin_length, track.Length()) << "," << x << "," << y
+        << "," << bin.cycles << "," << row.p50 * 1000 << "," << row.p90 * 1000 << "," << row.p99 * 1000 << ","
+        << row.max * 1000 << "," << bin.iterations / cycles << "," << bin.failed / cycles << ","
+        << bin.degraded / cycles << "\n";
+  }
+  return out.str();
+}
+
+string TrackProfile::Svg() const {
+  const double width = 800, margin = 20;
+  ostringstream out;
+  if (bins.empty()) {
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\"/>\n";
+    return out.str();
+  }
+  double min_x = track.X(0), max_x = min_x, min_y = track.Y(0), max_y = min_y;
+  for (size_t i = 0; i < track.Size(); i++) {
+    min_x = min(min_x, track.X(i));
+    max_x = max(max_x, track.X(i));
+    min_y = min(min_y, track.Y(i));
+    max_y = max(max_y, track.Y(i));
+  }
+  double scale = (width - 2 * margin) / max(max_x - min_x, max_y - min_y);
+  double height = (max_y - min_y) * scale + 2 * margin + 30;
+  // Map frame to picture: y points up on the map and down in SVG.
+  auto point = [&](double at) {
+    double x, y;
+    track.Point(at, &x, &y);
+    ostringstream p;
+    p << margin + (x - min_x) * scale << "," << margin + (max_y - y) * scale << " ";
+    return p.str();
+  };
+
+  lock_guard<mutex> guard(lock);
+  vector<Row> rows;
+  double worst = 0;
+  for (const Bin &bin : bins) {
+    rows.push_back(Percentiles(bin));
+    worst = max(worst, rows.back().p99);
+  }
+
+  out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << height << "\">\n";
+  for (size_t b = 0; b < bins.size(); b++) {
+    double begin = b * bin_length, end = min((b + 1) * bin_length, track.Length());
+    string color = "#cccccc";
+    if (bins[b].cycles > 0 && worst > 0) {
+      // Green for the fastest, red for the slowest p99.
+      ostringstream hsl;
+      hsl << "hsl(" << static_cast<int>(120 * (1 - rows[b].p99 / worst)) << ",80%,45%)";
+      color = hsl.str();
+    }
+    out << "<polyline fill=\"none\" stroke-width=\"8\" stroke=\"" << color << "\" points=\"" << point(begin);
+    for (size_t i = 0; i < track.Size(); i++) {
+      if (track.S(i) > begin && track.S(i) < end) {
+        out << point(track.S(i));
+      }
+    }
+    out << point(end) << "\"><title>s " << begin << "-" << end << " m: " << bins[b].cycles << " cycles, p50 "
+        << rows[b].p50 * 1000 << " ms, p99 " << rows[b].p99 * 1000 << " ms, "
+        << bins[b].iterations / max(bins[b].cycles, 1.0) << " iterations</title></polyline>\n";
+  }
+  out << "<text x=\"" << margin << "\" y=\"" << height - 10 << "\" font-family=\"sans-serif\" font-size=\"14\">"
+      << "p99 solve time per " << bin_length << " m, green 0 to red " << worst * 1000 << " ms</text>\n";
+  out << "</svg>\n";
+  return out.str();
+}
+
+TrackProfile &GlobalTrackProfile() {
+  const char *bin = getenv("MPC_TRACK_BIN_M");
+  static TrackProfile profile(GlobalTrack(), (bin && atof(bin) > 0) ? atof(bin) : 10);
+  return profile;
+}
@@ -0,0 +1,54 @@
+#ifndef TRACK_PROFILE_H
+#define TRACK_PROFILE_H
+
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Track.h"
+
+using namespace std;
+
+// Solver performance by position on the track. The loop is cut into bins of equal arc length, and every cycle is
+// counted in the bin the car is in: solve time (the last kSamplesPerBin of them, for percentiles), Ipopt iterations,
+// failed solves and solves the governor had to run at a reduced tier. Exported as a CSV table and as an SVG map of
+// the track colored by p99 solve time (GET /track/profile.csv, GET /track/profile.svg).
+class TrackProfile {
+ public:
+  static const size_t kSamplesPerBin = 1024;
+
+  TrackProfile(const Track &track, double bin_length);
+
+  // (px, py) is the map-frame position of the car. Ignored if there is no track.
+  void Record(double px, double py, double solve_seconds, int iterations, bool failed, bool degraded);
+
+  string Csv() const;
+  string Svg() const;
+
+ private:
+  struct Bin {
+    vector<double> seconds;  // ring of the latest solve times
+    size_t next;
+    double cycles;
+    double iterations;
+    double failed;
+    double degraded;
+  };
+
+  struct Row {
+    double p50, p90, p99, max;
+  };
+
+  const Track &track;
+  double bin_length;
+  mutable mutex lock;
+  vector<Bin> bins;
+
+  // Latency percentiles of a bin (s); the lock must be held.
+  Row Percentiles(const Bin &bin) const;
+};
+
+// Profile over GlobalTrack(), with bins of MPC_TRACK_BIN_M meters (10 by default).
+TrackProfile &GlobalTrackProfile();
+
+#endif /* TRACK_PROFILE_H */
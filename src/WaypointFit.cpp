@@ -0,0 +1,143 @@
+#include "WaypointFit.h"
+#include <math.h>
+#include <algorithm>
+#include "Eigen-3.3/Eigen/Jacobi"
+#include "Metrics.h"
+
+// Downdates slowly lose accuracy, so the factorization is rebuilt from scratch after this many rank-1 changes.
+static const size_t kMaxUpdatesBetweenRebuilds = 256;
+// A sliding window keeps the frame it was rebuilt in only while that frame is still about the one a fresh fit would
+// pick. Moving the origin doesn't change the least-squares cubic, only turning the axes does: around a bend the old
+// chord no longer follows the road and the cubic stops fitting it. So the window is refitted in a frame of its own
+// once its chord has turned by more than kMaxFrameTurn (rad, 2 degrees), or once its first waypoint is more than
+// kMaxFrameShift * scale from the origin, where the normal equations lose their conditioning.
+static const double kMaxFrameTurn = 0.035;
+static const double kMaxFrameShift = 4;
+
+WaypointFit::WaypointFit(int samples)
+    : refactorizations(0), rank_updates(0), samples(samples), valid(false), ox(0), oy(0), heading(0), scale(1),
+      x_min(0), x_max(0), updates_since_rebuild(0) {}
+
+void WaypointFit::ToWindow(double x, double y, double *u, double *v) const {
+  double dx = x - ox;
+  double dy = y - oy;
+  *u = dx * cos(heading) + dy * sin(heading);
+  *v = -dx * sin(heading) + dy * cos(heading);
+}
+
+bool WaypointFit::Apply(double x, double y, double sign) {
+  double u, v;
+  ToWindow(x, y, &u, &v);
+  double s = u / scale;
+  Vector4 row(1, s, s * s, s * s * s);
+  AtA += sign * row * row.transpose();
+  Aty += sign * v * row;
+  llt.rankUpdate(row, sign);
+  rank_updates++;
+  updates_since_rebuild++;
+  return llt.info() == Eigen::Success;
+}
+
+void WaypointFit::Rebuild(const vector<double> &ptsx, const vector<double> &ptsy) {
+  size_t n = ptsx.size();
+  refactorizations++;
+  updates_since_rebuild = 0;
+  wx = ptsx;
+  wy = ptsy;
+
+  ox = ptsx[0];
+  oy = ptsy[0];
+  double chord = sqrt((ptsx[n - 1] - ox) * (ptsx[n - 1] - ox) + (ptsy[n - 1] - oy) * (ptsy[n - 1] - oy));
+  heading = atan2(ptsy[n - 1] - oy, ptsx[n - 1] - ox);
+  scale = (chord / 2 > 1) ? chord / 2 : 1;
+
+  AtA.setZero();
+  Aty.setZero();
+  valid = true;
+  double last_u = -1;
+  for (size_t i = 0; i < n; i++) {
+    double u, v;
+    ToWindow(ptsx[i], ptsy[i], &u, &v);
+    // y(x) only exists if the waypoints move forward along the chord.
+    if (u <= last_u) {
+      valid = false;
+    }
+    last_u = u;
+    double s = u / scale;
+    Vector4 row(1, s, s * s, s * s * s);
+    AtA += row * row.transpose();
+    Aty += v * row;
+  }
+  ToWindow(ptsx[0], ptsy[0], &x_min, &last_u);
+  ToWindow(ptsx[n - 1], ptsy[n - 1], &x_max, &last_u);
+  llt.compute(AtA);
+  valid = valid && llt.info() == Eigen::Success;
+}
+
+bool WaypointFit::FrameFits(const vector<double> &ptsx, const vector<double> &ptsy) const {
+  size_t n = ptsx.size();
+  double turn = atan2(ptsy[n - 1] - ptsy[0], ptsx[n - 1] - ptsx[0]) - heading;
+  turn = atan2(sin(turn), cos(turn));
+  double u, v;
+  ToWindow(ptsx[0], ptsy[0], &u, &v);
+  return fabs(turn) <= kMaxFrameTurn && fabs(u) <= kMaxFrameShift * scale && fabs(v) <= kMaxFrameShift * scale;
+}
+
+bool WaypointFit::Update(const vector<double> &ptsx, const vector<double> &ptsy) {
+  size_t n = ptsx.size();
+  if (n < 4 || ptsy.size() != n) {
+    valid = false;
+    return false;
+  }
+  if (valid && ptsx == wx && ptsy == wy) {
+    return true;
+  }
+
+  // Look for the new window being the old one moved forward by `k` waypoints (overlapping at least half of it).
+  size_t old_n = wx.size();
+  size_t k = 1;
+  bool slid = false;
+  while (valid && !slid && k <= old_n / 2 && old_n - k <= n) {
+    slid = equal(wx.begin() + k, wx.end(), ptsx.begin()) && equal(wy.begin() + k, wy.end(), ptsy.begin());
+    if (!slid) {
+      k++;
+    }
+  }
+
+  size_t rank_updates_before = rank_updates;
+  bool ok = slid && updates_since_rebuild < kMaxUpdatesBetweenRebuilds && FrameFits(ptsx, ptsy);
+  for (size_t i = 0; ok && i < k; i++) {
+    ok = Apply(wx[i], wy[i], -1);
+  }
+  for (size_t i = old_n - k; ok && i < n; i++) {
+    double u, v;
+    ToWindow(ptsx[i], ptsy[i], &u, &v);
+    ok = u > x_max && Apply(ptsx[i], ptsy[i], 1);
+    x_max = u;
+  }
+  if (ok) {
+    double v;
+    ToWindow(ptsx[0], ptsy[0], &x_min, &v);
+    wx = ptsx;
+    wy = ptsy;
+  } else {
+    Rebuild(ptsx, ptsy);
+  }
+  // Published once per message, not from Apply: the metrics take a lock and build their key every time.
+  Metrics &m = GlobalMetrics();
+  if (rank_updates > rank_updates_before) {
+    m.Add("mpc_fit_rank_updates_total", rank_updates - rank_updates_before);
+  }
+  if (!ok) {
+    m.Add("mpc_fit_refactorizations_total");
+  }
+  if (valid) {
+    coeffs = llt.solve(Aty);
+  }
+  return valid;
+}
+
+shared_ptr<const WindowGeometry> WaypointFit::Geometry() const {
+  double c[4] = {coeffs[0], coeffs[1], coeffs[2], coeffs[3]};
+  return make_shared<WindowGeometry>(ox, oy, heading, scale, c, x_min, x_max, samples);
+}
@@ -0,0 +1,72 @@
+#ifndef WAYPOINT_FIT_H
+#define WAYPOINT_FIT_H
+
+#include <stddef.h>
+#include <vector>
+#include "Eigen-3.3/Eigen/Cholesky"
+#include "Eigen-3.3/Eigen/Core"
+#include "WaypointWindow.h"
+
+using namespace std;
+
+// Least-squares cubic through the waypoints, kept up to date incrementally.
+//
+// Consecutive telemetry messages mostly carry the same map-frame waypoints; only the car moves, and now and then the
+// window slides by a point. So instead of transforming the waypoints into the car frame and fitting them from scratch
+// every message, the cubic is fitted in a frame attached to the window (origin at its first waypoint, x along the
+// chord to the last one). The Cholesky factor of the normal equations is kept between messages and gets a rank-1
+// update for every waypoint entering the window and a rank-1 downdate for every one leaving it, as long as the frame
+// stays close to the one of the new window (FrameFits); the fit then matches a fresh one on the same waypoints, which
+// matters since it goes into the window cache shared by all sessions (mpc_fit_bench checks it). The car-frame cubic
+// is then refitted from a fixed number of samples of the window cubic (WindowGeometry), whatever the number of
+// look-ahead points.
+class WaypointFit {
+ public:
+  // `samples` is the number of points the window cubic is sampled at (see WindowGeometry).
+  explicit WaypointFit(int samples = 16);
+
+  // Feeds the map-frame waypoints of a message. Returns false if they can't be fitted as y(x) in the window frame
+  // (e.g. the road turns back on itself), in which case the caller has to fit in the car frame itself.
+  bool Update(const vector<double> &ptsx, const vector<double> &ptsy);
+
+  // Samples the fit of the last successful Update.
+  shared_ptr<const WindowGeometry> Geometry() const;
+
+  // Number of full factorizations and of rank-1 updates/downdates so far.
+  size_t refactorizations;
+  size_t rank_updates;
+
+  // Bytes of the heap buffers (the window).
+  size_t HeapBytes() const { return (wx.capacity() + wy.capacity()) * sizeof(double); }
+
+  // Holds fixed-size Eigen members.
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+ private:
+  typedef Eigen::Matrix<double, 4, 1> Vector4;
+  typedef Eigen::Matrix<double, 4, 4> Matrix4;
+
+  int samples;
+  bool valid;
+
+  // The window frame. x is divided by `scale` (about half the window length) to keep the normal equations well
+  // conditioned.
+  double ox, oy, heading, scale;
+  double x_min, x_max;
+
+  vector<double> wx, wy;  // current window, map frame
+  Matrix4 AtA;
+  Vector4 Aty;
+  Eigen::LLT<Matrix4> llt;
+  Vector4 coeffs;  // window frame, scaled x
+  size_t updates_since_rebuild;
+
+  void Rebuild(const vector<double> &ptsx, const vector<double> &ptsy);
+  // Whether the frame is still close to the one Rebuild would set for these waypoints.
+  bool FrameFits(const vector<double> &ptsx, const vector<double> &ptsy) const;
+  // Adds (sign = 1) or removes (sign = -1) a map-frame waypoint. Returns false if it doesn't fit in the frame.
+  bool Apply(double x, double y, double sign);
+  void ToWindow(double x, double y, double *u, double *v) const;
+};
+
+#endif /* WAYPOINT_FIT_H */
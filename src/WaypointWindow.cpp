@@ -0,0 +1,155 @@
+#include "WaypointWindow.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Eigen-3.3/Eigen/Cholesky"
+#include "Metrics.h"
+
+WindowGeometry::WindowGeometry(double ox, double oy, double heading, double scale, const double coeffs[4],
+                               double u_min, double u_max, int samples)
+    : ox(ox), oy(oy), heading(heading), scale(scale) {
+  memcpy(this->coeffs, coeffs, sizeof(this->coeffs));
+  for (int k = 0; k < samples; k++) {
+    double u = u_min + (u_max - u_min) * k / (samples - 1);
+    double t = u / scale;
+    double v = coeffs[0] + coeffs[1] * t + coeffs[2] * t * t + coeffs[3] * t * t * t;
+    // Window frame -> map frame.
+    x.push_back(ox + u * cos(heading) - v * sin(heading));
+    y.push_back(oy + u * sin(heading) + v * cos(heading));
+    s.push_back(k == 0 ? 0 : s.back() + hypot(x[k] - x[k - 1], y[k] - y[k - 1]));
+    double dv = (coeffs[1] + 2 * coeffs[2] * t + 3 * coeffs[3] * t * t) / scale;
+    double ddv = (2 * coeffs[2] + 6 * coeffs[3] * t) / (scale * scale);
+    curvature.push_back(ddv / pow(1 + dv * dv, 1.5));
+  }
+  int fitted = samples;
+  if (fitted > kCarFrameSamples) {
+    fitted = kCarFrameSamples;
+  }
+  for (int k = 0; k < fitted; k++) {
+    car_frame_samples.push_back((k * (samples - 1) + (fitted - 1) / 2) / (fitted - 1));
+  }
+}
+
+Eigen::VectorXd WindowGeometry::CarFrame(double px, double py, double psi) const {
+  // Sums of t^j and of y t^j over the samples in the car frame, with t = x / scale to keep the normal equations well
+  // conditioned.
+  double cos_psi = cos(psi), sin_psi = sin(psi);
+  double moments[7] = {0, 0, 0, 0, 0, 0, 0};
+  Eigen::Matrix4d AtA;
+  Eigen::Vector4d Aty = Eigen::Vector4d::Zero();
+  for (int k : car_frame_samples) {
+    double dx = x[k] - px;
+    double dy = y[k] - py;
+    double t = (dx * cos_psi + dy * sin_psi) / scale;
+    double v = -dx * sin_psi + dy * cos_psi;
+    double power = 1;
+    for (int j = 0; j < 7; j++) {
+      moments[j] += power;
+      if (j < 4) {
+        Aty[j] += v * power;
+      }
+      power *= t;
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      AtA(i, j) = moments[i + j];
+    }
+  }
+  Eigen::Vector4d a = AtA.llt().solve(Aty);
+  Eigen::VectorXd coeffs(4);
+  for (int j = 0; j < 4; j++) {
+    coeffs[j] = a[j] / pow(scale, j);
+  }
+  return coeffs;
+}
+
+void WindowGeometry::Frenet(double px, double py, double *station, double *offset) const {
+  double best = -1;
+  for (size_t k = 0; k + 1 < x.size(); k++) {
+    double dx = x[k + 1] - x[k], dy = y[k + 1] - y[k];
+    double length_sq = dx * dx + dy * dy;
+    double t = (length_sq > 0) ? ((px - x[k]) * dx + (py - y[k]) * dy) / length_sq : 0;
+    t = (t < 0) ? 0 : (t > 1) ? 1 : t;
+    double ex = px - x[k] - t * dx, ey = py - y[k] - t * dy;
+    double d = ex * ex + ey * ey;
+    if (best < 0 || d < best) {
+      best = d;
+      *station = s[k] + t * (s[k + 1] - s[k]);
+      // Left of the direction of travel is positive.
+      *offset = (dx * ey - dy * ex >= 0 ? 1 : -1) * sqrt(d);
+    }
+  }
+}
+
+double WindowGeometry::Curvature(double station) const {
+  if (station <= s.front()) {
+    return curvature.front();
+  }
+  for (size_t k = 0; k + 1 < s.size(); k++) {
+    if (station < s[k + 1]) {
+      double t = (station - s[k]) / (s[k + 1] - s[k]);
+      return curvature[k] + t * (curvature[k + 1] - curvature[k]);
+    }
+  }
+  return curvature.back();
+}
+
+WindowCache::WindowCache(size_t capacity) : capacity(capacity), hits(0), misses(0) {}
+
+uint64_t WindowCache::Hash(const vector<double> &ptsx, const vector<double> &ptsy) {
+  uint64_t hash = 14695981039346656037ULL;
+  const vector<double> *coordinates[2] = {&ptsx, &ptsy};
+  for (const vector<double> *values : coordinates) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(values->data());
+    for (size_t i = 0; i < values->size() * sizeof(double); i++) {
+      hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    // Separates the x from the y coordinates.
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+shared_ptr<const WindowGeometry> WindowCache::Find(const vector<double> &ptsx, const vector<double> &ptsy) {
+  uint64_t hash = Hash(ptsx, ptsy);
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(hash);
+  if (it == index.end() || it->second->ptsx != ptsx || it->second->ptsy != ptsy) {
+    misses++;
+    GlobalMetrics().Add("mpc_window_cache_misses_total");
+    GlobalMetrics().Set("mpc_window_cache_hit_ratio", hits / (hits + misses));
+    return nullptr;
+  }
+  hits++;
+  GlobalMetrics().Add("mpc_window_cache_hits_total");
+  GlobalMetrics().Set("mpc_window_cache_hit_ratio", hits / (hits + misses));
+  entries.splice(entries.begin(), entries, it->second);
+  return it->second->geometry;
+}
+
+void WindowCache::Insert(const vector<double> &ptsx, const vector<double> &ptsy,
+                         shared_ptr<const WindowGeometry> geometry) {
+  uint64_t hash = Hash(ptsx, ptsy);
+  lock_guard<mutex> guard(lock);
+  auto it = index.find(hash);
+  if (it != index.end()) {
+    // Same window inserted by another session meanwhile, or a hash collision: the newer one wins.
+    entries.erase(it->second);
+    index.erase(it);
+  }
+  Entry entry = {hash, ptsx, ptsy, geometry};
+  entries.push_front(entry);
+  index[hash] = entries.begin();
+  while (entries.size() > capacity) {
+    index.erase(entries.back().hash);
+    entries.pop_back();
+  }
+  GlobalMetrics().Set("mpc_window_cache_entries", entries.size());
+}
+
+WindowCache &GlobalWindowCache() {
+  const char *capacity = getenv("MPC_WINDOW_CACHE");
+  static WindowCache cache((capacity && atoi(capacity) > 0) ? atoi(capacity) : 256);
+  return cache;
+}
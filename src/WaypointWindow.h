@@ -0,0 +1,79 @@
+#ifndef WAYPOINT_WINDOW_H
+#define WAYPOINT_WINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "Eigen-3.3/Eigen/Core"
+
+using namespace std;
+
+// Everything about a window of waypoints that doesn't depend on the car's pose: the cubic fitted in the frame of the
+// window (see WaypointFit.h) and tables sampled from it, evenly spaced along the window.
+struct WindowGeometry {
+  // Window frame: origin, direction of its x axis, and the scale x is divided by in the cubic.
+  double ox, oy, heading, scale;
+  // v(u) = c0 + c1 (u / scale) + c2 (u / scale)^2 + c3 (u / scale)^3 in the window frame.
+  double coeffs[4];
+
+  // Samples of the cubic: map-frame position, arc length from the first sample (m) and curvature (1/m, positive
+  // turning left).
+  vector<double> x, y, s, curvature;
+
+  // At most this many of the samples, spread evenly, are refitted by CarFrame.
+  static const int kCarFrameSamples = 8;
+  // Indices of those samples.
+  vector<int> car_frame_samples;
+
+  // Samples the cubic at `samples` points between u_min and u_max.
+  WindowGeometry(double ox, double oy, double heading, double scale, const double coeffs[4], double u_min,
+                 double u_max, int samples);
+
+  // Coefficients of the cubic in the frame of a car at (px, py) heading psi, refitted from car_frame_samples through
+  // the 4x4 normal equations, which costs a fixed few hundred flops whatever the number of waypoints.
+  Eigen::VectorXd CarFrame(double px, double py, double psi) const;
+
+  // Frenet coordinates of a map-frame point: arc length of the closest point of the sampled curve and signed
+  // distance to it (positive to the left of the curve).
+  void Frenet(double px, double py, double *station, double *offset) const;
+
+  // Curvature at an arc length, interpolated between the samples and held constant past the ends.
+  double Curvature(double station) const;
+};
+
+// Recently seen waypoint windows and their geometry. The simulator sends the same waypoints for many consecutive
+// messages and the same windows again every lap, and all sessions on a track share them. Windows are keyed by a hash
+// of the raw coordinates (and compared in full on a hit), least recently used ones are dropped.
+class WindowCache {
+ public:
+  explicit WindowCache(size_t capacity);
+
+  // nullptr on a miss.
+  shared_ptr<const WindowGeometry> Find(const vector<double> &ptsx, const vector<double> &ptsy);
+  void Insert(const vector<double> &ptsx, const vector<double> &ptsy, shared_ptr<const WindowGeometry> geometry);
+
+  // FNV-1a over the bytes of the coordinates.
+  static uint64_t Hash(const vector<double> &ptsx, const vector<double> &ptsy);
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    vector<double> ptsx, ptsy;
+    shared_ptr<const WindowGeometry> geometry;
+  };
+
+  mutex lock;
+  size_t capacity;
+  list<Entry> entries;  // most recently used first
+  unordered_map<uint64_t, list<Entry>::iterator> index;
+  double hits, misses;
+};
+
+// Shared by all sessions; MPC_WINDOW_CACHE windows (256 by default).
+WindowCache &GlobalWindowCache();
+
+#endif /* WAYPOINT_WINDOW_H */
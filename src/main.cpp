@@ -1,12 +1,32 @@
 #include <math.h>
 #include <uWS/uWS.h>
+#include <atomic>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
-#include <thread>
+#include <map>
+#include <memory>
+#include <set>
 #include <vector>
 #include "Eigen-3.3/Eigen/Core"
 #include "Eigen-3.3/Eigen/QR"
+#include "Archive.h"
+#include "ClosestPoint.h"
+#include "LiveStats.h"
+#include "LoopTimers.h"
 #include "MPC.h"
+#include "Metrics.h"
+#include "Polynomial.h"
+#include "Profiler.h"
+#include "Reference.h"
+#include "Scaling.h"
+#include "Session.h"
+#ifdef MPC_COROUTINES
+#include "SessionRuntime.h"
+#endif
+#include "SolverPool.h"
+#include "Stage.h"
+#include "TrackProfile.h"
 #include "json.hpp"
 
 // for convenience
@@ -17,6 +37,71 @@ constexpr double pi() { return M_PI; }
 double deg2rad(double x) { return x * pi() / 180; }
 double rad2deg(double x) { return x * 180 / pi(); }
 
+// How far ahead of the car the reference curvature reaches (m), more than a horizon at full speed.
+const double kReferenceDistance = 100;
+
+// Number (milliseconds, count) from the environment variable `name`, or `fallback` if it's unset.
+static uint64_t envNumber(const char *name, uint64_t fallback) {
+  const char *value = getenv(name);
+  return value != nullptr ? strtoull(value, nullptr, 10) : fallback;
+}
+
+// Emulated actuation latency: the reply to a telemetry message goes out this long after it was computed.
+static const uint64_t actuation_latency_ms = envNumber("MPC_LATENCY_MS", 100);
+// Sessions that send nothing for this long are disconnected; 0 never does.
+static const uint64_t idle_timeout_ms = envNumber("MPC_IDLE_TIMEOUT_MS", 0);
+// Vehicles a connection may drive in its batches; the ids beyond get an error until vehicles are dropped.
+static const uint64_t batch_max_vehicles = envNumber("MPC_BATCH_MAX_VEHICLES", 64);
+// Vehicles missing from a connection's batches for this long are dropped; 0 never does.
+static const uint64_t batch_idle_ms = envNumber("MPC_BATCH_IDLE_MS", 10000);
+
+// (Re)starts the idle timeout of a session, which closes its socket.
+static void armIdleTimeout(LoopTimers &timers, Session *session, uWS::WebSocket<uWS::SERVER> ws) {
+  if (idle_timeout_ms == 0) {
+    return;
+  }
+  timers.Cancel(session->idle_timer);
+  session->idle_timer = timers.Schedule(idle_timeout_ms, [ws]() mutable {
+    GlobalMetrics().Add("mpc_idle_timeouts_total");
+    ws.close();
+  });
+}
+
+// Subscribers of the live metrics ("/live"), with every how many cycles each wants one sampled (0 for none).
+struct LiveFeed {
+  std::map<uWS::WebSocket<uWS::SERVER>, unsigned> subscribers;
+  std::map<unsigned, Session *> *sessions;
+
+  // Samples as often as the most demanding subscriber asks for.
+  void Resample() {
+    unsigned every = 0;
+    for (auto &subscriber : subscribers) {
+      if (subscriber.second > 0 && (every == 0 || subscriber.second < every)) {
+        every = subscriber.second;
+      }
+    }
+    SetLiveSampling(every);
+    GlobalMetrics().Set("mpc_live_subscribers", subscribers.size());
+  }
+};
+
+// Pushes the last second's figures to the live subscribers, every second.
+static void pushLive(uS::Timer *second) {
+  LiveFeed *feed = static_cast<LiveFeed *>(second->getData());
+  if (feed->subscribers.empty()) {
+    return;
+  }
+  LiveReport report = CollectLive();
+  report.sessions = feed->sessions->size();
+  const string summary = report.Json(false);
+  const string sampled = LiveSampling() > 0 ? report.Json(true) : summary;
+  for (auto &subscriber : feed->subscribers) {
+    const string &msg = subscriber.second > 0 ? sampled : summary;
+    uWS::WebSocket<uWS::SERVER> ws = subscriber.first;
+    ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+  }
+}
+
 // Checks if the SocketIO event has JSON data.
 // If there is data the JSON object in string format will be returned,
 // else the empty string "" will be returned.
@@ -32,201 +117,598 @@ string hasData(string s) {
   return "";
 }
 
-// Evaluate a polynomial.
-double polyeval(Eigen::VectorXd coeffs, double x) {
-  double result = 0.0;
-  for (int i = 0; i < coeffs.size(); i++) {
-    result += coeffs[i] * pow(x, i);
+// Parses "/session/<id>/state" and returns the id, or 0 if the url doesn't have that form.
+unsigned sessionFromUrl(const string &url) {
+  const string prefix = "/session/";
+  const string suffix = "/state";
+  if (url.size() <= prefix.size() + suffix.size() || url.compare(0, prefix.size(), prefix) != 0 ||
+      url.compare(url.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return 0;
   }
-  return result;
+  string id = url.substr(prefix.size(), url.size() - prefix.size() - suffix.size());
+  if (id.find_first_not_of("0123456789") != string::npos) {
+    return 0;
+  }
+  return strtoul(id.c_str(), nullptr, 10);
 }
 
-// Fit a polynomial.
-// Adapted from
-// https://github.com/JuliaMath/Polynomials.jl/blob/master/src/Polynomials.jl#L676-L716
-Eigen::VectorXd polyfit(Eigen::VectorXd xvals, Eigen::VectorXd yvals,
-                        int order) {
-  assert(xvals.size() == yvals.size());
-  assert(order >= 1 && order <= xvals.size() - 1);
-  Eigen::MatrixXd A(xvals.size(), order + 1);
+// Ids of sessions and of the vehicles of batches, never reused.
+static unsigned nextSessionId() {
+  static atomic<unsigned> next(1);
+  return next++;
+}
 
-  for (int i = 0; i < xvals.size(); i++) {
-    A(i, 0) = 1.0;
+// Whether `telemetry` has every field steer reads, as numbers, and enough waypoints for the cubic fit. Reading a
+// missing or mistyped field would throw, so telemetry is checked before it gets to steer.
+static bool validTelemetry(const json &telemetry) {
+  if (!telemetry.is_object()) {
+    return false;
+  }
+  const char *fields[6] = {"x", "y", "psi", "speed", "steering_angle", "throttle"};
+  for (const char *field : fields) {
+    auto value = telemetry.find(field);
+    if (value == telemetry.end() || !value->is_number()) {
+      return false;
+    }
+  }
+  auto ptsx = telemetry.find("ptsx");
+  auto ptsy = telemetry.find("ptsy");
+  if (ptsx == telemetry.end() || ptsy == telemetry.end() || !ptsx->is_array() || !ptsy->is_array() ||
+      ptsx->size() != ptsy->size() || ptsx->size() < 4) {
+    return false;
   }
+  for (size_t i = 0; i < ptsx->size(); i++) {
+    if (!(*ptsx)[i].is_number() || !(*ptsy)[i].is_number()) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  for (int j = 0; j < xvals.size(); j++) {
-    for (int i = 0; i < order; i++) {
-      A(j, i + 1) = A(j, i) * xvals(j);
+// Runs a control cycle of `session` for the telemetry of one vehicle and returns the steer data for the simulator.
+// The telemetry has to be valid (validTelemetry). parse_stage ends once the telemetry is read. Only touches the
+// session and the process-wide state, which is locked, so sessions may run their cycles on different threads (see
+// SessionRuntime.h and steerBatch).
+static json steer(Session *session, json &telemetry, StageScope &parse_stage) {
+  MPC &mpc = session->mpc;
+  SetProfiledSession(session->id);
+  vector<double> ptsx = telemetry["ptsx"];
+  vector<double> ptsy = telemetry["ptsy"];
+  double px = telemetry["x"];
+  double py = telemetry["y"];
+  double psi = telemetry["psi"];
+  double v = telemetry["speed"];
+  double steer_value = telemetry["steering_angle"];
+  double throttle_value = telemetry["throttle"];
+  double Lf = 2.67;
+
+
+  // Predicting state parameters for a latency of 100 ms
+  double latency = mpc.latency;
+  px = px + v * cos(psi) * latency;
+  py = py + v * sin(psi) * latency;
+  psi = psi - v * steer_value / Lf * latency;
+  v = v + throttle_value * latency;
+
+  parse_stage.End();
+  StageScope fit_stage(kStageFit);
+
+  // Usually the waypoints are the ones of an earlier message (or of another session on the same track), so
+  // their pose-independent geometry comes from the window cache. Otherwise the fit is updated incrementally in
+  // the frame of the waypoint window (see WaypointFit.h). Either way only the refit into the car's coord
+  // system is left.
+  Eigen::VectorXd coeffs;
+  shared_ptr<const WindowGeometry> window = GlobalWindowCache().Find(ptsx, ptsy);
+  if (!window && session->fit.Update(ptsx, ptsy)) {
+    window = session->fit.Geometry();
+    GlobalWindowCache().Insert(ptsx, ptsy, window);
+  }
+  if (window) {
+    coeffs = window->CarFrame(px, py, psi);
+  } else {
+    // Coordinate system transformation for the waypoints: rotation from the map coord system to the car's system
+    for (size_t i = 0; i < ptsx.size(); i++) {
+      double delta_x = ptsx[i] - px;
+      double delta_y = ptsy[i] - py;
+      ptsx[i] = delta_x * cos(0 - psi) - delta_y * sin(0 - psi);
+      ptsy[i] = delta_x * sin(0 - psi) + delta_y * cos(0 - psi);
     }
+
+    // Now I want to fit a polynomial (3rd order is enough) to the waypoints in the car's coord system.
+    // But polyfit function requires a VectorXd input, so the vectors <double> are transformed to VectorX first.
+    double* ptrx = &ptsx[0];
+    double* ptry = &ptsy[0];
+    Eigen::Map<Eigen::VectorXd> ptsx_transform(ptrx, ptsx.size());
+    Eigen::Map<Eigen::VectorXd> ptsy_transform(ptry, ptsy.size());
+
+    // And now do the fit:
+    // (remember this is the coord. system of the car, i.e. x points ahead, y points to the left)
+    coeffs = polyfit(ptsx_transform, ptsy_transform, 3);
   }
 
-  auto Q = A.householderQr();
-  auto result = Q.solve(yvals);
-  return result;
-}
+  // Now we compute the variables we want to be zero so the car's stay at the track.
+  // i) cte: Now that the car is in the origin of the coord. system, the distance from the origin to the fit
+  // (> 0 to the left, < 0 to the right). Evaluating the fit at x=0, i.e. along the y-axis only, is a good
+  // approximation on straights but not in bends (see ClosestPoint.h).
+  double cte = ExactCrossTrack() ? CrossTrackError(coeffs, 0.0, 0.0) : polyeval(coeffs, 0);
+  // ii) epsi: Accordingly psi is now zero at the car's coord system, so the approximation for the psi error is:
+  double epsi = -atan(coeffs[1]);
 
-int main() {
-  uWS::Hub h;
+  // px, py, psi are all zero since our coordinate transform
+  Eigen::VectorXd state(6);
+  state << 0, 0, 0, v, cte, epsi;
 
-  // MPC is initialized here!
-  MPC mpc;
+  // The curvature of the road ahead, for the feed-forward steering, and the speed to drive it at: from the
+  // whole track when we are on it, which sees past the end of the waypoints, else from the waypoint window.
+  Reference reference =
+      ReferenceAhead(GlobalTrack(), GlobalSpeedProfile(), px, py, coeffs, window.get(), kReferenceDistance);
 
-  h.onMessage([&mpc](uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length,
-                     uWS::OpCode opCode) {
-    // "42" at the start of the message means there's a websocket message event.
-    // The 4 signifies a websocket message
-    // The 2 signifies a websocket event
-    string sdata = string(data).substr(0, length);
-    cout << sdata << endl;
-    if (sdata.size() > 2 && sdata[0] == '4' && sdata[1] == '2') {
-      string s = hasData(sdata);
-      if (s != "") {
-        auto j = json::parse(s);
-        string event = j[0].get<string>();
-        if (event == "telemetry") {
-          // j[1] is the data JSON object
-          vector<double> ptsx = j[1]["ptsx"];
-          vector<double> ptsy = j[1]["ptsy"];
-          double px = j[1]["x"];
-          double py = j[1]["y"];
-          double psi = j[1]["psi"];
-          double v = j[1]["speed"];
-          double steer_value = j[1]["steering_angle"];
-          double throttle_value = j[1]["throttle"];
-          double Lf = 2.67;
-
-
-          // Predicting state parameters for a latency of 100 ms
-          double latency = 0.1;
-          px = px + v * cos(psi) * latency;
-          py = py + v * sin(psi) * latency;
-          psi = psi - v * steer_value / Lf * latency;
-          v = v + throttle_value * latency;
-
-          // Coordinate system transformation for the waypoints: rotation from the map coord system to the car's system
-          for (size_t i = 0; i < ptsx.size(); i++) {
-            double delta_x = ptsx[i] - px;
-            double delta_y = ptsy[i] - py;
-            ptsx[i] = delta_x * cos(0 - psi) - delta_y * sin(0 - psi);
-            ptsy[i] = delta_x * sin(0 - psi) + delta_y * cos(0 - psi);
-          }
 
+  // We pass our state and coefficients of the fit to the MP controller.
+  // The MPC selects the trajectory with minimum cost -given the constraints of the model- and deliver us a
+  // vector with the corresponding control inputs. The idea is we will apply the first control input
+  // (steering angle & throttle) and then repeat the loop.
+  fit_stage.End();
+  auto vars = mpc.Solve(state, coeffs, reference);
+  mpc.governor.Export(session->id);
+  GlobalTrackProfile().Record(telemetry["x"], telemetry["y"], LastStageSeconds(kStageSolve),
+                              mpc.last_solve.iterations, !mpc.last_solve.ok, mpc.last_solve.tier > 0);
 
-          // Now I want to fit a polynomial (3rd order is enough) to the waypoints in the car's coord system.
-          // But polyfit function requires a VectorXd input, so the vectors <double> are transformed to VectorX first.
-          double* ptrx = &ptsx[0];
-          double* ptry = &ptsy[0];
-          Eigen::Map<Eigen::VectorXd> ptsx_transform(ptrx, 6);
-          Eigen::Map<Eigen::VectorXd> ptsy_transform(ptry, 6);
 
-          // And now do the fit:
-          // (remember this is the coord. system of the car, i.e. x points ahead, y points to the left)
-          auto coeffs = polyfit(ptsx_transform, ptsy_transform, 3);
+  StageScope respond_stage(kStageRespond);
 
-          // Now we compute the variables we want to be zero so the car's stay at the track.
-          // i) cte: Now that the car is in the origin of the coord. system, we just evaluate the fit at x=0.
-          // i.e. the cte is along the y-axis only (> 0 to the left, < 0 to the right) which is a good approximation.
-          double cte = polyeval(coeffs, 0);
-          // ii) epsi: Accordingly psi is now zero at the car's coord system, so the approximation for the psi error is:
-          double epsi = -atan(coeffs[1]);
+  // This is optional, but I'll want to plot the reference path back in the simulator (yellow line)
+  // These (x,y) values are in car's reference system.
+  vector<double> next_x_vals;
+  vector<double> next_y_vals;
 
-          // px, py, psi are all zero since our coordinate transform
-          Eigen::VectorXd state(6);
-          state << 0, 0, 0, v, cte, epsi;
+  double poly_inc = 2.5;
+  int num_points = 25;
 
+  for (int i = 1; i < num_points; i++) {
+    next_x_vals.push_back(poly_inc * i);
+    next_y_vals.push_back(polyeval(coeffs, poly_inc * i));
+  }
 
-          // We pass our state and coefficients of the fit to the MP controller.
-          // The MPC selects the trajectory with minimum cost -given the constraints of the model- and deliver us a
-          // vector with the corresponding control inputs. The idea is we will apply the first control input
-          // (steering angle & throttle) and then repeat the loop.
-          auto vars = mpc.Solve(state, coeffs);
+  // This is optional, but I'll want to plot the MPC trajectory back in the simulator (green line)
+  // These (x,y) values are in car's reference system.
+  vector<double> mpc_x_vals;
+  vector<double> mpc_y_vals;
 
+  for (size_t i = 2; i < vars.size(); i++) {
+    if (i%2 == 0) {
+      mpc_x_vals.push_back(vars[i]);
+    } else {
+      mpc_y_vals.push_back(vars[i]);
+    }
+  }
 
-          // This is optional, but I'll want to plot the reference path back in the simulator (yellow line)
-          // These (x,y) values are in car's reference system.
-          vector<double> next_x_vals;
-          vector<double> next_y_vals;
+  // Back to the server! (send back to the simulator, I mean)
+  json msgJson;
+  // NOTE: Remember to divide by deg2rad(25) before you send the steering value back.
+  // Otherwise the values will be in between [-deg2rad(25), deg2rad(25] instead of [-1, 1].
+  // Control inputs:
+  msgJson["steering_angle"] = vars[0] / (deg2rad(25) * Lf);
+  msgJson["throttle"] = vars[1];
+  mpc.steer = vars[0] / (deg2rad(25) * Lf);
+  mpc.throttle = vars[1];
+
+  // Display the MPC predicted trajectory (optional)
+  msgJson["mpc_x"] = mpc_x_vals;
+  msgJson["mpc_y"] = mpc_y_vals;
+
+  // Display the waypoints/reference line (optional)
+  msgJson["next_x"] = next_x_vals;
+  msgJson["next_y"] = next_y_vals;
+
+  respond_stage.End();
+
+  // Keep the cycle for later analysis (see mpc_query).
+  ArchiveWriter *archive = GlobalArchive();
+  if (archive != nullptr) {
+    CycleRecord record;
+    record.time_ns = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    record.session = session->id;
+    record.ok = mpc.last_solve.ok;
+    record.iterations = mpc.last_solve.iterations;
+    record.horizon = mpc.last_solve.horizon;
+    record.cost = mpc.last_solve.cost;
+    const char *fields[6] = {"x", "y", "psi", "speed", "steering_angle", "throttle"};
+    for (int i = 0; i < 6; i++) {
+      record.telemetry[i] = telemetry[fields[i]];
+      record.state[i] = state[i];
+    }
+    for (int i = 0; i < 4; i++) {
+      record.coeffs[i] = coeffs[i];
+    }
+    record.steer = mpc.steer;
+    record.throttle = mpc.throttle;
+    for (size_t i = 0; i < mpc_x_vals.size() && i < kArchivePlanPoints; i++) {
+      record.plan_x[i] = mpc_x_vals[i];
+      record.plan_y[i] = mpc_y_vals[i];
+    }
+    for (int s = 0; s < kNumStages; s++) {
+      record.stage_seconds[s] = LastStageSeconds(static_cast<Stage>(s));
+    }
+    archive->Append(record);
+  }
+  if (LiveSampling() > 0) {
+    LiveCycle cycle;
+    cycle.time_ns = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    cycle.session = session->id;
+    cycle.ok = mpc.last_solve.ok;
+    cycle.iterations = mpc.last_solve.iterations;
+    cycle.horizon = mpc.last_solve.horizon;
+    for (int s = 0; s < kNumStages; s++) {
+      cycle.stage_seconds[s] = LastStageSeconds(static_cast<Stage>(s));
+    }
+    RecordLiveCycle(cycle);
+  }
+  SetProfiledSession(0);
+  return msgJson;
+}
 
-          double poly_inc = 2.5;
-          int num_points = 25;
+// Reply entry for a vehicle of a batch that isn't steered.
+static json batchError(const json &vehicle, const string &error) {
+  json reply;
+  if (vehicle.is_object() && vehicle.count("id") > 0) {
+    reply["id"] = vehicle["id"];
+  }
+  reply["error"] = error;
+  return reply;
+}
 
-          for (int i = 1; i < num_points; i++) {
-            next_x_vals.push_back(poly_inc * i);
-            next_y_vals.push_back(polyeval(coeffs, poly_inc * i));
-          }
+// Drops the vehicles of `session` that no batch has listed for batch_idle_ms, with their metrics (see ~Session).
+static void dropIdleVehicles(Session *session, uint64_t now) {
+  if (batch_idle_ms == 0) {
+    return;
+  }
+  size_t dropped = 0;
+  for (auto vehicle = session->vehicles.begin(); vehicle != session->vehicles.end();) {
+    if (now - vehicle->second.last_seen >= batch_idle_ms) {
+      vehicle = session->vehicles.erase(vehicle);
+      dropped++;
+    } else {
+      ++vehicle;
+    }
+  }
+  if (dropped > 0) {
+    GlobalMetrics().Add("mpc_batch_evictions_total", dropped);
+  }
+}
 
-          // This is optional, but I'll want to plot the MPC trajectory back in the simulator (green line)
-          // These (x,y) values are in car's reference system.
-          vector<double> mpc_x_vals;
-          vector<double> mpc_y_vals;
+// Steers all the vehicles of a "telemetry_batch" event, in parallel on the solver pool. Every vehicle id gets a
+// session of its own within `session`, created on its first frame unless there are batch_max_vehicles already, and
+// dropped once it stays out of the frames (dropIdleVehicles); a vehicle listed twice in a frame is steered once.
+// Entries without an id, with invalid telemetry or over the limit get an error reply instead, and so does a vehicle
+// whose cycle fails.
+static json steerBatch(Session *session, json &batch) {
+  json reply;
+  reply["vehicles"] = json::array();
+  if (!batch.is_object() || batch.count("vehicles") == 0 || !batch["vehicles"].is_array()) {
+    GlobalMetrics().Add("mpc_batch_rejected_total");
+    reply["error"] = "no vehicles";
+    return reply;
+  }
+  json &vehicles = batch["vehicles"];
+  uint64_t now =
+      chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+  dropIdleVehicles(session, now);
+  vector<json> errors;
+  vector<size_t> items;
+  vector<Session *> controllers;
+  set<Session *> seen;
+  for (size_t i = 0; i < vehicles.size(); i++) {
+    if (!validTelemetry(vehicles[i]) || vehicles[i].count("id") == 0 || vehicles[i]["id"].is_null()) {
+      errors.push_back(batchError(vehicles[i], "invalid telemetry"));
+      continue;
+    }
+    string id = vehicles[i]["id"].dump();
+    auto known = session->vehicles.find(id);
+    if (known == session->vehicles.end()) {
+      if (session->vehicles.size() >= batch_max_vehicles) {
+        errors.push_back(batchError(vehicles[i], "too many vehicles"));
+        continue;
+      }
+      known = session->vehicles.insert(make_pair(id, Session::Vehicle())).first;
+      known->second.session.reset(new Session(nextSessionId()));
+    }
+    known->second.last_seen = now;
+    Session *vehicle = known->second.session.get();
+    if (seen.insert(vehicle).second) {
+      items.push_back(i);
+      controllers.push_back(vehicle);
+    }
+  }
 
-          for (size_t i = 2; i < vars.size(); i++) {
-            if (i%2 == 0) {
-              mpc_x_vals.push_back(vars[i]);
-            } else {
-              mpc_y_vals.push_back(vars[i]);
-            }
-          }
+  vector<json> replies(items.size());
+  GlobalSolverPool().ForEach(items.size(), [&](size_t k) {
+    try {
+      StageScope parse_stage(kStageParse);
+      replies[k] = steer(controllers[k], vehicles[items[k]], parse_stage);
+      replies[k]["id"] = vehicles[items[k]]["id"];
+    } catch (const std::exception &e) {
+      SetProfiledSession(0);
+      replies[k] = batchError(vehicles[items[k]], e.what());
+    }
+  });
+  size_t failed = errors.size();
+  for (const json &entry : replies) {
+    failed += entry.count("error");
+  }
+  GlobalMetrics().Add("mpc_batch_frames_total");
+  GlobalMetrics().Add("mpc_batch_vehicles_total", items.size());
+  GlobalMetrics().Add("mpc_batch_duplicates_total", vehicles.size() - items.size() - errors.size());
+  GlobalMetrics().Add("mpc_batch_errors_total", failed);
 
-          // Back to the server! (send back to the simulator, I mean)
-          json msgJson;
-          // NOTE: Remember to divide by deg2rad(25) before you send the steering value back.
-          // Otherwise the values will be in between [-deg2rad(25), deg2rad(25] instead of [-1, 1].
-          // Control inputs:
-          msgJson["steering_angle"] = vars[0] / (deg2rad(25) * Lf);
-          msgJson["throttle"] = vars[1];
+  for (json &entry : replies) {
+    reply["vehicles"].push_back(move(entry));
+  }
+  for (json &entry : errors) {
+    reply["vehicles"].push_back(move(entry));
+  }
+  return reply;
+}
 
-          // Display the MPC predicted trajectory (optional)
-          msgJson["mpc_x"] = mpc_x_vals;
-          msgJson["mpc_y"] = mpc_y_vals;
+// Runs the control cycle for the data of a SocketIO event (see hasData) and returns the reply for the simulator:
+// "steer" to "telemetry", "steer_batch" to "telemetry_batch", "" to anything else, malformed events included
+// (counted by mpc_bad_messages_total).
+static string controlCycle(Session *session, const string &payload) {
+  StageScope parse_stage(kStageParse);
+  json j;
+  try {
+    j = json::parse(payload);
+  } catch (const std::exception &) {
+  }
+  if (!j.is_array() || j.size() < 2 || !j[0].is_string() ||
+      (j[0] == "telemetry" && !validTelemetry(j[1]))) {
+    GlobalMetrics().Add("mpc_bad_messages_total");
+    return "";
+  }
+  string event = j[0].get<string>();
+  string msg;
+  if (event == "telemetry") {
+    // j[1] is the data JSON object
+    msg = "42[\"steer\"," + steer(session, j[1], parse_stage).dump() + "]";
+  } else if (event == "telemetry_batch") {
+    parse_stage.End();
+    msg = "42[\"steer_batch\"," + steerBatch(session, j[1]).dump() + "]";
+  }
+  if (msg != "") {
+    std::cout << msg << std::endl;
+  }
+  return msg;
+}
 
-          // Display the waypoints/reference line (optional)
-          msgJson["next_x"] = next_x_vals;
-          msgJson["next_y"] = next_y_vals;
+#ifdef MPC_COROUTINES
+// The cycle of one session as a coroutine (see SessionRuntime.h): wait for a message, run the control cycle on the
+// solver pool, wait out the latency, reply. Ends when the connection closes and then frees the session, which is why
+// the disconnection handler leaves that to it.
+static Detached runSession(Session *session, uWS::WebSocket<uWS::SERVER> ws, LoopTimers &timers,
+                           LoopExecutor &loop) {
+  while (optional<string> sdata = co_await session->inbox.Next()) {
+    string s = hasData(*sdata);
+    if (s == "") {
+      // Manual driving
+      std::string msg = "42[\"manual\",{}]";
+      ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+      continue;
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    OnSolver solve(GlobalSolverPool(), loop, [session, s] { return controlCycle(session, s); });
+    session->in_cycle = true;
+    string msg = co_await solve;
+    session->in_cycle = false;
+    GlobalMetrics().Observe("mpc_session_cycle_seconds",
+                            chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    if (session->inbox.Closed()) {
+      break;
+    }
+    session->Account();
+    if (msg == "") {
+      continue;
+    }
+    // Latency, see onMessage.
+    co_await Sleep{timers, actuation_latency_ms};
+    if (session->inbox.Closed()) {
+      break;
+    }
+    ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+  }
+  delete session;
+}
+#endif
 
+int main() {
+  uWS::Hub h;
 
-          auto msg = "42[\"steer\"," + msgJson.dump() + "]";
-          std::cout << msg << std::endl;
+  // Every connection gets its own MPC, see Session.h.
+  std::map<unsigned, Session *> sessions;
+
+  // Delayed replies and idle timeouts of all the sessions (see LoopTimers.h).
+  LoopTimers timers(h.getLoop());
+  // The solver pool (batches, coroutine sessions) sets CppAD up for its threads, which has to happen before the
+  // first solve.
+  GlobalSolverPool();
+  // Live metrics subscribers, served every second whether or not any session is connected.
+  LiveFeed live;
+  live.sessions = &sessions;
+  uS::Timer *second = new uS::Timer(h.getLoop());
+  second->setData(&live);
+  second->start(pushLive, 1000, 1000);
+#ifdef MPC_COROUTINES
+  // Resumes the sessions whose solves are done.
+  LoopExecutor loop(h.getLoop());
+#endif
+
+  h.onMessage([&timers, &sessions, &live](uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length,
+                                          uWS::OpCode opCode) {
+    Session *session = static_cast<Session *>(ws.getUserData());
+    if (session == nullptr) {
+      // A live subscriber: {"samples": N} asks for every Nth cycle, 0 for none.
+      if (live.subscribers.count(ws)) {
+        try {
+          json command = json::parse(string(data, length));
+          if (command.is_object() && command["samples"].is_number_unsigned()) {
+            live.subscribers[ws] = command["samples"];
+            live.Resample();
+          }
+        } catch (const std::exception &) {
+          // Not JSON, nothing to do.
+        }
+      }
+      return;
+    }
+    armIdleTimeout(timers, session, ws);
+    // "42" at the start of the message means there's a websocket message event.
+    // The 4 signifies a websocket message
+    // The 2 signifies a websocket event
+    string sdata = string(data).substr(0, length);
+    cout << sdata << endl;
+    if (sdata.size() > 2 && sdata[0] == '4' && sdata[1] == '2') {
+#ifdef MPC_COROUTINES
+      // The session's coroutine takes it from here.
+      session->inbox.Push(sdata);
+#else
+      string s = hasData(sdata);
+      if (s != "") {
+        string msg = controlCycle(session, s);
+        session->Account();
+        if (msg != "") {
           // Latency
           // The purpose is to mimic real driving conditions where
           // the car does actuate the commands instantly.
           //
-          // Feel free to play around with this value but should be to drive
+          // Feel free to play around with this value (MPC_LATENCY_MS) but should be to drive
           // around the track with 100ms latency.
           //
-          // NOTE: REMEMBER TO SET THIS TO 100 MILLISECONDS BEFORE
-          // SUBMITTING.
-          this_thread::sleep_for(chrono::milliseconds(100));
-          ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+          // The reply waits on a timer rather than blocking the loop, so the other sessions keep being served.
+          // A session that disconnects in the meantime is no longer in `sessions` (ids are never reused).
+          unsigned id = session->id;
+          chrono::steady_clock::time_point due =
+              chrono::steady_clock::now() + chrono::milliseconds(actuation_latency_ms);
+          timers.Schedule(actuation_latency_ms, [ws, msg, id, due, &sessions]() mutable {
+            if (sessions.count(id) == 0) {
+              return;
+            }
+            GlobalMetrics().Observe("mpc_reply_lateness_seconds",
+                                    chrono::duration<double>(chrono::steady_clock::now() - due).count());
+            ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
+          });
         }
       } else {
         // Manual driving
         std::string msg = "42[\"manual\",{}]";
         ws.send(msg.data(), msg.length(), uWS::OpCode::TEXT);
       }
+#endif
     }
   });
 
-  // We don't need this since we're not using HTTP but if it's removed the
-  // program
-  // doesn't compile :-(
-  h.onHttpRequest([](uWS::HttpResponse *res, uWS::HttpRequest req, char *data,
-                     size_t, size_t) {
+  // Besides the hello page, HTTP is used to move sessions between controller processes:
+  // GET /session/<id>/state exports a snapshot of the session, POST /session/<id>/state imports one into it.
+  // GET /metrics returns the counters, gauges and histograms of Metrics.h.
+  // GET /scaling returns the scaling profile recorded so far (load it with MPC_SCALING_PROFILE).
+  // GET /track/profile.csv and GET /track/profile.svg return solver performance by position on the track.
+  // GET /profile/start[?hz=N] starts the sampling profiler, GET /profile/stop stops it and returns a gzipped pprof
+  // profile.
+  // WebSocket connections to /live (rather than /) subscribe to the live metrics of LiveStats.h instead of driving.
+  h.onHttpRequest([&sessions](uWS::HttpResponse *res, uWS::HttpRequest req, char *data,
+                              size_t length, size_t remainingBytes) {
     const std::string s = "<h1>Hello world!</h1>";
+    string url(req.getUrl().value, req.getUrl().valueLength);
+    unsigned id = sessionFromUrl(url);
     if (req.getUrl().valueLength == 1) {
       res->end(s.data(), s.length());
+    } else if (url == "/metrics") {
+      const std::string metrics = GlobalMetrics().Render();
+      res->end(metrics.data(), metrics.length());
+    } else if (url == "/scaling") {
+      const std::string profile = GlobalScalingProfile().Save();
+      res->end(profile.data(), profile.length());
+    } else if (url == "/track/profile.csv") {
+      const std::string table = GlobalTrackProfile().Csv();
+      res->end(table.data(), table.length());
+    } else if (url == "/track/profile.svg") {
+      const std::string picture = GlobalTrackProfile().Svg();
+      res->end(picture.data(), picture.length());
+    } else if (url == "/profile/start" || url.compare(0, 18, "/profile/start?hz=") == 0) {
+      int hz = url.size() > 18 ? atoi(url.c_str() + 18) : 49;
+      const std::string reply = StartProfiler(hz) ? "started" : "not started";
+      res->end(reply.data(), reply.length());
+    } else if (url == "/profile/stop") {
+      const std::string profile = StopProfiler();
+      res->end(profile.data(), profile.length());
+#ifdef MPC_COROUTINES
+    } else if (id != 0 && sessions.count(id) && sessions[id]->in_cycle) {
+      // Its cycle is running on the solver pool, the state is only consistent between cycles.
+      const std::string reply = "busy";
+      res->end(reply.data(), reply.length());
+#endif
+    } else if (id != 0 && sessions.count(id)) {
+      MPC &mpc = sessions[id]->mpc;
+      if (req.getMethod() == uWS::HttpMethod::METHOD_POST) {
+        // Snapshots are a few kB, we expect them in a single chunk.
+        SessionState state;
+        bool ok = remainingBytes == 0 && DeserializeSessionState(string(data, length), &state) &&
+                  mpc.ImportState(state);
+        const std::string reply = ok ? "imported" : "rejected";
+        res->end(reply.data(), reply.length());
+      } else {
+        const std::string snapshot = SerializeSessionState(mpc.ExportState());
+        res->end(snapshot.data(), snapshot.length());
+      }
     } else {
       // i guess this should be done more gracefully?
       res->end(nullptr, 0);
     }
   });
 
-  h.onConnection([&h](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
-    std::cout << "Connected!!!" << std::endl;
+#ifdef MPC_COROUTINES
+  h.onConnection([&h, &sessions, &timers, &live, &loop](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
+#else
+  h.onConnection([&h, &sessions, &timers, &live](uWS::WebSocket<uWS::SERVER> ws, uWS::HttpRequest req) {
+#endif
+    if (string(req.getUrl().value, req.getUrl().valueLength) == "/live") {
+      ws.setUserData(nullptr);
+      if (live.subscribers.empty()) {
+        // Nobody collected while there were no subscribers, the first frame starts from now.
+        CollectLive();
+      }
+      live.subscribers[ws] = 0;
+      live.Resample();
+      std::cout << "Live metrics subscriber connected" << std::endl;
+      return;
+    }
+    Session *session = new Session(nextSessionId());
+    sessions[session->id] = session;
+    ws.setUserData(session);
+    session->Account();
+    armIdleTimeout(timers, session, ws);
+#ifdef MPC_COROUTINES
+    runSession(session, ws, timers, loop);
+#endif
+    std::cout << "Connected!!! (session " << session->id << ")" << std::endl;
   });
 
-  h.onDisconnection([&h](uWS::WebSocket<uWS::SERVER> ws, int code,
-                         char *message, size_t length) {
+  h.onDisconnection([&h, &sessions, &timers, &live](uWS::WebSocket<uWS::SERVER> ws, int code,
+                                                     char *message, size_t length) {
+    if (live.subscribers.erase(ws)) {
+      live.Resample();
+    }
+    Session *session = static_cast<Session *>(ws.getUserData());
+    if (session != nullptr) {
+      timers.Cancel(session->idle_timer);
+      sessions.erase(session->id);
+#ifdef MPC_COROUTINES
+      session->inbox.Close();
+#else
+      delete session;
+#endif
+      ws.setUserData(nullptr);
+    }
     ws.close();
     std::cout << "Disconnected" << std::endl;
   });
@@ -0,0 +1,178 @@
+// Checks the incremental waypoint fit (see WaypointFit.h) against fresh fits on the same windows, and times the
+// car-frame refit of a cached window (WindowGeometry::CarFrame) against transforming the waypoints and fitting them.
+//
+//   mpc_fit_bench TRACK [WINDOW [LAPS]]
+//
+// A window of WINDOW waypoints (default 6, as the simulator sends) slides along the track for LAPS laps (default 3),
+// by one or two waypoints at a time, once over the waypoints of the file and once over the track resampled every
+// 5 m, where the window turns little per slide and mostly gets rank-1 updates. After every slide the cubic of the
+// sliding fit is compared with the one of a fresh WaypointFit on the same waypoints: the largest distance between
+// the two, measured across the fresh frame at the samples of the sliding one, has to stay under 5 cm. Exits with 1
+// otherwise.
+//
+// Then a car is put next to the start of every window of the file, and both ways of getting its car-frame cubic are
+// timed over the windows: CarFrame on the window's geometry, which is what a window cache hit costs, and the
+// transform-and-fit of steer (main.cpp) on the waypoints. The largest difference between the two cubics, at the car
+// and up to the last waypoint, is printed along.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "Polynomial.h"
+#include "Track.h"
+#include "WaypointFit.h"
+
+// Largest gap allowed between the sliding and the fresh fit (m).
+static const double kTolerance = 0.05;
+// Spacing of the resampled track (m).
+static const double kSpacing = 5;
+
+// Largest distance between the cubics of `a` and `b`, across the frame of b at the samples of a.
+static double gap(const WindowGeometry &a, const WindowGeometry &b) {
+  double worst = 0;
+  for (size_t k = 0; k < a.x.size(); k++) {
+    double dx = a.x[k] - b.ox;
+    double dy = a.y[k] - b.oy;
+    double u = dx * cos(b.heading) + dy * sin(b.heading);
+    double v = -dx * sin(b.heading) + dy * cos(b.heading);
+    double t = u / b.scale;
+    double fit = b.coeffs[0] + b.coeffs[1] * t + b.coeffs[2] * t * t + b.coeffs[3] * t * t * t;
+    worst = fabs(v - fit) > worst ? fabs(v - fit) : worst;
+  }
+  return worst;
+}
+
+// Slides the window over `n` points given by point(i, &x, &y) (i wraps around) and returns the largest gap.
+template <class Point>
+static double slide(const char *name, size_t n, size_t window, size_t laps, Point point) {
+  WaypointFit sliding;
+  double worst = 0;
+  size_t windows = 0, mismatches = 0;
+  for (size_t first = 0; first < laps * n; first += 1 + first % 3 / 2) {
+    vector<double> ptsx(window), ptsy(window);
+    for (size_t i = 0; i < window; i++) {
+      point((first + i) % n, &ptsx[i], &ptsy[i]);
+    }
+    WaypointFit fresh;
+    bool ok = sliding.Update(ptsx, ptsy);
+    if (ok != fresh.Update(ptsx, ptsy)) {
+      mismatches++;
+    } else if (ok) {
+      double g = gap(*sliding.Geometry(), *fresh.Geometry());
+      worst = g > worst ? g : worst;
+    }
+    windows++;
+  }
+  printf("%-10s %6zu windows  %6zu refactorizations  %6zu rank-1 updates  largest gap %.4f m  %zu mismatches\n", name,
+         windows, sliding.refactorizations, sliding.rank_updates, worst, mismatches);
+  return mismatches > 0 ? INFINITY : worst;
+}
+
+// The car-frame fit of steer without the window cache.
+static Eigen::VectorXd transformAndFit(const vector<double> &ptsx, const vector<double> &ptsy, double px, double py,
+                                       double psi) {
+  Eigen::VectorXd xs(ptsx.size()), ys(ptsy.size());
+  for (size_t i = 0; i < ptsx.size(); i++) {
+    double dx = ptsx[i] - px;
+    double dy = ptsy[i] - py;
+    xs[i] = dx * cos(0 - psi) - dy * sin(0 - psi);
+    ys[i] = dx * sin(0 - psi) + dy * cos(0 - psi);
+  }
+  return polyfit(xs, ys, 3);
+}
+
+static void timeCarFrame(const Track &track, size_t window) {
+  const int kRepeats = 20000;
+  struct Case {
+    vector<double> ptsx, ptsy;
+    shared_ptr<const WindowGeometry> geometry;
+    double px, py, psi;
+  };
+  vector<Case> cases;
+  for (size_t first = 0; first < track.Size(); first++) {
+    Case c;
+    for (size_t i = 0; i < window; i++) {
+      c.ptsx.push_back(track.X((first + i) % track.Size()));
+      c.ptsy.push_back(track.Y((first + i) % track.Size()));
+    }
+    WaypointFit fit;
+    if (!fit.Update(c.ptsx, c.ptsy)) {
+      continue;
+    }
+    c.geometry = fit.Geometry();
+    // Half a metre left of the first waypoint, a little off the chord.
+    double heading = atan2(c.ptsy[1] - c.ptsy[0], c.ptsx[1] - c.ptsx[0]);
+    c.px = c.ptsx[0] - 0.5 * sin(heading);
+    c.py = c.ptsy[0] + 0.5 * cos(heading);
+    c.psi = heading + 0.05;
+    cases.push_back(c);
+  }
+
+  double at_car = 0, ahead = 0;
+  for (const Case &c : cases) {
+    Eigen::VectorXd cached = c.geometry->CarFrame(c.px, c.py, c.psi);
+    Eigen::VectorXd fitted = transformAndFit(c.ptsx, c.ptsy, c.px, c.py, c.psi);
+    double end = (c.ptsx.back() - c.px) * cos(c.psi) + (c.ptsy.back() - c.py) * sin(c.psi);
+    at_car = fmax(at_car, fabs(polyeval(cached, 0) - polyeval(fitted, 0)));
+    for (int k = 0; k <= 20; k++) {
+      ahead = fmax(ahead, fabs(polyeval(cached, end * k / 20) - polyeval(fitted, end * k / 20)));
+    }
+  }
+
+  double checksum = 0;
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (int r = 0; r < kRepeats; r++) {
+    for (const Case &c : cases) {
+      checksum += c.geometry->CarFrame(c.px, c.py, c.psi)[0];
+    }
+  }
+  double car_frame = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  start = chrono::steady_clock::now();
+  for (int r = 0; r < kRepeats; r++) {
+    for (const Case &c : cases) {
+      checksum += transformAndFit(c.ptsx, c.ptsy, c.px, c.py, c.psi)[0];
+    }
+  }
+  double transform_and_fit = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  size_t calls = kRepeats * cases.size();
+  printf("CarFrame %.3f us/call, transform and fit %.3f us/call; cubics differ by %.3f m at the car, %.3f m ahead "
+         "(checksum %g)\n",
+         1e6 * car_frame / calls, 1e6 * transform_and_fit / calls, at_car, ahead, checksum);
+}
+
+static int usage() {
+  fprintf(stderr, "usage: mpc_fit_bench TRACK [WINDOW [LAPS]]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 4) {
+    return usage();
+  }
+  Track track;
+  if (!track.Load(argv[1])) {
+    fprintf(stderr, "can't load the track from %s\n", argv[1]);
+    return 1;
+  }
+  long settings[] = {6, 3};
+  for (int i = 2; i < argc; i++) {
+    settings[i - 2] = atol(argv[i]);
+    if (settings[i - 2] < (i == 2 ? 4 : 1)) {
+      return usage();
+    }
+  }
+  size_t window = settings[0], laps = settings[1];
+
+  double waypoints = slide("waypoints", track.Size(), window, laps, [&track](size_t i, double *x, double *y) {
+    *x = track.X(i);
+    *y = track.Y(i);
+  });
+  size_t n = static_cast<size_t>(track.Length() / kSpacing);
+  double resampled = slide("resampled", n, window, laps, [&track](size_t i, double *x, double *y) {
+    track.Point(i * kSpacing, x, y);
+  });
+  bool agree = waypoints < kTolerance && resampled < kTolerance;
+  printf("%s\n", agree ? "sliding and fresh fits agree" : "sliding and fresh fits DIFFER");
+  timeCarFrame(track, window);
+  return agree ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+// Queries cycle archives written by the controller with MPC_ARCHIVE (format in ArchiveFormat.h).
+//
+//   mpc_query ARCHIVE info                           columns, rows, blocks, time range
+//   mpc_query ARCHIVE percentiles COLUMN [P ...]     percentiles of a column (default 50 90 99 99.9)
+//   mpc_query ARCHIVE slow COLUMN THRESHOLD          cycles whose COLUMN exceeds THRESHOLD
+//   mpc_query ARCHIVE slice FROM TO [SESSION]        all columns of the cycles between two unix times (s), as CSV
+//
+// The archive is memory-mapped and only the columns a query needs are decoded; blocks whose min/max rule them out
+// are skipped without decoding anything.
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "ArchiveFormat.h"
+
+using namespace std;
+
+static int usage() {
+  fprintf(stderr,
+          "usage: mpc_query ARCHIVE info\n"
+          "       mpc_query ARCHIVE percentiles COLUMN [P ...]\n"
+          "       mpc_query ARCHIVE slow COLUMN THRESHOLD\n"
+          "       mpc_query ARCHIVE slice FROM TO [SESSION]\n");
+  return 2;
+}
+
+static int column(const ArchiveReader &archive, const string &name) {
+  int c = archive.ColumnIndex(name);
+  if (c < 0) {
+    fprintf(stderr, "no column %s\n", name.c_str());
+    exit(1);
+  }
+  return c;
+}
+
+static int info(const ArchiveReader &archive) {
+  size_t rows = 0;
+  for (const ArchiveReader::Block &block : archive.blocks) {
+    rows += block.rows;
+  }
+  printf("%zu rows in %zu blocks%s\n", rows, archive.blocks.size(), archive.indexed ? "" : " (no index, recovered)");
+  if (!archive.blocks.empty()) {
+    printf("time %.3f to %.3f\n", archive.blocks.front().min[0] / 1e9, archive.blocks.back().max[0] / 1e9);
+  }
+  for (const ArchiveColumn &c : archive.columns) {
+    printf("  %s (%s)\n", c.name.c_str(), c.type == kArchiveInt ? "int" : "double");
+  }
+  return 0;
+}
+
+static int percentiles(const ArchiveReader &archive, const string &name, vector<double> ps) {
+  int c = column(archive, name);
+  if (ps.empty()) {
+    ps = {50, 90, 99, 99.9};
+  }
+  vector<double> all, values;
+  for (size_t b = 0; b < archive.blocks.size(); b++) {
+    if (!archive.Doubles(b, c, &values)) {
+      fprintf(stderr, "block %zu is corrupt\n", b);
+      continue;
+    }
+    for (double v : values) {
+      if (!isnan(v)) {
+        all.push_back(v);
+      }
+    }
+  }
+  if (all.empty()) {
+    printf("no values\n");
+    return 0;
+  }
+  printf("%zu values\n", all.size());
+  for (double p : ps) {
+    size_t k = min(all.size() - 1, static_cast<size_t>(p / 100 * all.size()));
+    nth_element(all.begin(), all.begin() + k, all.end());
+    printf("p%g %g\n", p, all[k]);
+  }
+  return 0;
+}
+
+static int slow(const ArchiveReader &archive, const string &name, double threshold) {
+  int c = column(archive, name);
+  int time = column(archive, "time_ns");
+  int session = column(archive, "session");
+  vector<double> values;
+  vector<int64_t> times, sessions;
+  size_t count = 0;
+  printf("time_ns,session,%s\n", name.c_str());
+  for (size_t b = 0; b < archive.blocks.size(); b++) {
+    if (!(archive.blocks[b].max[c] > threshold)) {
+      continue;
+    }
+    if (!archive.Doubles(b, c, &values) || !archive.Ints(b, time, &times) || !archive.Ints(b, session, &sessions)) {
+      fprintf(stderr, "block %zu is corrupt\n", b);
+      continue;
+    }
+    for (size_t i = 0; i < values.size(); i++) {
+      if (values[i] > threshold) {
+        printf("%lld,%lld,%g\n", static_cast<long long>(times[i]), static_cast<long long>(sessions[i]), values[i]);
+        count++;
+      }
+    }
+  }
+  fprintf(stderr, "%zu cycles\n", count);
+  return 0;
+}
+
+static int slice(const ArchiveReader &archive, double from, double to, long long only_session) {
+  int64_t from_ns = from * 1e9, to_ns = to * 1e9;
+  int time = column(archive, "time_ns");
+  int session = column(archive, "session");
+  size_t n = archive.columns.size();
+  for (size_t c = 0; c < n; c++) {
+    printf("%s%s", c ? "," : "", archive.columns[c].name.c_str());
+  }
+  printf("\n");
+  vector<vector<int64_t>> ints(n);
+  vector<vector<double>> doubles(n);
+  for (size_t b = 0; b < archive.blocks.size(); b++) {
+    const ArchiveReader::Block &block = archive.blocks[b];
+    if (block.max[time] < from_ns || block.min[time] > to_ns) {
+      continue;
+    }
+    bool ok = true;
+    for (size_t c = 0; ok && c < n; c++) {
+      ok = (archive.columns[c].type == kArchiveInt) ? archive.Ints(b, c, &ints[c]) : archive.Doubles(b, c, &doubles[c]);
+    }
+    if (!ok) {
+      fprintf(stderr, "block %zu is corrupt\n", b);
+      continue;
+    }
+    for (size_t i = 0; i < block.rows; i++) {
+      if (ints[time][i] < from_ns || ints[time][i] > to_ns || (only_session >= 0 && ints[session][i] != only_session)) {
+        continue;
+      }
+      for (size_t c = 0; c < n; c++) {
+        if (archive.columns[c].type == kArchiveInt) {
+          printf("%s%lld", c ? "," : "", static_cast<long long>(ints[c][i]));
+        } else {
+          printf("%s%.17g", c ? "," : "", doubles[c][i]);
+        }
+      }
+      printf("\n");
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    return usage();
+  }
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  ArchiveReader archive;
+  if (!archive.Open(static_cast<const char *>(data), st.st_size)) {
+    fprintf(stderr, "%s is not an archive\n", argv[1]);
+    return 1;
+  }
+
+  string command = argv[2];
+  if (command == "info") {
+    return info(archive);
+  } else if (command == "percentiles" && argc >= 4) {
+    vector<double> ps;
+    for (int i = 4; i < argc; i++) {
+      ps.push_back(atof(argv[i]));
+    }
+    return percentiles(archive, argv[3], ps);
+  } else if (command == "slow" && argc == 5) {
+    return slow(archive, argv[3], atof(argv[4]));
+  } else if (command == "slice" && (argc == 5 || argc == 6)) {
+    return slice(archive, atof(argv[3]), atof(argv[4]), argc == 6 ? atoll(argv[5]) : -1);
+  }
+  return usage();
+}
@@ -0,0 +1,41 @@
+// Computes the reference speed profile of a track (see SpeedProfile.h) and prints it as the table the controller
+// loads with MPC_SPEED_PROFILE.
+//
+//   mpc_speed_profile TRACK [MAX_SPEED [LATERAL [ACCEL [DECEL [SPACING]]]]] > profile.csv
+//
+// TRACK is a waypoint file like lake_track_waypoints.csv, MAX_SPEED is in mph (default 60), LATERAL, ACCEL and DECEL
+// are the lateral, acceleration and braking limits in m/s^2 (defaults 8, 3, 6), SPACING is in m (default 2).
+#include <stdio.h>
+#include <stdlib.h>
+#include "SpeedProfile.h"
+#include "Track.h"
+
+static int usage() {
+  fprintf(stderr, "usage: mpc_speed_profile TRACK [MAX_SPEED [LATERAL [ACCEL [DECEL [SPACING]]]]]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 7) {
+    return usage();
+  }
+  Track track;
+  if (!track.Load(argv[1])) {
+    fprintf(stderr, "can't load the track from %s\n", argv[1]);
+    return 1;
+  }
+  SpeedLimits limits;
+  double spacing = 2;
+  double *settings[] = {&limits.max_speed, &limits.lateral_accel, &limits.accel, &limits.decel, &spacing};
+  for (int i = 2; i < argc; i++) {
+    *settings[i - 2] = atof(argv[i]);
+    if (*settings[i - 2] <= 0) {
+      return usage();
+    }
+  }
+  SpeedProfile profile;
+  profile.Compute(track, limits, spacing);
+  fputs(profile.Csv().c_str(), stdout);
+  fprintf(stderr, "%zu samples every %.3f m over %.1f m\n", profile.Size(), profile.Spacing(), track.Length());
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Benchmarks the timers of many concurrent sessions on the timer wheel (see TimerWheel.h), against an ordered map of
+// deadlines.
+//
+//   mpc_timer_bench [SESSIONS [SECONDS [LATENCY_MS]]]
+//
+// Every simulated session (10000 by default) runs the controller's cycle in simulated 1 ms ticks for SECONDS
+// (default 60): on telemetry it reschedules its idle timeout (10 s), schedules the delayed reply after LATENCY_MS
+// (default 100) and a deadline check 50 ms after that; the reply cancels the deadline check, and the next telemetry
+// comes 10 to 30 ms later. All the timer work of a simulated second is timed, which is what the event loop would
+// spend on timers in a real one.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include "TimerWheel.h"
+
+using namespace std;
+
+// The obvious alternative: deadlines in an ordered map, O(log n) to schedule and cancel.
+class MapTimers {
+ public:
+  typedef uint64_t Handle;
+
+  MapTimers() : current(0), next_handle(1) {}
+
+  Handle Schedule(uint64_t delay, function<void()> fn) {
+    Handle handle = next_handle++;
+    handles[handle] = timers.insert(make_pair(current + (delay > 0 ? delay : 1), make_pair(handle, move(fn))));
+    return handle;
+  }
+
+  bool Cancel(Handle handle) {
+    auto it = handles.find(handle);
+    if (it == handles.end()) {
+      return false;
+    }
+    timers.erase(it->second);
+    handles.erase(it);
+    return true;
+  }
+
+  size_t Advance(uint64_t now) {
+    current = now;
+    size_t fired = 0;
+    while (!timers.empty() && timers.begin()->first <= now) {
+      function<void()> fn = move(timers.begin()->second.second);
+      handles.erase(timers.begin()->second.first);
+      timers.erase(timers.begin());
+      fn();
+      fired++;
+    }
+    return fired;
+  }
+
+  size_t Size() const { return timers.size(); }
+
+ private:
+  typedef multimap<uint64_t, pair<Handle, function<void()> > > Timers;
+  uint64_t current;
+  Handle next_handle;
+  Timers timers;
+  unordered_map<Handle, Timers::iterator> handles;
+};
+
+struct Result {
+  double seconds;  // wall time of all the timer work
+  size_t schedules;
+  size_t cancels;
+  size_t fired;
+  size_t peak;  // most timers pending at once
+  double worst_tick;  // longest simulated tick (s)
+};
+
+template <class Timers>
+static Result run(size_t n_sessions, uint64_t ticks, uint64_t latency) {
+  const uint64_t kIdleTimeout = 10000;
+  const uint64_t kDeadline = 50;
+  struct SimSession {
+    typename Timers::Handle idle, deadline;
+  };
+  Timers timers;
+  vector<SimSession> sessions(n_sessions);
+  Result result = Result();
+  unsigned seed = 1;
+  auto jitter = [&seed](uint64_t range) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % range;
+  };
+
+  function<void(size_t)> telemetry = [&](size_t s) {
+    SimSession &session = sessions[s];
+    if (session.idle != 0 && timers.Cancel(session.idle)) {
+      result.cancels++;
+    }
+    session.idle = timers.Schedule(kIdleTimeout, [] {});
+    session.deadline = timers.Schedule(latency + kDeadline, [] {});
+    timers.Schedule(latency, [&, s] {
+      if (timers.Cancel(sessions[s].deadline)) {
+        result.cancels++;
+      }
+      result.schedules++;
+      timers.Schedule(10 + jitter(20), [&, s] { telemetry(s); });
+    });
+    result.schedules += 3;
+  };
+
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  for (size_t s = 0; s < n_sessions; s++) {
+    sessions[s].idle = 0;
+    result.schedules++;
+    timers.Schedule(1 + jitter(latency), [&, s] { telemetry(s); });
+  }
+  for (uint64_t tick = 1; tick <= ticks; tick++) {
+    chrono::steady_clock::time_point before = chrono::steady_clock::now();
+    result.fired += timers.Advance(tick);
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - before).count();
+    result.worst_tick = elapsed > result.worst_tick ? elapsed : result.worst_tick;
+    result.peak = timers.Size() > result.peak ? timers.Size() : result.peak;
+  }
+  result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+static void report(const char *name, const Result &r, uint64_t ticks) {
+  size_t ops = r.schedules + r.cancels + r.fired;
+  printf("%-6s %9.3f s  %12zu ops  %7.1f ns/op  %8.1f us/simulated s  worst tick %7.1f us  peak %zu timers\n", name,
+         r.seconds, ops, 1e9 * r.seconds / ops, 1e6 * r.seconds / (ticks / 1000.0), 1e6 * r.worst_tick, r.peak);
+}
+
+static int usage() {
+  fprintf(stderr, "usage: mpc_timer_bench [SESSIONS [SECONDS [LATENCY_MS]]]\n");
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 4) {
+    return usage();
+  }
+  long settings[] = {10000, 60, 100};
+  for (int i = 1; i < argc; i++) {
+    settings[i - 1] = atol(argv[i]);
+    if (settings[i - 1] <= 0) {
+      return usage();
+    }
+  }
+  size_t n_sessions = settings[0];
+  uint64_t ticks = settings[1] * 1000;
+  uint64_t latency = settings[2];
+  printf("%zu sessions, %lu simulated s, %lu ms latency\n", n_sessions, settings[1], settings[2]);
+  report("wheel", run<TimerWheel>(n_sessions, ticks, latency), ticks);
+  report("map", run<MapTimers>(n_sessions, ticks, latency), ticks);
+  return 0;
+}